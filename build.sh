@@ -1,12 +1,26 @@
-# Windows + MinGW
+# Windows + MinGW, or anything with gcc
+#   ./build.sh         debug build, then run an example
+#   ./build.sh bench   optimized build, then run the benchmarks into bin/bench
 name="story"
 src="src/main.c"
-opt="-O0"
-etc="-std=c99 -pedantic -Wall -Wextra"
+etc="-std=c99 -pedantic -Wall -Wextra -pthread"
 
-# build
-gcc $src $opt $etc -o bin/$name &&
+mkdir -p bin
 
-# run
-cd bin && ./$name run "data/test.story" && cd ..
+if [ "$1" = "bench" ]; then
 
+    # build
+    gcc $src -O2 $etc -o bin/$name &&
+
+    # run
+    cd bin && ./$name bench bench && cd ..
+
+else
+
+    # build
+    gcc $src -O0 $etc -o bin/$name &&
+
+    # run
+    cd bin && ./$name run "../examples/basic.story" && cd ..
+
+fi
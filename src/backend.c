@@ -1,11 +1,79 @@
 /* ==== Utils ==== */
 
+// if set, errors jump here instead of exiting, so we can keep going with what we had (see story_reload())
+jmp_buf* error_trap;
+
+void hard_exit() {
+    if (error_trap) longjmp(*error_trap, 1);
+    exit(1);
+}
+
+/*
+    With story check, errors are kept here instead of printed, and the check goes on from the next scene
+    (see story_check()), so one run finds all of them. The messages are in the arena.
+*/
+
+typedef struct {
+    u64    file;
+    u64    line;      // 0 if the error is not at a line
+    char*  kind;      // a short name, like "missing-link"
+    String label;     // of the scene it's in, empty if it's not in one
+    String message;
+    u64    order;     // so the errors on the same line stay in the order we found them
+} Diagnostic;
+
+typedef struct {
+    Diagnostic* data;
+    u64         count;
+    u64         allocated;
+    Arena       arena;
+    String      label;    // of the scene we are checking
+} Diagnostics;
+
+Diagnostics* diagnostics;
+
+// message is in the arena
+void diagnostics_add(u64 file, u64 line, char* kind, String message) {
+    
+    Diagnostics* d = diagnostics;
+    
+    if (d->count == d->allocated) {
+        u64         wanted = d->allocated ? d->allocated * 2 : 256;
+        Diagnostic* data   = memory_realloc(memory_check, d->data, wanted * sizeof(Diagnostic));
+        if (!data) return; // we still have the ones before
+        d->data      = data;
+        d->allocated = wanted;
+    }
+    
+    message = string_trim_any_u8_from_end(message, string(", \n"));
+    d->data[d->count] = (Diagnostic) { file, line, kind, d->label, message, d->count };
+    d->count++;
+}
+
 void hard_error(char* s, ...) {
+    
     va_list va;
     va_start(va, s);
-    printf("Error: ");
-    vprintf(s, va);
-    exit(1);
+    
+    if (diagnostics) {
+        
+        va_list copy;
+        va_copy(copy, va);
+        int count = vsnprintf(NULL, 0, s, copy);
+        va_end(copy);
+        
+        char* data = count > 0 ? arena_alloc(&diagnostics->arena, count + 1) : NULL;
+        if (data) vsnprintf(data, count + 1, s, va);
+        diagnostics_add(0, 0, "fatal", (String) { (u8*) data, data ? (u64) count : 0 });
+    
+    } else {
+        
+        printf("Error: ");
+        vprintf(s, va);
+    }
+    
+    va_end(va);
+    hard_exit();
 }
 
 
@@ -44,7 +112,7 @@ void print_table(HashTable table) {
         if (it->occupied) {
             printf("[%.8x] ", it->hash);
             print(string("[@]\n"), it->key);
-            debug_print_scene(&it->value);
+            debug_print_scene(&table.values[i]);
         }
         printf("\n");
     }
@@ -52,6 +120,30 @@ void print_table(HashTable table) {
     printf("\n");
 }
 
+void print_table_stats(HashTable* table) {
+    
+    TableStats stats = table_get_stats(table);
+    
+    printf("Slots:     %llu, %llu used (%.1f%%, grows at %.0f%%)\n", table->size, table->entry_count, 100.0 * table->entry_count / table->size, 100.0 * table->load_factor);
+    printf("Seed:      %u, rehashed %llu times, %llu of them for a new seed\n", table->seed, table->rehash_count, table->reseed_count);
+    printf("Hit:       %.2f slots on average, %llu at most\n", stats.hit_mean, stats.hit_max);
+    printf("Miss:      %.2f slots on average, %llu at most\n", stats.miss_mean, stats.miss_max);
+    printf("Clusters:  %llu, %.2f slots on average, %llu at most\n", stats.cluster_count, stats.cluster_mean, stats.cluster_max);
+    
+    printf("\nProbe length of hits:\n");
+    for (u64 i = 0; i < table_histogram_count; i++) {
+        if (!stats.hit_histogram[i]) continue;
+        printf("%4llu%s %10llu\n", i + 1, i + 1 == table_histogram_count ? "+" : " ", stats.hit_histogram[i]);
+    }
+    
+    char* buckets[] = { "1", "2-3", "4-7", "8-15", "16-31", "32+" };
+    printf("\nCluster sizes:\n");
+    for (u64 i = 0; i < count_of(buckets); i++) {
+        if (!stats.cluster_histogram[i]) continue;
+        printf("%5s %10llu\n", buckets[i], stats.cluster_histogram[i]);
+    }
+}
+
 
 
 
@@ -89,14 +181,286 @@ u8 language_table_get_index(LanguageTable* table, String s, u64* index_out) {
 
 /* ==== Story ==== */
 
+/* ---- Scene Cache ---- */
+
+/*
+    For stories that are too big to keep in memory: the scene table only has the labels (see table_init_keys()),
+    and each slot only has where its scene is. A scene is read from its file and parsed when we need it,
+    and kept in an LRU list until the scenes take more than max_resident bytes,
+    which counts the Scene, its code and segments, and its source.
+*/
+
+#define scene_cache_none 0xffffffff
+
+typedef struct {
+    u64 file;
+    u64 offset;  // of the source in the file
+    u64 count;   // of the source
+    u64 line;    // of the label, 0 if the label is not defined
+} SceneSlot;
+
+typedef struct {
+    u64        max_resident;  // in bytes
+    u64        resident;
+    SceneSlot* slots;         // per slot
+    Scene**    scenes;        // per slot, NULL if it's not in memory
+    u32*       prev;          // per slot, the LRU list, most recently used at head
+    u32*       next;
+    u32        head;
+    u32        tail;
+    Scene      undefined;     // what a slot with no scene gives, like the quit label when the story doesn't define it
+} SceneCache;
+
+SceneCache* scene_cache_init(u64 max_resident) {
+    SceneCache* cache = calloc(1, sizeof(SceneCache));
+    if (!cache) hard_error("Out of memory when setting up the scene cache.\n");
+    cache->max_resident = max_resident;
+    cache->head         = scene_cache_none;
+    cache->tail         = scene_cache_none;
+    cache->undefined    = (Scene) { .parsed = 1 };
+    return cache;
+}
+
+// once the slots stop moving
+void scene_cache_set_slot_count(SceneCache* cache, u64 count) {
+    
+    assert(count < scene_cache_none);
+    cache->slots  = memory_calloc(memory_table, count, sizeof(SceneSlot));
+    cache->scenes = memory_calloc(memory_table, count, sizeof(Scene*));
+    cache->prev   = memory_alloc(memory_table, count * sizeof(u32));
+    cache->next   = memory_alloc(memory_table, count * sizeof(u32));
+    if (!cache->slots || !cache->scenes || !cache->prev || !cache->next) hard_error("Out of memory when setting up the scene cache.\n");
+}
+
+// what a resident scene counts for max_resident
+u64 scene_cache_size(Scene* scene) {
+    return sizeof(Scene) + scene->code_count * sizeof(Instruction) + scene->segment_count * sizeof(TextSegment) + scene->source.count;
+}
+
+// frees the scenes and the slots, the cache can have its slots set again for the next parse
+void scene_cache_clear(SceneCache* cache, u64 count) {
+    
+    for (u64 i = 0; cache->scenes && i < count; i++) {
+        Scene* scene = cache->scenes[i];
+        if (!scene) continue;
+        memory_free(scene->source.data);
+        scene_free_script(scene);
+        memory_free(scene);
+    }
+    
+    memory_free(cache->slots);
+    memory_free(cache->scenes);
+    memory_free(cache->prev);
+    memory_free(cache->next);
+    
+    *cache = (SceneCache) {
+        .max_resident = cache->max_resident,
+        .head         = scene_cache_none,
+        .tail         = scene_cache_none,
+        .undefined    = { .parsed = 1 },
+    };
+}
+
+void scene_cache_unlink(SceneCache* cache, u32 index) {
+    
+    u32 prev = cache->prev[index];
+    u32 next = cache->next[index];
+    
+    if (prev != scene_cache_none) cache->next[prev] = next;
+    else                          cache->head       = next;
+    if (next != scene_cache_none) cache->prev[next] = prev;
+    else                          cache->tail       = prev;
+}
+
+void scene_cache_push_front(SceneCache* cache, u32 index) {
+    
+    cache->prev[index] = scene_cache_none;
+    cache->next[index] = cache->head;
+    
+    if (cache->head != scene_cache_none) cache->prev[cache->head] = index;
+    else                                 cache->tail              = index;
+    cache->head = index;
+}
+
+
+
+
+/* ---- Stream Labels ---- */
+
+/*
+    A story from a pipe is parsed one scene at a time and then dropped (see stream.c), so a link can go to a label
+    we haven't read yet. What we keep instead of the scenes is this: an id for each label, in the order we first see them,
+    and where the first link to it is, so the links can all be checked when the stream ends.
+*/
+
+typedef struct {
+    u64    id;
+    u8     defined;
+    u64    file;      // of the first link to it, the line is 0 if there is none yet
+    u64    line;
+    String from;      // the label of the scene with that link
+} StreamLabel;
+
+Define_HashMap(String, StreamLabel);
+
+typedef HashMapEntry(String, StreamLabel) StreamLabelEntry;
+
+typedef struct {
+    HashMap(String, StreamLabel) map;
+    Arena                        keys;          // the labels are copied here, the input they come from doesn't stay
+    u64                          count;
+    String                       scene_label;   // of the scene we are parsing, for the links it has
+} StreamLabels;
+
+StreamLabels stream_labels_init() {
+    return (StreamLabels) {
+        .map  = hash_map(String, StreamLabel, init)(1024, 0.7, memory_table),
+        .keys = { .tag = memory_parse },
+    };
+}
+
+void stream_labels_free(StreamLabels* labels) {
+    hash_map(String, StreamLabel, free)(&labels->map);
+    arena_free(&labels->keys);
+}
+
+// adds the label if we haven't seen it, key_out is our copy of it
+StreamLabel* stream_labels_get(StreamLabels* labels, String label, String* key_out) {
+    
+    HashMapEntry(String, StreamLabel)* entry = hash_map(String, StreamLabel, get_entry)(&labels->map, label);
+    if (entry) {
+        if (key_out) *key_out = entry->key;
+        return &entry->value;
+    }
+    
+    String key = { arena_alloc(&labels->keys, label.count), label.count };
+    if (label.count && !key.data) hard_error("Out of memory for the labels.\n");
+    memcpy(key.data, label.data, label.count);
+    
+    StreamLabel* it = hash_map(String, StreamLabel, put)(&labels->map, key, (StreamLabel) { .id = labels->count++ });
+    if (!it) hard_error("Out of memory for the labels.\n");
+    
+    if (key_out) *key_out = key;
+    return it;
+}
+
+// gives the id a link goes to, and keeps where it is if it's the first link to a label we don't have yet
+u64 stream_labels_link(StreamLabels* labels, String label, u64 file, u64 line) {
+    StreamLabel* it = stream_labels_get(labels, label, NULL);
+    if (!it->defined && !it->line) {
+        it->file = file;
+        it->line = line;
+        it->from = labels->scene_label;
+    }
+    return it->id;
+}
+
+
+
+
+/* ---- Story ---- */
+
+/*
+    A story is one file with the header, and the files it includes. 
+    An included file has no header, only scenes, and labels can link across files.
+*/
+
+typedef struct {
+    char*     name;      // as we open it, includes are relative to the directory of the first file
+    String    data;      // the whole file, all String views of its scenes point into this (empty with a scene cache)
+    FILE*     stream;    // only with a scene cache
+    LineIndex lines;     // built when the file is loaded, errors get their line from it
+} StoryFile;
+
 typedef struct {
     HashTable     scene_table;
     LanguageTable lang_table;
+    VariableTable var_table;
     String        start_label;
     String        quit_label;
+    u64           quit_index;       // slot of the quit label, valid after parsing
+    StoryFile*    files;            // files[0] has the header
+    u64           file_count;
+    u64           body_offset;      // where the header ends in files[0]
+    u8*           staged_defined;   // only during story_reload(), per slot, if the new file defines it
+    SceneCache*   cache;            // NULL if the whole file is in memory, see story_enable_scene_cache()
+    u64           content_hash;     // computed on demand, see story_get_content_hash()
+    u8            has_content_hash;
+    u8            parse_cache;      // set before parse_file_to_story() to use the parse cache (--parse-cache), see story_parse_all()
+    StreamLabels* stream;           // only for a story we read from a pipe, then links are ids from this, see stream.c
 } Story;
 
+// call this before parse_file_to_story() to keep at most max_resident bytes of parsed scenes in memory
+void story_enable_scene_cache(Story* story, u64 max_resident) {
+    story->cache = scene_cache_init(max_resident);
+}
+
+// what parse_file_to_story() allocated, so we can parse again, the name of the first file is the caller's
+void story_free(Story* story) {
+    
+    HashTable* table = &story->scene_table;
+    if (story->cache) scene_cache_clear(story->cache, table->size);
+    else              for (u64 i = 0; i < table->size; i++) scene_free_script(&table->values[i]);
+    table_free(table);
+    
+    for (u64 i = 0; i < story->file_count; i++) {
+        StoryFile* it = &story->files[i];
+        memory_free(it->data.data);
+        line_index_free(&it->lines);
+        if (it->stream) fclose(it->stream);
+        if (i)          free(it->name);
+    }
+    
+    free(story->files);
+}
+
+// fnv1a 64, same as get_hash_fnv1a_64() but in chunks
+u64 get_stream_hash_fnv1a_64(FILE* f) {
+    
+    fseek(f, 0, SEEK_SET);
+    
+    u8  chunk[65536];
+    u64 hash = 0xcbf29ce484222325;
+    while (1) {
+        u64 count = fread(chunk, 1, sizeof(chunk), f);
+        if (!count) break;
+        for (u64 i = 0; i < count; i++) {
+            hash ^= (u64) chunk[i];
+            hash *= 0x100000001b3;
+        }
+    }
+    
+    return hash;
+}
+
+// with one file, this is just the hash of the file
+u64 story_get_content_hash(Story* story) {
+    
+    if (story->has_content_hash) return story->content_hash;
+    
+    u64 hash = 0;
+    for (u64 i = 0; i < story->file_count; i++) {
+        
+        StoryFile* file = &story->files[i];
+        u64 file_hash = file->stream ? get_stream_hash_fnv1a_64(file->stream) : get_hash_fnv1a_64(file->data);
+        
+        hash = i ? (hash ^ file_hash) * 0x100000001b3 : file_hash;
+    }
+    
+    story->content_hash     = hash;
+    story->has_content_hash = 1;
+    
+    return story->content_hash;
+}
 
+// parallel on files, unless errors need to jump back to error_trap, which can't happen from another thread
+void story_for_each_file(Story* story, ParallelFunction* f, void* data) {
+    if (story->cache || error_trap || story->file_count < 2) {
+        for (u64 i = 0; i < story->file_count; i++) f(data, i);
+    } else {
+        run_parallel(f, data, story->file_count);
+    }
+}
 
 /* ---- Parsing ---- */
 
@@ -110,365 +474,2146 @@ String string_strip_label(String s) {
     return string_view(s, 1, s.count - 1);
 }
 
-// todo: cleanup
-// todo: make this return error code instead of hard exiting?
-// todo: better error messages
-void parse_file_to_story(char* file_name, Story* story) {
+// if a slot is something we can link to, a slot can stay in the table after its label is removed (see story_reload())
+u8 story_is_defined(Story* story, u64 index) {
+    if (index == story->quit_index) return 1;
+    if (story->staged_defined)      return story->staged_defined[index];
+    if (story->cache)               return story->cache->slots[index].line != 0;
+    return story->scene_table.values[index].line != 0;
+}
+
+// ends an error message with where it is, the file name is only there when the story has includes
+void hard_error_location(Story* story, u64 file, u64 line) {
+    if (story->file_count > 1) printf("at line %llu of \"%s\".\n", line, story->files[file].name);
+    else                       printf("at line %llu.\n", line);
+    hard_exit();
+}
+
+// the line of a String view into the source of a scene,
+// with a scene cache the source is a copy of the body, so this goes by the offset of the body in the file
+u64 scene_get_line(Story* story, Scene* scene, String s) {
+    return line_index_get_line(&story->files[scene->file].lines, scene->offset + (u64) (s.data - scene->source.data));
+}
+
+// an error at a line of the story, the message is like print() and ends where the location goes,
+// with story check it's kept, and a soft error returns so the caller can go on from it, the others jump to error_trap
+void story_error_va(Story* story, u64 file, u64 line, char* kind, u8 soft, String format, va_list args) {
     
+    if (diagnostics) {
+        
+        va_list copy;
+        va_copy(copy, args);
+        u64 count = format_va(NULL, 0, format, copy);
+        va_end(copy);
+        
+        u8* data = arena_alloc(&diagnostics->arena, count);
+        if (data) format_va(data, count, format, args);
+        diagnostics_add(file, line, kind, (String) { data, data ? count : 0 });
+        
+        if (!soft) hard_exit();
+        return;
+    }
+    
+    printf("Error: ");
+    print_va(format, args);
+    hard_error_location(story, file, line);
+}
 
-    /* ---- Load file and init hash table ---- */ 
+void story_error(Story* story, u64 file, u64 line, char* kind, String format, ...) {
+    va_list args;
+    va_start(args, format);
+    story_error_va(story, file, line, kind, 0, format, args);
+    va_end(args);
+}
+
+// only returns with story check
+void story_soft_error(Story* story, u64 file, u64 line, char* kind, String format, ...) {
+    va_list args;
+    va_start(args, format);
+    story_error_va(story, file, line, kind, 1, format, args);
+    va_end(args);
+}
+
+// the header is parsed before story->files is there, so this takes the lines of the first file
+void header_error(Story* story, LineIndex* lines, u64 offset, String format, ...) {
+    va_list args;
+    va_start(args, format);
+    story_error_va(story, 0, line_index_get_line(lines, offset), "header", 0, format, args);
+    va_end(args);
+}
+
+// invalid is from utf8_find_invalid(), before is its line up to it, with it
+void utf8_error(Story* story, u64 file, LineIndex* lines, u64 invalid, String before) {
+    
+    // everything before the byte is valid, so the column can count characters, which is what an editor shows
+    char byte[8];
+    char column[24];
+    snprintf(byte,   sizeof(byte),   "0x%02X", before.data[before.count - 1]);
+    snprintf(column, sizeof(column), "%llu",   utf8_count_characters(string_view(before, 0, before.count - 1)) + 1);
+    
+    story_soft_error(story, file, line_index_get_line(lines, invalid), "invalid-utf8", string("Invalid UTF-8, byte @ in column @, "), c_string_to_string(byte), c_string_to_string(column));
+}
+
+// the file can be one that is not in story->files yet, like in header_error()
+void utf8_error_in_file(Story* story, u64 file, StoryFile* it, u64 invalid) {
+    
+    u64 start = line_index_get_line_start(&it->lines, invalid);
+    
+    if (it->data.data) {
+        utf8_error(story, file, &it->lines, invalid, string_view(it->data, start, invalid + 1));
+        return;
+    }
+    
+    String before = { memory_alloc(memory_parse, invalid - start + 1), invalid - start + 1 };
+    if (!before.data) hard_error("Out of memory when reading \"%s\".\n", it->name);
     
-    String file = load_file(file_name);
-    if (!file.count) hard_error("Cannot open file \"%s\".\n", file_name);
+    fseek(it->stream, start, SEEK_SET);
+    before.count = fread(before.data, 1, before.count, it->stream);
+    fseek(it->stream, 0, SEEK_SET);
     
-    story->scene_table = table_init(256, 0.7, get_hash_fnv1a);
+    utf8_error(story, file, &it->lines, invalid, before);
+    memory_free(before.data);
+}
 
+// at the line of s, a String view into the source of the scene
+void scene_error(Story* story, Scene* scene, String s, char* kind, String format, ...) {
+    va_list args;
+    va_start(args, format);
+    story_error_va(story, scene->file, scene_get_line(story, scene, s), kind, 0, format, args);
+    va_end(args);
+}
 
-    /* ---- Init ---- */ 
+void scene_soft_error(Story* story, Scene* scene, String s, char* kind, String format, ...) {
+    va_list args;
+    va_start(args, format);
+    story_error_va(story, scene->file, scene_get_line(story, scene, s), kind, 1, format, args);
+    va_end(args);
+}
 
-    HashTable*     table      = &story->scene_table;
-    LanguageTable* lang_table = &story->lang_table;
+// a label line is only a label and spaces
+u8 line_get_label(String line, String* label_out) {
+    
+    // fast path: most lines are text, and a label line must start with '[' after spaces
+    u64 i = 0;
+    while (i < line.count && (line.data[i] == ' ' || line.data[i] == '\t')) i++;
+    if (i == line.count || line.data[i] != '[') return 0;
+    
+    String label = string_trim_spaces(line);
+    if (!string_is_label(label)) return 0;
+    
+    *label_out = string_strip_label(label);
+    return 1;
+}
+
+// the lines before the first label of a file can only be blank lines or comments
+void check_before_first_label(Story* story, u64 file, LineReader* reader, String line) {
     
-    String walk = file;
-    u64 line_count = 0;
+    u64 i = 0;
+    while (i < line.count && (line.data[i] == ' ' || line.data[i] == '\t')) i++;
+    if (i == line.count || line.data[i] == '#') return;
+    
+    u64 line_number = line_index_get_line(&story->files[file].lines, reader->line_offset);
+    story_soft_error(story, file, line_number, "invalid-label", string("Invalid label "));
+}
 
+// gives the next label line without the brackets
+u8 scan_next_label(Story* story, u64 file, LineReader* reader, u8 is_first, String* label_out) {
 
-    /* ---- Header ---- */ 
+    String line;
+    while (line_reader_next(reader, &line)) {
+        if (line_get_label(line, label_out)) return 1;
+        if (is_first) check_before_first_label(story, file, reader, line);
+    }
+    
+    return 0;
+}
 
-    u8 has_language = 0;    
-    u8 has_start    = 0;
-    u8 has_quit     = 0;
+// parses scene->source, which is everything between the label line and the next label line
+// note: a soft error only returns with story check, then we skip the line (or the option) and go on
+void parse_scene(Story* story, Scene* scene) {
+
+    HashTable*     table      = &story->scene_table;
+    LanguageTable* lang_table = &story->lang_table;
+
+    String walk = scene->source;
     
+    ScriptCompiler script = { .variables = &story->var_table };
+
+    // label text
     while (walk.count) {
         
         String line = string_eat_line(&walk);
-        line_count++;
+
+        if (!line.count) break;
+        if (string_starts_with_u8(line, '#')) continue;
         
-        const String start = string("start:");
-        const String quit  = string("quit:");
+        String text = line;
+        String lang = string_eat_by_separator(&text, string(":"));
+
+        if (lang.count == line.count) {
+            scene_soft_error(story, scene, line, "invalid-text", string("Invalid label text "));
+            continue;
+        }
         
-        if (!line.count) continue;
-        if (string_starts_with_u8(line, '#')) continue;
+        text = string_trim_spaces(text);
         
-        if (string_starts_with(line, string("languages:"))) {
+        // is paragraph
+        if (!text.count) {
+            
+            const String delimiter = string("~~~");
+            u64 delimiter_count = 0;
+            
+            u8 paragraph_has_start = 0;
+            u8 paragraph_has_end   = 0;
+            
+            String start = {0};
+            String end   = {0};
 
+            
             while (walk.count) {
                 
                 String line = string_eat_line(&walk);
-                line_count++;
+
+                if (!line.count) continue;
                 
-                if (!line.count) break;
-               
-                if (string_starts_with_u8(line, '#')) continue;
+                line = string_trim_spaces(line);
+
+                if (string_equal(line, delimiter)) {
+                    delimiter_count++;
+                }
                 
-                String language = string_trim_spaces(line);
-                language_table_add(lang_table, language);
+                // todo: make these better
+                if (delimiter_count == 1 && !paragraph_has_start) {
+                    start = line;
+                    paragraph_has_start = 1;
+                }
+                
+                if (delimiter_count == 2) {
+                    end = line;
+                    paragraph_has_end = 1;
+                    break;
+                }
             }
-
-            has_language = 1;
-        
-        } else if (string_starts_with(line, start)) { 
             
-            String label = string_trim_spaces(string_advance(line, start.count));
-            if (!string_is_label(label)) {
-                hard_error("Invalid start label at line %llu.\n", line_count);
+            if (!paragraph_has_start || !paragraph_has_end) {
+                scene_error(story, scene, line, "invalid-paragraph", string("Invalid paragraph "));
             }
 
-            story->start_label = string_strip_label(label);
-
-            has_start = 1;
-        
-        } else if (string_starts_with(line, quit)) {
+            String range = { start.data, end.data - start.data };
+            string_eat_line(&range);
             
-            String label = string_trim_spaces(string_advance(line, quit.count));
-            if (!string_is_label(label)) {
-                hard_error("Invalid quit label at line %llu.\n", line_count);
-            }
-
-            label = string_strip_label(label);
-
-            story->quit_label = label;
+            // hack: these are to deal with print_scene() always print a new line
+            if (string_ends_with_u8(range, '\n')) range.count--;
+            if (string_ends_with_u8(range, '\r')) range.count--;
             
-            table_put(table, label, (Scene) {0}); // todo: this waste a slot
-            has_quit = 1;
-        
-        } else {
-        
-            hard_error("Invalid content at line %llu. A Story file must starts with a correct header!\n", line_count);
+            text = range;
         }
-        
-        if (has_language && has_start && has_quit) break;
-    }
-   
-    if (!has_language) hard_error("File \"%s\" does not contain a language list!\n", file_name);
-    if (!has_start)    hard_error("File \"%s\" does not contain a start label!\n", file_name);
-    if (!has_quit)     hard_error("File \"%s\" does not contain a quit label!\n", file_name);
-
-    
-
-    /* ---- first pass to put all labels into the hash table ---- */
-    
-    // todo: because we don't report error here when a label is invalid, this makes error messages not that good 
-    // (rely on later hash table look up error, which won't tell the location of the invalid label)
-    
-    for (String t = file; t.count;) {
 
-        String line = string_eat_line(&t);
-        if (!line.count) continue;
+        u64 index;
+        if (!language_table_get_index(lang_table, lang, &index)) {
+            scene_soft_error(story, scene, line, "unknown-language", string("Cannot find language \"@\" in language list, "), lang);
+            continue;
+        }
         
-        String label = string_trim_spaces(line);
-        if (!string_is_label(label)) continue;
-
-        table_put(table, string_strip_label(label), (Scene) {0});
-    }
-
-    if (!table_get_entry(table, story->start_label)) {
-        print(string("Error: File \"@\" does not contain the correct start label [@] specified in the header.\n"), c_string_to_string(file_name), story->start_label);
-        exit(1);
+        String* slot = &scene->text[index];
+        if (slot->count) {
+            scene_soft_error(story, scene, line, "redundant-text", string("Redundant text for language \"@\", "), lang);
+            continue;
+        }
+           
+        *slot = text;
+        if (text.count) scene->text_mask |= 1u << index;
     }
 
+    u64 option_acc = 0;
 
-
-    /* ---- Labels ---- */
-
+    // options
     while (walk.count) {
-
-
+        
         String line = string_eat_line(&walk);
-        line_count++;
 
-        if (!line.count) continue;
-        
-        String label = string_trim_spaces(line);
-        
+        if (!line.count) break;
         if (string_starts_with_u8(line, '#')) continue;
 
-        // this doesn't work, see comments for the first pass
-        if (!string_is_label(label)) {
-            hard_error("Invalid label at line %llu.\n", line_count);
+        String option = line;
+        String num = string_eat_by_separator(&option, string("."));
+        
+        u64 _;
+        if (num.count == line.count || !parse_u64(num, &_)) {
+            scene_soft_error(story, scene, line, "invalid-option", string("Invalid option "));
+            while (walk.count && string_eat_line(&walk).count) {} // the rest of the option
+            continue;
+        }
+        
+        option = string_trim_spaces(option);
+        if (!string_is_label(option)) {
+            scene_soft_error(story, scene, line, "invalid-option", string("Invalid option label "));
+            while (walk.count && string_eat_line(&walk).count) {}
+            continue;
+        }
+        
+        if (option_acc == count_of(scene->options)) {
+            scene_error(story, scene, line, "too-many-options", string("Too many options, a scene can have 8 at most, "));
         }
 
-        HashTableEntry* entry = table_get_entry(table, string_strip_label(label));
-        assert(entry != NULL);
-
-        Scene* scene = &entry->value;
+        option = string_strip_label(option);
 
-        // label text
+        u64 link_index;
+        if (story->stream) {
+            // the label can come later, the links are checked at the end, see stream_finish()
+            link_index = stream_labels_link(story->stream, option, scene->file, scene_get_line(story, scene, line));
+        } else if (!table_get_index(table, option, &link_index) || !story_is_defined(story, link_index)) {
+            u64 line_number = scene_get_line(story, scene, line);
+            story_soft_error(story, scene->file, line_number, "missing-link", string("Cannot find option label [@] in the whole file, "), option);
+            link_index = story->quit_index; // only with story check, so we can go on
+        }
+        
+        scene->options[option_acc].link       = option;
+        scene->options[option_acc].link_index = link_index;
+        
+        // option text
         while (walk.count) {
-            
-            String line = string_eat_line(&walk);
-            line_count++;
 
+            String line = string_eat_line(&walk);
+            
             if (!line.count) break;
             if (string_starts_with_u8(line, '#')) continue;
-            
+        
             String text = line;
             String lang = string_eat_by_separator(&text, string(":"));
 
             if (lang.count == line.count) {
-                hard_error("Invalid label text at line %llu.\n", line_count);
-            }
+                scene_soft_error(story, scene, line, "invalid-text", string("Invalid option text "));
+                continue;
+            } 
             
             text = string_trim_spaces(text);
             
-            u64 old_line_count = line_count;
-            
-            // is paragraph
-            if (!text.count) {
-                
-                const String delimiter = string("~~~");
-                u64 delimiter_count = 0;
+            // a condition or an effect, see script.c
+            u8 is_condition = string_equal(lang, string("if"));
+            if (is_condition || string_equal(lang, string("do"))) {
                 
-                u8 paragraph_has_start = 0;
-                u8 paragraph_has_end   = 0;
-                
-                String start = {0};
-                String end   = {0};
-
-                
-                while (walk.count) {
-                    
-                    String line = string_eat_line(&walk);
-                    line_count++;
-
-                    if (!line.count) continue;
-                    
-                    line = string_trim_spaces(line);
-
-                    if (string_equal(line, delimiter)) {
-                        delimiter_count++;
-                    }
-                    
-                    // todo: make these better
-                    if (delimiter_count == 1 && !paragraph_has_start) {
-                        start = line;
-                        paragraph_has_start = 1;
-                    }
-                    
-                    if (delimiter_count == 2) {
-                        end = line;
-                        paragraph_has_end = 1;
-                        break;
-                    }
-                }
+                Option* option = &scene->options[option_acc];
+                u16*    slot   = is_condition ? &option->condition : &option->effect;
                 
-                if (!paragraph_has_start || !paragraph_has_end) {
-                    hard_error("Invalid paragraph at line %llu.\n", old_line_count);
+                if (*slot) {
+                    String key = is_condition ? string("if") : string("do");
+                    scene_soft_error(story, scene, line, "redundant-script", string("Redundant \"@:\" for the option, "), key);
+                    continue;
                 }
-
-                String range = { start.data, end.data - start.data };
-                string_eat_line(&range);
                 
-                // hack: these are to deal with print_scene() always print a new line
-                if (string_ends_with_u8(range, '\n')) range.count--;
-                if (string_ends_with_u8(range, '\r')) range.count--;
+                *slot = is_condition ? script_compile_condition(&script, text) : script_compile_effect(&script, text);
                 
-                text = range;
+                if (script.error) {
+                    scene_soft_error(story, scene, line, "invalid-script", string("@ in \"@\", "), c_string_to_string(script.error), text);
+                    *slot        = 0;
+                    script.error = NULL;
+                }
+                continue;
             }
-
+            
             u64 index;
             if (!language_table_get_index(lang_table, lang, &index)) {
-                print(string("Error: Cannot find language \"@\" in language list, "), lang);
-                printf("at line %llu.\n", old_line_count);
-                exit(1);
+                scene_soft_error(story, scene, line, "unknown-language", string("Cannot find language \"@\" in language list, "), lang);
+                continue;
             }
             
-            String* slot = &scene->text[index];
+            String* slot = &scene->options[option_acc].text[index];
             if (slot->count) {
-                print(string("Error: Redundant text for language \"@\", "), lang);
-                printf("at line %llu.\n", old_line_count);
-                exit(1);
+                scene_soft_error(story, scene, line, "redundant-text", string("Redundant text for language \"@\", "), lang);
+                continue;
             }
-               
+
             *slot = text;
+            if (text.count) scene->options[option_acc].text_mask |= 1u << index;
         }
+        
+        option_acc++;
+    }
 
-        u64 option_acc = 0;
+    scene->option_count = option_acc;
+    scene->code         = script.code;
+    scene->code_count   = script.count;
+    
+    scene_split_templates(&story->var_table, scene);
 
-        // options
-        while (walk.count) {
-            
-            String line = string_eat_line(&walk);
-            line_count++;
+    // only blank lines and comments can be left before the next label
+    while (walk.count) {
+        
+        String line = string_eat_line(&walk);
+        
+        if (!line.count) continue;
+        if (string_starts_with_u8(line, '#')) continue;
 
-            if (!line.count) break;
-            if (string_starts_with_u8(line, '#')) continue;
+        scene_soft_error(story, scene, line, "invalid-label", string("Invalid label "));
+    }
+    
+    scene->parsed = 1;
+}
 
-            String option = line;
-            String num = string_eat_by_separator(&option, string("."));
-            if (num.count == line.count) {
-                hard_error("Invalid option at line %llu.\n", line_count);
-            } else {
-                u64 _;
-                if (!parse_u64(num, &_)) { 
-                    hard_error("Invalid option at line %llu.\n", line_count);
-                }
-            }
-            
-            option = string_trim_spaces(option);
-            if (!string_is_label(option)) {
-                hard_error("Invalid option label at line %llu.\n", line_count);
-            }
+// with a scene cache, the scene is read from its file and parsed, and it will stay until it's evicted
+Scene* scene_cache_load(Story* story, u64 index) {
+    
+    SceneCache* cache = story->cache;
+    SceneSlot*  slot  = &cache->slots[index];
+    if (!slot->line) return &cache->undefined;
+    
+    Scene* scene = memory_alloc(memory_file, sizeof(Scene));
+    u8*    data  = memory_alloc(memory_file, slot->count);
+    if (!scene || !data) story_error(story, slot->file, slot->line, "fatal", string("Out of memory when loading the scene "));
+    
+    FILE* stream = story->files[slot->file].stream;
+    fseek(stream, slot->offset, SEEK_SET);
+    if (fread(data, 1, slot->count, stream) != slot->count) {
+        story_error(story, slot->file, slot->line, "fatal", string("Cannot read the scene (did the file change?) "));
+    }
+    
+    *scene = (Scene) {
+        .source = { data, slot->count },
+        .file   = slot->file,
+        .offset = slot->offset,
+        .line   = slot->line,
+    };
+    parse_scene(story, scene);
+    
+    cache->scenes[index] = scene;
+    cache->resident     += scene_cache_size(scene);
+    scene_cache_push_front(cache, index);
+
+    // evict the least recently used, but never the one we just loaded
+    while (cache->resident > cache->max_resident && cache->tail != index) {
+        
+        u32    evicted_index = cache->tail;
+        Scene* evicted       = cache->scenes[evicted_index];
+        
+        scene_cache_unlink(cache, evicted_index);
+        cache->resident -= scene_cache_size(evicted);
+        memory_free(evicted->source.data);
+        scene_free_script(evicted);
+        memory_free(evicted);
+        cache->scenes[evicted_index] = NULL;
+    }
+    
+    return scene;
+}
+
+// gives the scene in the slot, parsing it first if we haven't
+// note: with a scene cache, the scene is only there until the next call
+Scene* story_get_scene(Story* story, u64 index) {
+    
+    SceneCache* cache = story->cache;
+    if (cache) {
+        Scene* scene = cache->scenes[index];
+        if (!scene) return scene_cache_load(story, index);
+        if (cache->head != index) {
+            scene_cache_unlink(cache, index);
+            scene_cache_push_front(cache, index);
+        }
+        return scene;
+    }
+    
+    Scene* scene = &story->scene_table.values[index];
+    if (!scene->parsed) parse_scene(story, scene);
+    return scene;
+}
+
+typedef struct {
+    u64 file;
+    u64 offset;
+    u64 index;
+} SceneOrder;
+
+// by file, then by offset in the file
+int compare_scene_order(const void* a, const void* b) {
+    SceneOrder* x = (SceneOrder*) a;
+    SceneOrder* y = (SceneOrder*) b;
+    if (x->file != y->file) return (x->file > y->file) - (x->file < y->file);
+    return (x->offset > y->offset) - (x->offset < y->offset);
+}
+
+// gives the defined scenes in file order, so we can report the first error in a file
+SceneOrder* story_scene_order(Story* story, u64* count_out) {
+    
+    HashTable*  table = &story->scene_table;
+    SceneOrder* order = memory_alloc(memory_parse, (table->entry_count + 1) * sizeof(SceneOrder));
+    u64         count = 0;
+    
+    for (u64 i = 0; i < table->size; i++) {
+        if (!table->entries[i].occupied) continue;
+        if (story->cache) {
+            SceneSlot* slot = &story->cache->slots[i];
+            if (slot->line) order[count++] = (SceneOrder) { slot->file, slot->offset, i };
+        } else {
+            Scene* scene = &table->values[i];
+            if (scene->line) order[count++] = (SceneOrder) { scene->file, scene->offset, i };
+        }
+    }
+    
+    qsort(order, count, sizeof(SceneOrder), compare_scene_order);
+    
+    *count_out = count;
+    return order;
+}
+
+// includes are relative to the directory of the file with the header
+char* story_include_path(char* main_name, String include) {
+    
+    char* slash     = strrchr(main_name, '/');
+    u64   dir_count = slash && !string_starts_with_u8(include, '/') ? (u64) (slash - main_name) + 1 : 0;
+    
+    char* out = malloc(dir_count + include.count + 1);
+    memcpy(out, main_name, dir_count);
+    memcpy(out + dir_count, include.data, include.count);
+    out[dir_count + include.count] = 0;
+    
+    return out;
+}
+
+
+
+
+/* ---- Scene Spans ---- */
+
+typedef struct {
+    String label;
+    u64    offset;  // of the body
+    u64    count;
+    u64    line;    // of the label
+} SceneSpan;
+
+typedef struct {
+    SceneSpan* data;
+    u64        count;
+    u64        allocated;
+} SceneSpanList;
+
+// finds where each scene of a file is, the bodies are parsed later by parse_scene()
+void scan_scene_spans(Story* story, u64 file, LineReader* reader, SceneSpanList* list) {
+
+    String label;
+    while (scan_next_label(story, file, reader, list->count == 0, &label)) {
+        
+        if (list->count) list->data[list->count - 1].count = reader->line_offset - list->data[list->count - 1].offset;
+        
+        if (list->count == list->allocated) {
+            list->allocated = list->allocated ? list->allocated * 2 : 256;
+            list->data      = memory_realloc(memory_parse, list->data, list->allocated * sizeof(SceneSpan));
+            if (!list->data) hard_error("Out of memory when reading \"%s\".\n", story->files[file].name);
+        }
+        
+        u64 line = line_index_get_line(&story->files[file].lines, reader->line_offset);
+        list->data[list->count++] = (SceneSpan) { line_reader_keep(reader, label), reader->offset, 0, line };
+    }
+    
+    if (list->count) list->data[list->count - 1].count = reader->offset - list->data[list->count - 1].offset;
+}
+
+typedef struct {
+    Story*         story;
+    SceneSpanList* spans;  // per file
+} ScanWork;
+
+// loads a file if we haven't, and finds its scenes, this runs on its own thread for each file
+void scan_story_file(void* data, u64 file) {
+
+    ScanWork*  work  = data;
+    Story*     story = work->story;
+    StoryFile* it    = &story->files[file];
+    
+    LineReader reader;
+    
+    if (story->cache) {
+        
+        if (!it->stream) it->stream = fopen(it->name, "rb");
+        if (!it->stream) hard_error("Cannot open file \"%s\".\n", it->name);
+        
+        if (!it->lines.count) {
+            u64 invalid;
+            it->lines = line_index_build_from_stream(it->stream, &invalid);
+            if (invalid != (u64) -1) utf8_error_in_file(story, file, it, invalid);
+        }
+        reader = line_reader_from_file(it->stream, 1024 * 1024);
+    
+    } else {
+        
+        if (!it->data.data) it->data = load_file(it->name);
+        if (!it->data.count) hard_error("Cannot open file \"%s\".\n", it->name);
+        
+        if (!it->lines.count) {
+            it->lines = line_index_build(it->data);
+            u64 invalid = utf8_find_invalid(it->data);
+            if (invalid != (u64) -1) utf8_error_in_file(story, file, it, invalid);
+        }
+        reader = line_reader_from_string(it->data);
+    }
+    
+    if (file == 0) line_reader_seek(&reader, story->body_offset);
+    
+    TraceSpan span = trace_begin("scan_file");
+    scan_scene_spans(story, file, &reader, &work->spans[file]);
+    trace_end(span);
+    
+    if (story->cache) free(reader.data);
+}
+
+
+
+
+/* ---- Parse Cache ---- */
+
+/*
+    Most of the time of parsing a big story goes to the scene bodies, and most files don't change between two runs,
+    so with --parse-cache, after we parse every scene of a file, we save them to .story-cache/ next to the first file.
+    There is one entry per file, under a hash of its name, so a new one replaces the old one, and the entry has a key,
+    a hash of the file, the language list and the variable list, which has to match for us to take it.
+    A String is saved as an offset and a count in the file, so loading a cached file makes no copy.
+    The links are looked up again, they can point to other files.
+    
+    note: a hit still scans the labels, hashes the file and decodes the entry, and only saves parsing the bodies,
+    which on the stories story bench makes is no faster than parsing them, so it's off by default
+
+    Layout (varint is LEB128):
+
+        u8[4]   "STPC"
+        u8      version
+        varint  key
+        varint  scene count
+        per scene, in file order:
+            varint  body offset, count        to check it's the same scene
+            varint  text offset, count        per language, 0 0 if it has none
+            varint  option count
+            per option:
+                varint  link offset, count
+                varint  text offset, count    per language
+                varint  condition, effect     see Option
+            varint  code count
+            per instruction:
+                u8      op, dst, a, b
+                varint  value                 zigzag
+*/
+
+#define parse_cache_version 3
+
+// gives NULL if we have no cache directory
+char* parse_cache_path(Story* story, u64 file, char* dir) {
+    
+    if (!dir) return NULL;
+    
+    u64   hash  = get_hash_fnv1a_64(c_string_to_string(story->files[file].name));
+    u64   count = strlen(dir) + 1 + 16 + 1;
+    char* out   = malloc(count);
+    snprintf(out, count, "%s/%016llx", dir, hash);
+    
+    return out;
+}
+
+// what the entry of a file has to have, so we don't take it for a file that changed
+u64 parse_cache_key(Story* story, u64 file) {
+    
+    u64 hash = get_hash_fnv1a_64(story->files[file].data);
+    hash = (hash ^ parse_cache_version) * 0x100000001b3;
+    for (u64 i = 0; i < story->lang_table.count; i++) {
+        hash = (hash ^ get_hash_fnv1a_64(story->lang_table.data[i])) * 0x100000001b3;
+    }
+    
+    // variables are compiled to their index, so the names and the order matter
+    for (u64 i = 0; i < story->var_table.count; i++) {
+        hash = (hash ^ get_hash_fnv1a_64(story->var_table.names[i])) * 0x100000001b3;
+    }
+    
+    return hash;
+}
+
+void parse_cache_put_string(u8* out, u64* acc, String s, String file) {
+    put_varint(out, acc, s.count ? (u64) (s.data - file.data) : 0);
+    put_varint(out, acc, s.count);
+}
+
+u8 parse_cache_eat_string(String* in, String file, String* out) {
+    u64 offset, count;
+    if (!string_eat_varint(in, &offset) || !string_eat_varint(in, &count)) return 0;
+    if (offset > file.count || count > file.count - offset)                 return 0;
+    *out = count ? (String) { file.data + offset, count } : (String) {0};
+    return 1;
+}
+
+// order is the scenes of the file, all parsed
+String parse_cache_encode(Story* story, u64 file, SceneOrder* order, u64 count) {
+    
+    HashTable* table          = &story->scene_table;
+    String     source         = story->files[file].data;
+    u64        language_count = story->lang_table.count;
+    
+    u64 code_count = 0;
+    for (u64 i = 0; i < count; i++) code_count += table->values[order[i].index].code_count;
+    
+    u64 scene_size = 2 * 10 + language_count * 20 + 10 + count_of(((Scene*) 0)->options) * (20 + language_count * 20 + 6) + 10;
+    u8* out        = memory_alloc(memory_parse, 5 + 2 * 10 + count * scene_size + code_count * 9);
+    u64 acc        = 0;
+    
+    memcpy(out, "STPC", 4);
+    out[4] = parse_cache_version;
+    acc    = 5;
+    
+    put_varint(out, &acc, parse_cache_key(story, file));
+    put_varint(out, &acc, count);
+    
+    for (u64 i = 0; i < count; i++) {
+        
+        Scene* scene = &table->values[order[i].index];
+        
+        put_varint(out, &acc, scene->offset);
+        put_varint(out, &acc, scene->source.count);
+        
+        for (u64 j = 0; j < language_count; j++) parse_cache_put_string(out, &acc, scene->text[j], source);
+        
+        put_varint(out, &acc, scene->option_count);
+        
+        for (u64 j = 0; j < scene->option_count; j++) {
+            Option* option = &scene->options[j];
+            parse_cache_put_string(out, &acc, option->link, source);
+            for (u64 k = 0; k < language_count; k++) parse_cache_put_string(out, &acc, option->text[k], source);
+            put_varint(out, &acc, option->condition);
+            put_varint(out, &acc, option->effect);
+        }
+        
+        put_varint(out, &acc, scene->code_count);
+        
+        for (u64 j = 0; j < scene->code_count; j++) {
+            Instruction* it = &scene->code[j];
+            out[acc++] = it->op;
+            out[acc++] = it->dst;
+            out[acc++] = it->a;
+            out[acc++] = it->b;
+            put_varint_signed(out, &acc, it->value);
+        }
+    }
+    
+    return (String) { out, acc };
+}
 
-            option = string_strip_label(option);
+// fills out[i] for order[i], gives 0 if the cache doesn't match the file, the links are not resolved here,
+// out has to be zeroed, free each scene with scene_free_script() even if this fails
+u8 parse_cache_decode(Story* story, u64 file, String in, SceneOrder* order, u64 count, Scene* out) {
+    
+    HashTable* table          = &story->scene_table;
+    String     source         = story->files[file].data;
+    u64        language_count = story->lang_table.count;
+    
+    if (in.count < 5 || memcmp(in.data, "STPC", 4) != 0 || in.data[4] != parse_cache_version) return 0;
+    in = string_advance(in, 5);
     
-            if (!table_get_entry(table, option)) {
-                print(string("Error: Cannot find option label [@] in the whole file, "), option);
-                printf("at line %llu.\n", line_count);
-                exit(1);
+    u64 key;
+    if (!string_eat_varint(&in, &key) || key != parse_cache_key(story, file)) return 0;
+    
+    u64 cached_count;
+    if (!string_eat_varint(&in, &cached_count) || cached_count != count) return 0;
+    
+    for (u64 i = 0; i < count; i++) {
+        
+        Scene* scene = &table->values[order[i].index];
+        Scene* it    = &out[i];
+        
+        *it = (Scene) { .source = scene->source, .file = file, .offset = scene->offset, .line = scene->line, .parsed = 1 };
+        
+        u64 offset, body_count;
+        if (!string_eat_varint(&in, &offset) || !string_eat_varint(&in, &body_count)) return 0;
+        if (offset != scene->offset || body_count != scene->source.count)           return 0;
+        
+        for (u64 j = 0; j < language_count; j++) {
+            if (!parse_cache_eat_string(&in, source, &it->text[j])) return 0;
+            if (it->text[j].count) it->text_mask |= 1u << j;
+        }
+        
+        if (!string_eat_varint(&in, &it->option_count) || it->option_count > count_of(it->options)) return 0;
+        
+        for (u64 j = 0; j < it->option_count; j++) {
+            Option* option = &it->options[j];
+            if (!parse_cache_eat_string(&in, source, &option->link)) return 0;
+            for (u64 k = 0; k < language_count; k++) {
+                if (!parse_cache_eat_string(&in, source, &option->text[k])) return 0;
+                if (option->text[k].count) option->text_mask |= 1u << k;
             }
             
-            scene->options[option_acc].link = option;
+            u64 condition, effect;
+            if (!string_eat_varint(&in, &condition) || !string_eat_varint(&in, &effect)) return 0;
+            option->condition = condition;
+            option->effect    = effect;
+            if (option->condition != condition || option->effect != effect) return 0;
+        }
+        
+        u64 code_count;
+        if (!string_eat_varint(&in, &code_count) || code_count > script_max_code || code_count > in.count) return 0;
+        
+        if (code_count) {
             
-            // option text
-            while (walk.count) {
-
-                String line = string_eat_line(&walk);
-                line_count++;
-                
-                if (!line.count) break;
-                if (string_starts_with_u8(line, '#')) continue;
+            it->code = memory_alloc(memory_script, code_count * sizeof(Instruction));
+            if (!it->code) return 0;
             
-                String text = line;
-                String lang = string_eat_by_separator(&text, string(":"));
-
-                if (lang.count == line.count) {
-                    hard_error("Invalid option text at line %llu.\n", line_count);
-                } 
+            for (u64 j = 0; j < code_count; j++) {
                 
-                text = string_trim_spaces(text);
+                if (in.count < 4) return 0;
                 
-                u64 index;
-                if (!language_table_get_index(lang_table, lang, &index)) {
-                    print(string("Error: Cannot find language \"@\" in language list, "), lang);
-                    printf("at line %llu.\n", line_count);
-                    exit(1);
-                }
+                Instruction* code = &it->code[it->code_count++];
+                code->op  = in.data[0];
+                code->dst = in.data[1];
+                code->a   = in.data[2];
+                code->b   = in.data[3];
+                in = string_advance(in, 4);
                 
-                String* slot = &scene->options[option_acc].text[index];
-                if (slot->count) {
-                    print(string("Error: Redundant text for language \"@\", "), lang);
-                    printf("at line %llu.\n", line_count);
-                    exit(1);
-                }
+                s64 value;
+                if (!string_eat_varint_signed(&in, &value) || value != (s32) value) return 0;
+                code->value = (s32) value;
+            }
+        }
+        
+        if (!script_code_is_valid(it->code, it->code_count, story->var_table.count)) return 0;
+        
+        for (u64 j = 0; j < it->option_count; j++) {
+            if (it->options[j].condition > it->code_count || it->options[j].effect > it->code_count) return 0;
+        }
+        
+        // cheaper to split again than to save, it's only the texts with a '{'
+        scene_split_templates(&story->var_table, it);
+    }
+    
+    return in.count == 0;
+}
 
-                *slot = text;
+typedef struct {
+    Story*      story;
+    SceneOrder* order;      // the defined scenes, by file
+    u64*        first;      // per file, where its scenes start in order, first[file_count] is the end
+    char*       cache_dir;  // NULL if we can't have one
+} ParseWork;
+
+// parses the scenes of a file that are not parsed, or takes them from the parse cache,
+// this runs on its own thread for each file, so it only writes the slots of this file
+void parse_story_file(void* data, u64 file) {
+    
+    ParseWork* work  = data;
+    Story*     story = work->story;
+    HashTable* table = &story->scene_table;
+    
+    SceneOrder* order = work->order + work->first[file];
+    u64         count = work->first[file + 1] - work->first[file];
+    
+    u64 parsed_count = 0;
+    for (u64 i = 0; i < count; i++) parsed_count += table->values[order[i].index].parsed;
+    if (parsed_count == count) return;
+    
+    TraceSpan span = trace_begin("parse_file");
+    
+    char* path = parse_cache_path(story, file, work->cache_dir);
+    
+    if (path) {
+        
+        TraceSpan load_span = trace_begin("parse_cache_load");
+        
+        String cached = load_file(path);
+        Scene* scenes = memory_calloc(memory_parse, count + 1, sizeof(Scene));
+        
+        u8 ok = cached.count && parse_cache_decode(story, file, cached, order, count, scenes);
+        
+        if (ok) {
+            
+            for (u64 i = 0; i < count; i++) {
+                
+                Scene* scene = &scenes[i];
+                for (u64 j = 0; j < scene->option_count; j++) {
+                    
+                    Option* option = &scene->options[j];
+                    if (table_get_index(table, option->link, &option->link_index) && story_is_defined(story, option->link_index)) continue;
+                    
+                    u64 line = scene_get_line(story, scene, option->link);
+                    story_soft_error(story, file, line, "missing-link", string("Cannot find option label [@] in the whole file, "), option->link);
+                    option->link_index = story->quit_index;
+                }
             }
             
-            option_acc++;
-            assert(option_acc <= count_of(scene->options));
+            // other threads read the line of these slots, which stays the same, so we don't write the whole Scene
+            for (u64 i = 0; i < count; i++) {
+                
+                Scene* scene = &table->values[order[i].index];
+                Scene* it    = &scenes[i];
+                if (scene->parsed) continue;
+                
+                memcpy(scene->text, it->text, sizeof(scene->text));
+                memcpy(scene->text_template, it->text_template, sizeof(scene->text_template));
+                memcpy(scene->options, it->options, sizeof(scene->options));
+                scene->text_mask     = it->text_mask;
+                scene->option_count  = it->option_count;
+                scene->code          = it->code;
+                scene->code_count    = it->code_count;
+                scene->segments      = it->segments;
+                scene->segment_count = it->segment_count;
+                scene->parsed        = 1;
+                
+                // they are the slot's now
+                it->code     = NULL;
+                it->segments = NULL;
+            }
+        }
+        
+        for (u64 i = 0; i < count; i++) scene_free_script(&scenes[i]);
+        memory_free(scenes);
+        memory_free(cached.data);
+        
+        trace_end(load_span);
+        
+        if (ok) {
+            free(path);
+            trace_end(span);
+            return;
         }
+    }
+    
+    for (u64 i = 0; i < count; i++) {
+        Scene* scene = &table->values[order[i].index];
+        if (!scene->parsed) parse_scene(story, scene);
+    }
+    
+    if (path) {
+        String encoded = parse_cache_encode(story, file, order, count);
+        save_file(encoded, path); // it's only a cache, so it's fine if we can't
+        memory_free(encoded.data);
+        free(path);
+    }
+    
+    trace_end(span);
+}
 
-        scene->option_count = option_acc;
+// parses every scene we haven't, the files in parallel, and with the parse cache when the files are in memory
+void story_parse_all(Story* story) {
+
+    TraceSpan   span  = trace_begin("parse_scenes");
+    u64         count;
+    SceneOrder* order = story_scene_order(story, &count);
+    
+    // with a scene cache, bodies are only in the file, so we go one by one
+    if (story->cache) {
+        for (u64 i = 0; i < count; i++) story_get_scene(story, order[i].index);
+        memory_free(order);
+        trace_end(span);
+        return;
     }
+    
+    ParseWork work = { .story = story, .order = order };
+    
+    work.first = calloc(story->file_count + 1, sizeof(u64));
+    for (u64 i = 0; i < count; i++)              work.first[order[i].file + 1]++;
+    for (u64 i = 0; i < story->file_count; i++)  work.first[i + 1] += work.first[i];
+    
+    char* dir = story->parse_cache ? story_include_path(story->files[0].name, string(".story-cache")) : NULL;
+    work.cache_dir = dir && make_directory(dir) ? dir : NULL;
+    
+    story_for_each_file(story, parse_story_file, &work);
+    
+    free(dir);
+    free(work.first);
+    memory_free(order);
+    
+    trace_end(span);
 }
 
+// the start label in the header is not defined, this only returns with story check
+void start_label_error(Story* story) {
+    
+    if (!diagnostics) {
+        print(string("Error: File \"@\" does not contain the correct start label [@] specified in the header.\n"), c_string_to_string(story->files[0].name), story->start_label);
+        hard_exit();
+    }
+    
+    diagnostics->label = story->start_label;
+    diagnostics_add(0, 0, "missing-start", string("The start label in the header is not defined"));
+    diagnostics->label = (String) {0};
+}
 
+// the header is everything before the first label of the first file, the reader stops at that label line,
+// this also sets up story->files, with main_file as the first one
+// note: story->scene_table has to be there, the quit label goes in it
+void parse_header(Story* story, StoryFile* main_file, LineReader* reader) {
 
+    HashTable*     table      = &story->scene_table;
+    LanguageTable* lang_table = &story->lang_table;
+    LineIndex*     lines      = &main_file->lines;  // story->files is not there yet
+    char*          file_name  = main_file->name;
+    
+    String line;
+    
+    TraceSpan span = trace_begin("parse_header");
 
-/* ---- Running (terminal mode) ---- */
+    u8 has_language = 0;    
+    u8 has_start    = 0;
+    u8 has_quit     = 0;
+    u8 has_body     = 0;
+    
+    char** includes      = NULL;
+    u64    include_count = 0;
+    
+    while (line_reader_next(reader, &line)) {
+        
+        const String start   = string("start:");
+        const String quit    = string("quit:");
+        const String include = string("include");
+        
+        if (!line.count) continue;
+        if (string_starts_with_u8(line, '#')) continue;
+        
+        // the header ends at the first label, so includes can come after the rest of it
+        if (has_language && has_start && has_quit) {
+            
+            if (string_is_label(string_trim_spaces(line))) {
+                story->body_offset = reader->line_offset;
+                has_body = 1;
+                break;
+            }
+            
+            if (!string_starts_with(line, include)) header_error(story, lines, reader->line_offset, string("Invalid label "));
+        }
+        
+        if (string_starts_with(line, string("languages:"))) {
+
+            while (line_reader_next(reader, &line)) {
+                
+                if (!line.count) break;
+               
+                if (string_starts_with_u8(line, '#')) continue;
+                
+                String language = string_trim_spaces(line);
+                language_table_add(lang_table, line_reader_keep(reader, language));
+            }
+
+            has_language = 1;
+        
+        } else if (string_starts_with(line, string("variables:"))) {
+
+            VariableTable* vars = &story->var_table;
+
+            while (line_reader_next(reader, &line)) {
+                
+                if (!line.count) break;
+                if (string_starts_with_u8(line, '#')) continue;
+                
+                String value = line;
+                String name  = string_trim_spaces(string_eat_by_separator(&value, string("=")));
+                
+                s64 initial = 0;
+                if (name.count != line.count && !script_parse_number(string_trim_spaces(value), &initial)) {
+                    header_error(story, lines, reader->line_offset, string("Invalid initial value, it should be a number like: gold = 10, "));
+                }
+                
+                u64 _;
+                if (!script_is_valid_name(name))                header_error(story, lines, reader->line_offset, string("Invalid variable name "));
+                if (variable_table_get_index(vars, name, &_))   header_error(story, lines, reader->line_offset, string("Redundant variable "));
+                if (vars->count == max_variable_count) {
+                    char most[32];
+                    snprintf(most, sizeof(most), "%d", max_variable_count);
+                    header_error(story, lines, reader->line_offset, string("Too many variables, the most we can have is @, "), c_string_to_string(most));
+                }
+                
+                vars->names[vars->count]   = line_reader_keep(reader, name);
+                vars->initial[vars->count] = initial;
+                vars->count++;
+            }
+        
+        } else if (string_starts_with(line, start)) { 
+            
+            String label = string_trim_spaces(string_advance(line, start.count));
+            if (!string_is_label(label)) {
+                header_error(story, lines, reader->line_offset, string("Invalid start label "));
+            }
+
+            story->start_label = line_reader_keep(reader, string_strip_label(label));
+
+            has_start = 1;
+        
+        } else if (string_starts_with(line, quit)) {
+            
+            String label = string_trim_spaces(string_advance(line, quit.count));
+            if (!string_is_label(label)) {
+                header_error(story, lines, reader->line_offset, string("Invalid quit label "));
+            }
+
+            label = line_reader_keep(reader, string_strip_label(label));
+
+            story->quit_label = label;
+            
+            u64 slot;
+            if (!table_add(table, label, &slot)) hard_error("Out of memory when building the scene table.\n"); // todo: this waste a slot
+            has_quit = 1;
+        
+        } else if (string_starts_with(line, include)) {
+            
+            String path = string_trim_spaces(string_advance(line, include.count));
+            if (path.count < 3 || path.data[0] != '"' || path.data[path.count - 1] != '"') {
+                header_error(story, lines, reader->line_offset, string("Invalid include, it should be like: include \"chapter.story\", "));
+            }
+            
+            includes = realloc(includes, (include_count + 1) * sizeof(char*));
+            includes[include_count++] = story_include_path(file_name, string_view(path, 1, path.count - 1));
+        
+        } else {
+        
+            header_error(story, lines, reader->line_offset, string("Invalid content in the header, a story file must start with a correct header, "));
+        }
+    }
+   
+    if (!has_language) hard_error("File \"%s\" does not contain a language list!\n", file_name);
+    if (!has_start)    hard_error("File \"%s\" does not contain a start label!\n", file_name);
+    if (!has_quit)     hard_error("File \"%s\" does not contain a quit label!\n", file_name);
+
+    if (!has_body) story->body_offset = reader->offset;
+    
+    story->file_count = 1 + include_count;
+    story->files      = calloc(story->file_count, sizeof(StoryFile));
+    story->files[0]   = *main_file;
+    for (u64 i = 0; i < include_count; i++) story->files[1 + i].name = includes[i];
+    free(includes);
+    
+    trace_end(span);
+}
+
+// todo: cleanup
+// todo: make this return error code instead of hard exiting?
+// todo: better error messages
+// note: with lazy, only the header and the label positions are parsed, the scenes are parsed on demand by story_get_scene()
+void parse_file_to_story(char* file_name, Story* story, u8 lazy) {
+    
+    TraceSpan span = trace_begin("parse_file_to_story");
+
+
+    /* ---- Load file and init hash table ---- */ 
+    
+    LineReader reader;
+    StoryFile  main_file = { .name = file_name };
+    
+    if (path_is_stdin(file_name)) story->parse_cache = 0; // we can't tell a pipe from the last run, and there is no file to put the cache next to
+    
+    if (story->cache) {
+        
+        FILE* f = fopen(file_name, "rb");
+        if (!f) hard_error("Cannot open file \"%s\".\n", file_name);
+        
+        u64 invalid;
+        main_file.stream = f;
+        main_file.lines  = line_index_build_from_stream(f, &invalid);
+        if (invalid != (u64) -1) utf8_error_in_file(story, 0, &main_file, invalid);
+        reader = line_reader_from_file(f, 1024 * 1024);
+    
+    } else {
+    
+        String file = load_file(file_name);
+        if (!file.count) hard_error("Cannot open file \"%s\".\n", file_name);
+        
+        main_file.data  = file;
+        main_file.lines = line_index_build(file);
+        u64 invalid = utf8_find_invalid(file);
+        if (invalid != (u64) -1) utf8_error_in_file(story, 0, &main_file, invalid);
+        reader = line_reader_from_string(file);
+    }
+    
+    // with a scene cache, the scenes are kept by the cache, per slot
+    story->scene_table = story->cache ? table_init_keys(256, 0.7, memory_table) : table_init(256, 0.7, memory_table);
+
+
+    /* ---- Init ---- */ 
+
+    HashTable* table = &story->scene_table;
+
+
+    /* ---- Header ---- */ 
+
+    parse_header(story, &main_file, &reader);
+    
+    if (story->cache) free(reader.data);
+    
+
+    
+
+
+    /* ---- Find all scenes, each file on its own thread ---- */
+    
+    // we only find where each scene is here, the scene bodies are parsed by parse_scene()
+    
+    SceneSpanList* spans = memory_calloc(memory_parse, story->file_count, sizeof(SceneSpanList));
+    {
+        TraceSpan scan_span = trace_begin("scan_labels");
+        ScanWork  work      = { story, spans };
+        story_for_each_file(story, scan_story_file, &work);
+        trace_end(scan_span);
+    }
+    
+
+    /* ---- Put all labels into the hash table, so links can go across files ---- */
+    
+    TraceSpan insert_span = trace_begin("insert_labels");
+    
+    for (u64 file = 0; file < story->file_count; file++) {
+        
+        for (u64 i = 0; i < spans[file].count; i++) {
+            
+            SceneSpan* span = &spans[file].data[i];
+            
+            // the slots are only set once they stop moving, see below
+            if (story->cache) {
+                u64 slot;
+                if (!table_add(table, span->label, &slot)) hard_error("Out of memory when building the scene table.\n");
+                continue;
+            }
+            
+            Scene* defined = table_get(table, span->label);
+            if (defined && defined->line) {
+                story_soft_error(story, file, span->line, "redundant-label", string("Redundant definition of label [@], "), span->label);
+                continue; // only with story check, the first one stays
+            }
+            
+            table_put(table, span->label, (Scene) {
+                .source = { NULL, span->count },
+                .file   = file,
+                .offset = span->offset,
+                .line   = span->line,
+            });
+        }
+        
+        if (!story->cache) memory_free(spans[file].data);
+    }
+    
+    if (story->cache) {
+        
+        scene_cache_set_slot_count(story->cache, table->size);
+        
+        for (u64 file = 0; file < story->file_count; file++) {
+            
+            for (u64 i = 0; i < spans[file].count; i++) {
+                
+                SceneSpan* span = &spans[file].data[i];
+                u64        index;
+                u8         ok   = table_get_index(table, span->label, &index);
+                assert(ok);
+                
+                SceneSlot* slot = &story->cache->slots[index];
+                if (slot->line) {
+                    story_soft_error(story, file, span->line, "redundant-label", string("Redundant definition of label [@], "), span->label);
+                    continue;
+                }
+                
+                *slot = (SceneSlot) { file, span->offset, span->count, span->line };
+            }
+            
+            memory_free(spans[file].data);
+        }
+    }
+    
+    memory_free(spans);
+    
+    trace_end(insert_span);
+
+    if (!table_get_entry(table, story->start_label)) start_label_error(story);
+
+    // no more table_put() after this, so slots are stable from here
+    {
+        u8 ok = table_get_index(table, story->quit_label, &story->quit_index);
+        assert(ok);
+        
+        // with a scene cache, an undefined quit label gets cache->undefined
+        if (!story->cache) {
+            Scene* quit = &table->values[story->quit_index];
+            if (!quit->line) quit->parsed = 1;
+        }
+    }
+    
+    if (!story->cache) {
+        for (u64 i = 0; i < table->size; i++) {
+            Scene* scene = &table->values[i];
+            if (scene->line) scene->source.data = story->files[scene->file].data.data + scene->offset;
+        }
+    }
+
+    if (!lazy) story_parse_all(story);
+    
+    u64 slot_size = story->cache ? sizeof(HashTableEntry) + sizeof(SceneSlot) + sizeof(Scene*) + 2 * sizeof(u32) : sizeof(HashTableEntry) + sizeof(Scene);
+    memory_note_table(table->size, table->entry_count, slot_size);
+    trace_end(span);
+}
+
+
+
+
+/* ---- Session ---- */
+
+/*
+    A session is everything run_story() needs to continue a story: the current scene and language,
+    the variables, and optionally the options chosen so far. Scenes are referred to by their slot in the scene table,
+    which only depends on the content of the file, so the encoded session carries a content hash,
+    and restoring is a direct index with no replay.
+
+    Encoded layout (varint is LEB128):
+    
+        u8      flags          bit 0..6: version, bit 7: has history
+        u64     content hash   little endian
+        varint  scene
+        varint  language
+        varint  variable count (since version 2, version 1 starts with the initial values)
+        varint  variables      zigzag
+        varint  history count  (only with history)
+        ...     history        3 bits per step (an option index is < 8), packed LSB first
+*/
+
+#define session_version 2
+
+typedef struct {
+    u64 scene;               // slot in story->scene_table
+    u64 language;            // index in story->lang_table
+    s64 variables[max_variable_count];   // same order as story->var_table
+    u8* history;             // 0-based option index chosen at each step
+    u64 history_count;
+    u64 history_allocated;
+} Session;
+
+void session_start(Story* story, Session* session) {
+    
+    *session = (Session) {0};
+    memcpy(session->variables, story->var_table.initial, sizeof(session->variables));
+    
+    u8 ok = table_get_index(&story->scene_table, story->start_label, &session->scene);
+    assert(ok);
+}
+
+void session_push_choice(Session* session, u8 option_index) {
+    
+    if (session->history_count == session->history_allocated) {
+        u64 wanted = session->history_allocated ? session->history_allocated * 2 : 64;
+        u8* data = realloc(session->history, wanted);
+        if (!data) return; // history is optional, we can live without it
+        session->history           = data;
+        session->history_allocated = wanted;
+    }
+    
+    session->history[session->history_count] = option_index;
+    session->history_count++;
+}
+
+// the upper bound of session_encode() output
+u64 session_encoded_size(Session* session, u8 with_history) {
+    u64 size = 1 + 8 + 10 + 10 + 10 + max_variable_count * 10;
+    if (with_history) size += 10 + (session->history_count * 3 + 7) / 8;
+    return size;
+}
+
+// returns the number of bytes written, 0 if it doesn't fit
+u64 session_encode(Story* story, Session* session, u8 with_history, u8* out, u64 capacity) {
+
+    if (capacity < session_encoded_size(session, with_history)) return 0;
+
+    u64 acc = 0;
+    out[acc++] = session_version | (with_history ? 0x80 : 0);
+    
+    u64 hash = story_get_content_hash(story);
+    for (u64 i = 0; i < 8; i++) out[acc++] = (u8) (hash >> (i * 8));
+    
+    put_varint(out, &acc, session->scene);
+    put_varint(out, &acc, session->language);
+    
+    put_varint(out, &acc, story->var_table.count);
+    for (u64 i = 0; i < story->var_table.count; i++) put_varint_signed(out, &acc, session->variables[i]);
+    
+    if (with_history) {
+        
+        put_varint(out, &acc, session->history_count);
+        
+        u64 bits      = 0;
+        u64 bit_count = 0;
+        for (u64 i = 0; i < session->history_count; i++) {
+            bits      |= (u64) (session->history[i] & 7) << bit_count;
+            bit_count += 3;
+            while (bit_count >= 8) {
+                out[acc++] = (u8) bits;
+                bits      >>= 8;
+                bit_count -= 8;
+            }
+        }
+        if (bit_count) out[acc++] = (u8) bits;
+    }
+    
+    return acc;
+}
+
+// note: the history is allocated, everything else is validated against the story
+u8 session_decode(Story* story, String in, Session* out) {
+
+    *out = (Session) {0};
+
+    if (in.count < 9) return 0;
+    
+    u8 flags   = in.data[0];
+    u8 version = flags & 0x7f;
+    if (version < 1 || version > session_version) return 0;
+    
+    u64 hash = 0;
+    for (u64 i = 0; i < 8; i++) hash |= (u64) in.data[1 + i] << (i * 8);
+    if (hash != story_get_content_hash(story)) return 0;
+    
+    in = string_advance(in, 9);
+
+    u64 scene, language;
+    if (!string_eat_varint(&in, &scene))    return 0;
+    if (!string_eat_varint(&in, &language)) return 0;
+
+    HashTable* table = &story->scene_table;
+    
+    // an occupied slot can also be the quit label or a label that is only linked to, neither is a scene to resume on
+    if (scene >= table->size || !table->entries[scene].occupied)       return 0;
+    if (scene == story->quit_index || !story_is_defined(story, scene)) return 0;
+    if (language >= story->lang_table.count)                            return 0;
+    
+    out->scene    = scene;
+    out->language = language;
+    
+    memcpy(out->variables, story->var_table.initial, sizeof(out->variables));
+    
+    if (version >= 2) {
+        
+        u64 count;
+        if (!string_eat_varint(&in, &count) || count != story->var_table.count) return 0;
+        
+        for (u64 i = 0; i < count; i++) {
+            if (!string_eat_varint_signed(&in, &out->variables[i])) return 0;
+        }
+    }
+
+    if (flags & 0x80) {
+        
+        // a save is untrusted, so the count is checked against what is left before anything multiplies it
+        u64 count;
+        if (!string_eat_varint(&in, &count))  return 0;
+        if (count > in.count * 8 / 3)         return 0;
+        if (in.count < (count * 3 + 7) / 8)   return 0;
+        
+        u64 bits      = 0;
+        u64 bit_count = 0;
+        for (u64 i = 0; i < count; i++) {
+            if (bit_count < 3) {
+                String byte = string_eat(&in, 1);
+                if (!byte.count) {
+                    free(out->history);
+                    *out = (Session) {0};
+                    return 0;
+                }
+                bits      |= (u64) byte.data[0] << bit_count;
+                bit_count += 8;
+            }
+            session_push_choice(out, bits & 7);
+            bits      >>= 3;
+            bit_count -= 3;
+        }
+    }
+    
+    return 1;
+}
+
+u8 session_save(Story* story, Session* session, u8 with_history, char* path) {
+    
+    u64 capacity = session_encoded_size(session, with_history);
+    u8* data = malloc(capacity);
+    if (!data) return 0;
+    
+    u64 count = session_encode(story, session, with_history, data, capacity);
+    u8  ok    = save_file((String) {data, count}, path);
+    
+    free(data);
+    return ok;
+}
+
+u8 session_load(Story* story, char* path, Session* out) {
+    
+    String data = load_file(path);
+    if (!data.count) return 0;
+    
+    u8 ok = session_decode(story, data, out);
+    
+    memory_free(data.data);
+    return ok;
+}
+
+
+
+
+/* ---- Reloading ---- */
+
+// if s points into from, gives the same position in to
+String string_rebase(String s, String from, String to) {
+    if (!s.data || s.data < from.data || s.data > from.data + from.count) return s;
+    return (String) { to.data + (s.data - from.data), s.count };
+}
+
+void scene_rebase(Scene* scene, String from, String to) {
+    
+    for (u64 i = 0; i < max_language_count; i++) {
+        scene->text[i] = string_rebase(scene->text[i], from, to);
+    }
+    
+    for (u64 i = 0; i < scene->option_count; i++) {
+        Option* option = &scene->options[i];
+        option->link = string_rebase(option->link, from, to);
+        for (u64 j = 0; j < max_language_count; j++) {
+            option->text[j] = string_rebase(option->text[j], from, to);
+        }
+    }
+    
+    for (u64 i = 0; i < scene->segment_count; i++) {
+        scene->segments[i].literal = string_rebase(scene->segments[i].literal, from, to);
+    }
+    
+    scene->source = string_rebase(scene->source, from, to);
+}
+
+// after the table is resized, every slot we remember is wrong
+void story_resolve_links(Story* story) {
+    
+    HashTable* table = &story->scene_table;
+    
+    for (u64 i = 0; i < table->size; i++) {
+        
+        Scene* scene = &table->values[i];
+        if (!table->entries[i].occupied || !scene->parsed) continue;
+        
+        for (u64 j = 0; j < scene->option_count; j++) {
+            u8 ok = table_get_index(table, scene->options[j].link, &scene->options[j].link_index);
+            assert(ok);
+        }
+    }
+
+    u8 ok = table_get_index(table, story->quit_label, &story->quit_index);
+    assert(ok);
+}
+
+// the header decides the languages, so we parse everything again, and keep the session on the same label if we can
+u8 story_reload_all(Story* story, Session* session) {
+    
+    Story fresh = {0};
+    
+    jmp_buf trap;
+    error_trap = &trap;
+    if (setjmp(trap)) {
+        error_trap = NULL;
+        return 0;
+    }
+    
+    parse_file_to_story(story->files[0].name, &fresh, 1);
+    
+    error_trap = NULL;
+    
+    HashTable* table = &fresh.scene_table;
+    
+    String label = story->scene_table.entries[session->scene].key;
+    if (!table_get_index(table, label, &session->scene) || !story_is_defined(&fresh, session->scene)) {
+        u8 ok = table_get_index(table, fresh.start_label, &session->scene);
+        assert(ok);
+    }
+    
+    String language = story->lang_table.data[session->language];
+    if (!language_table_get_index(&fresh.lang_table, language, &session->language)) session->language = 0;
+    
+    // variables keep their value by name, new ones start from their initial value
+    s64 variables[max_variable_count];
+    for (u64 i = 0; i < fresh.var_table.count; i++) {
+        u64 old;
+        u8  kept = variable_table_get_index(&story->var_table, fresh.var_table.names[i], &old);
+        variables[i] = kept ? session->variables[old] : fresh.var_table.initial[i];
+    }
+    memcpy(session->variables, variables, fresh.var_table.count * sizeof(s64));
+    
+    story_free(story);
+    *story = fresh;
+    
+    if (story->file_count > 1) printf("Reloaded \"%s\" and %llu included files.\n", story->files[0].name, story->file_count - 1);
+    else                       printf("Reloaded \"%s\": the header changed, so everything is parsed again.\n", story->files[0].name);
+    
+    return 1;
+}
+
+typedef struct {
+    String        file;            // the new file
+    SceneSpanList spans;
+    u64*          changed;         // index into spans
+    Scene*        staged;          // the changed scenes parsed, same order as changed
+    u64           changed_count;
+    u8*           defined;         // per slot, if the new file defines it
+    LineIndex     old_lines;       // of the old file, files[0].lines is the new one until we know if it's good
+} Reload;
+
+// everything that can fail, the only change to the story is giving the new labels a slot (see below)
+void reload_stage(Story* story, Session* session, Reload* r) {
+
+    HashTable* table    = &story->scene_table;
+    String     old_file = story->files[0].data;
+    String     file     = r->file;
+    
+
+    /* ---- Find all scenes in the new file ---- */
+    
+    {
+        LineReader reader = line_reader_from_string(file);
+        line_reader_seek(&reader, story->body_offset);
+        scan_scene_spans(story, 0, &reader, &r->spans);
+    }
+    
+
+    /* ---- New labels get a slot ---- */
+
+    // this doesn't change the story, since nothing can link to a slot that is not defined
+    {
+        String current      = table->entries[session->scene].key;
+        u64    rehash_count = table->rehash_count;
+        
+        for (u64 i = 0; i < r->spans.count; i++) {
+            if (table_get_entry(table, r->spans.data[i].label)) continue;
+            table_put(table, string_copy(r->spans.data[i].label), (Scene) {0});
+        }
+        
+        // growing or a new hash seed moved every slot
+        if (table->rehash_count != rehash_count) {
+            story_resolve_links(story);
+            u8 ok = table_get_index(table, current, &session->scene);
+            assert(ok);
+        }
+    }
+    
+
+    /* ---- Check and parse what changed ---- */
+
+    r->defined = calloc(table->size, sizeof(u8));
+    
+    for (u64 i = 0; i < r->spans.count; i++) {
+        
+        u64 index;
+        u8 ok = table_get_index(table, r->spans.data[i].label, &index);
+        assert(ok);
+        
+        if (r->defined[index]) {
+            story_error(story, 0, r->spans.data[i].line, "redundant-label", string("Redundant definition of label [@], "), r->spans.data[i].label);
+        }
+        r->defined[index] = 1;
+    }
+    
+    {
+        u64 start;
+        if (!table_get_index(table, story->start_label, &start) || !r->defined[start]) start_label_error(story);
+    }
+
+    story->staged_defined = r->defined;
+    
+    r->changed = malloc(r->spans.count * sizeof(u64));
+    
+    for (u64 i = 0; i < r->spans.count; i++) {
+        
+        SceneSpan* span = &r->spans.data[i];
+        
+        u64 index;
+        table_get_index(table, span->label, &index);
+        Scene* scene = &table->values[index];
+
+        u8 same = scene->line && scene->source.count == span->count;
+        if (same) same = memcmp(old_file.data + scene->offset, file.data + span->offset, span->count) == 0;
+        
+        if (!same) {
+            r->changed[r->changed_count++] = i;
+            continue;
+        }
+        
+        // the links of an unchanged scene can still point to a label that is removed now,
+        // the body is the same, so the link is as far into it in the new file, where the lines are now
+        if (!scene->parsed) continue;
+        for (u64 j = 0; j < scene->option_count; j++) {
+            String link = scene->options[j].link;
+            if (story_is_defined(story, scene->options[j].link_index)) continue;
+            u64 line = line_index_get_line(&story->files[0].lines, span->offset + (u64) (link.data - scene->source.data));
+            story_error(story, 0, line, "missing-link", string("Cannot find option label [@] in the whole file, "), link);
+        }
+    }
+
+    r->staged = calloc(r->changed_count, sizeof(Scene));
+    
+    for (u64 i = 0; i < r->changed_count; i++) {
+        SceneSpan* span = &r->spans.data[r->changed[i]];
+        r->staged[i] = (Scene) {
+            .source = { file.data + span->offset, span->count },
+            .file   = 0,
+            .offset = span->offset,
+            .line   = span->line,
+        };
+        parse_scene(story, &r->staged[i]);
+    }
+}
+
+// swaps the staged scenes in, nothing can fail here
+void reload_commit(Story* story, Session* session, Reload* r) {
+
+    HashTable* table    = &story->scene_table;
+    String     old_file = story->files[0].data;
+    String     file     = r->file;
+    
+    u64 removed_count = 0;
+    
+    for (u64 i = 0; i < table->size; i++) {
+        
+        HashTableEntry* entry = &table->entries[i];
+        if (!entry->occupied || r->defined[i]) continue;
+
+        // we are freeing the old buffer
+        if (entry->key.data >= old_file.data && entry->key.data < old_file.data + old_file.count) {
+            entry->key = string_copy(entry->key);
+        }
+
+        if (table->values[i].line) removed_count++;
+        scene_free_script(&table->values[i]);
+        table->values[i] = (Scene) { .parsed = i == story->quit_index };
+    }
+
+    u64 next_changed = 0;
+    
+    for (u64 i = 0; i < r->spans.count; i++) {
+        
+        SceneSpan* span = &r->spans.data[i];
+        
+        u64 index;
+        table_get_index(table, span->label, &index);
+        HashTableEntry* entry = &table->entries[index];
+        
+        // a key that is not a view into the old file is a copy, from reload_stage() or from the loop above on an earlier reload
+        u8 key_is_view = entry->key.data >= old_file.data && entry->key.data < old_file.data + old_file.count;
+        if (!key_is_view) free(entry->key.data);
+        entry->key = span->label;
+
+        if (next_changed < r->changed_count && r->changed[next_changed] == i) {
+            scene_free_script(&table->values[index]);
+            table->values[index] = r->staged[next_changed];
+            next_changed++;
+            continue;
+        }
+
+        Scene* scene = &table->values[index];
+        
+        String from = { old_file.data + scene->offset, span->count };
+        String to   = { file.data     + span->offset,  span->count };
+        
+        scene_rebase(scene, from, to);
+        scene->offset = span->offset;
+        scene->line   = span->line;
+    }
+    
+    {
+        String from = { old_file.data, story->body_offset };
+        String to   = { file.data,     story->body_offset };
+        
+        story->start_label = string_rebase(story->start_label, from, to);
+        story->quit_label  = string_rebase(story->quit_label,  from, to);
+        for (u64 i = 0; i < story->lang_table.count; i++) {
+            story->lang_table.data[i] = string_rebase(story->lang_table.data[i], from, to);
+        }
+        for (u64 i = 0; i < story->var_table.count; i++) {
+            story->var_table.names[i] = string_rebase(story->var_table.names[i], from, to);
+        }
+        
+        HashTableEntry* quit = &table->entries[story->quit_index];
+        quit->key = string_rebase(quit->key, from, to);
+    }
+    
+    if (!story_is_defined(story, session->scene)) {
+        u8 ok = table_get_index(table, story->start_label, &session->scene);
+        assert(ok);
+    }
+
+    memory_free(old_file.data);
+    line_index_free(&r->old_lines);
+    story->files[0].data    = file;
+    story->has_content_hash = 0;
+
+    printf("Reloaded \"%s\": %llu scenes changed, %llu removed.\n", story->files[0].name, r->changed_count, removed_count);
+}
+
+/*
+    Re-reads the file, and only parses the scenes whose body changed, 
+    the rest are moved to the new file buffer as they are.
+    If the new file has an error, we report it and keep the story we had.
+    
+    note: scene bodies are compared byte by byte against the old buffer, which is as cheap as hashing them
+    note: this can't work with a scene cache, since we need both buffers
+    note: with includes, we parse everything again, but lazily, so only the labels until we show a scene
+*/
+u8 story_reload(Story* story, Session* session) {
+
+    assert(!story->cache);
+    
+    if (story->file_count > 1) return story_reload_all(story, session);
+
+    String file = load_file(story->files[0].name);
+    if (!file.count) return 0; // the editor may have truncated it before writing, we'll get another event
+    
+    if (file.count < story->body_offset || memcmp(file.data, story->files[0].data.data, story->body_offset) != 0) {
+        memory_free(file.data);
+        return story_reload_all(story, session);
+    }
+    
+    Reload reload = { .file = file, .old_lines = story->files[0].lines };
+    story->files[0].lines = line_index_build(file);
+    
+    jmp_buf trap;
+    error_trap = &trap;
+    
+    u8 ok = !setjmp(trap);
+    if (ok) {
+        u64 invalid = utf8_find_invalid(file);
+        if (invalid != (u64) -1) utf8_error_in_file(story, 0, &(StoryFile) { story->files[0].name, file, NULL, story->files[0].lines }, invalid);
+        reload_stage(story, session, &reload);
+        error_trap            = NULL;
+        story->staged_defined = NULL;
+        reload_commit(story, session, &reload);
+    } else {
+        error_trap            = NULL;
+        story->staged_defined = NULL;
+        memory_free(reload.file.data);
+        line_index_free(&story->files[0].lines);
+        story->files[0].lines = reload.old_lines;
+        for (u64 i = 0; i < reload.changed_count && reload.staged; i++) scene_free_script(&reload.staged[i]);
+    }
+    
+    memory_free(reload.spans.data);
+    free(reload.changed);
+    free(reload.staged);
+    free(reload.defined);
+    
+    return ok;
+}
+
+
+
+
+// the watcher starts with the first file, this adds the included ones, call it again after a reload since they can change
+void story_watch_includes(Story* story, FileWatcher* watcher) {
+    for (u64 i = 1; i < story->file_count; i++) file_watcher_add(watcher, story->files[i].name);
+}
+
+
+
+
+/* ---- Layout (terminal mode) ---- */
+
+/*
+    print_scene() lays the scene out for the width of the terminal, then writes it with one write.
+    A line that is too long is broken at its last space, or before a wide character, since Chinese has no spaces,
+    and the width is counted in columns, where a Chinese character takes 2. The lines after the first one of an option
+    start under its text, after "[n] ". The line breaks of the story (the ones in a ~~~ paragraph) are kept,
+    a line is only broken further.
+
+    A scene without placeholders and conditions for the language looks the same every time, so its layout is kept
+    per (scene, language), and all of them are dropped when the width changes (SIGWINCH) or the story is reloaded.
+    The other scenes are laid out every time, which is cheap, it's one pass over the text.
+    With a scene cache nothing is kept, or the layouts would grow with every scene we visit, past max_resident.
+
+    note: width 0 (stdout is not a terminal) doesn't wrap, so a pipe gets the text as it is in the story
+*/
+
+Define_HashMap(u64, String);
+
+typedef struct {
+    u64                  width;         // to wrap at, 0 to not wrap
+    HashMap(u64, String) cache;         // by slot * max_language_count + language
+    u8                   no_cache;      // to lay out every scene every time
+    u8*                  data;          // the scene being laid out
+    u64                  count;
+    u64                  capacity;
+    u64                  column;        // where data ends on its last line, in columns
+    u64                  indent;        // of the lines after the first one of what we lay out now
+    u64                  break_at;      // where in data the last line can be broken, (u64) -1 if nowhere
+    u64                  break_column;  // the column there
+    u8                   break_space;   // if data[break_at] is a space, which the line break replaces
+    u32                  last;          // the last character, see layout_can_break_before()
+} Layout;
+
+void layout_init(Layout* l, u64 width) {
+    *l = (Layout) { .width = width, .cache = hash_map(u64, String, init)(64, 0.7, memory_layout) };
+}
+
+void layout_clear(Layout* l) {
+    for (u64 i = 0; hash_map(u64, String, next)(&l->cache, &i); i++) memory_free(l->cache.entries[i].value.data);
+    hash_map(u64, String, free)(&l->cache);
+    l->cache = hash_map(u64, String, init)(64, 0.7, memory_layout);
+}
+
+void layout_free(Layout* l) {
+    layout_clear(l);
+    hash_map(u64, String, free)(&l->cache);
+    memory_free(l->data);
+}
+
+// picks up the new width after a SIGWINCH, the layouts we have are for the old one
+void layout_update_width(Layout* l) {
+    
+    if (!terminal_resized) return;
+    terminal_resized = 0;
+    
+    u64 width = terminal_get_width();
+    if (width == l->width) return;
+    
+    l->width = width;
+    layout_clear(l);
+}
+
+void layout_reserve(Layout* l, u64 extra) {
+    
+    if (l->count + extra <= l->capacity) return;
+    
+    u64 capacity = l->capacity ? l->capacity : 1024;
+    while (capacity < l->count + extra) capacity *= 2;
+    
+    u8* data = memory_realloc(memory_layout, l->data, capacity);
+    if (!data) hard_error("Cannot allocate memory for the layout of a scene.\n");
+    
+    l->data     = data;
+    l->capacity = capacity;
+}
+
+// as it is, the caller keeps the column
+void layout_raw(Layout* l, String s) {
+    layout_reserve(l, s.count);
+    memcpy(l->data + l->count, s.data, s.count);
+    l->count += s.count;
+}
+
+// the start of a text with its own indent, like an option
+void layout_begin(Layout* l, u64 indent) {
+    l->column   = 0;
+    l->indent   = indent;
+    l->break_at = (u64) -1;
+    l->last     = '\n';
+}
+
+void layout_new_line(Layout* l) {
+    layout_reserve(l, 1 + l->indent);
+    l->data[l->count++] = '\n';
+    memset(l->data + l->count, ' ', l->indent);
+    l->count   += l->indent;
+    l->column   = l->indent;
+    l->break_at = (u64) -1;
+}
+
+// moves what comes after break_at to a new line
+void layout_break(Layout* l) {
+    
+    u64 tail_start = l->break_at + l->break_space;
+    u64 tail_count = l->count - tail_start;
+    u64 tail_width = l->column - l->break_column - l->break_space;
+    u64 insert     = 1 + l->indent;
+    u64 new_start  = l->break_at + insert;
+    
+    layout_reserve(l, insert);
+    memmove(l->data + new_start, l->data + tail_start, tail_count);
+    l->data[l->break_at] = '\n';
+    memset(l->data + l->break_at + 1, ' ', l->indent);
+    
+    l->count    = new_start + tail_count;
+    l->column   = l->indent + tail_width;
+    l->break_at = (u64) -1;
+}
+
+// a line should not start with a closing mark, or end with an opening one
+u8 layout_can_break_before(u32 last, u32 c) {
+    
+    const u32 closing[] = { 0x3001, 0x3002, 0x300d, 0x300f, 0x3011, 0xff01, 0xff09, 0xff0c, 0xff1a, 0xff1b, 0xff1f };
+    const u32 opening[] = { 0x300c, 0x300e, 0x3010, 0xff08 };
+    
+    for (u64 i = 0; i < count_of(closing); i++) if (c    == closing[i]) return 0;
+    for (u64 i = 0; i < count_of(opening); i++) if (last == opening[i]) return 0;
+    
+    return 1;
+}
+
+void layout_mark_break(Layout* l, u64 at, u64 column, u8 space) {
+    if (column <= l->indent) return; // the line would be empty
+    l->break_at     = at;
+    l->break_column = column;
+    l->break_space  = space;
+}
+
+void layout_text(Layout* l, String s) {
+    
+    u64 i = 0;
+    while (i < s.count) {
+        
+        u64 start = i;
+        u32 c     = utf8_decode(s, &i);
+        u64 width = utf8_display_width(c);
+        
+        if (c == '\n') {
+            layout_new_line(l);
+            l->last = c;
+            continue;
+        }
+        
+        if (l->width && l->column + width > l->width && l->column > l->indent) {
+            
+            // the space would be the last column, so it's the line break
+            if (c == ' ') {
+                layout_new_line(l);
+                l->last = c;
+                continue;
+            }
+            
+            if (l->break_at != (u64) -1) layout_break(l);
+            else                         layout_new_line(l); // one word longer than the line, so it's cut
+        }
+        
+        if (width == 2 && layout_can_break_before(l->last, c)) layout_mark_break(l, l->count, l->column, 0);
+        
+        layout_raw(l, (String) { s.data + start, i - start });
+        l->column += width;
+        l->last    = c;
+        
+        if (c == ' ') layout_mark_break(l, l->count - 1, l->column - 1, 1);
+    }
+}
+
+void layout_template(Layout* l, Scene* scene, String text, u16 text_template, s64* variables) {
+
+    if (!text_template) {
+        layout_text(l, text);
+        return;
+    }
+
+    for (TextSegment* it = scene->segments + text_template - 1;; it++) {
+        layout_text(l, it->literal);
+        if (it->variable < 0) break;
+        char number[24];
+        layout_text(l, (String) { (u8*) number, snprintf(number, sizeof(number), "%lld", variables[it->variable]) });
+    }
+}
+
+// if the scene looks the same with any variables, so its layout can be kept
+u8 scene_layout_is_fixed(Scene* scene, u64 language) {
+    
+    if (scene->text_template[language]) return 0;
+    
+    for (u64 i = 0; i < scene->option_count; i++) {
+        if (scene->options[i].condition || scene->options[i].text_template[language]) return 0;
+    }
+    
+    return 1;
+}
 
-void print_scene(Scene* scene, u64 language) {
+// the scene as print_scene() writes it, in l->data
+// only the options that are there with these variables are shown, and they are numbered without gaps
+void layout_scene(Layout* l, Scene* scene, u64 language, s64* variables) {
     
     const String missing = string("{missing string}");
     
+    l->count = 0;
+    layout_begin(l, 0);
+    
     String text = scene->text[language];
     if (!text.count) text = missing;
-    print(string("@\n"), text);
+    layout_template(l, scene, text, scene->text_template[language], variables);
+    layout_raw(l, string("\n"));
     
+    u64 shown = 0;
     for (u64 i = 0; i < scene->option_count; i++) {
         
-        printf("[%llu] ", i + 1);
+        Option* option = &scene->options[i];
+        if (!option_is_available(scene, option, variables)) continue;
+        
+        char   number[32];
+        String prefix = { (u8*) number, snprintf(number, sizeof(number), "[%llu] ", ++shown) };
         
-        String text = scene->options[i].text[language];
+        // on a terminal too narrow for it, the indent would leave no room for the text
+        layout_begin(l, l->width && prefix.count * 2 > l->width ? 0 : prefix.count);
+        layout_raw(l, prefix);
+        l->column = prefix.count;
+        
+        String text = option->text[language];
         if (!text.count) text = missing;
-        print(string("@\n"), text);
+        layout_template(l, scene, text, option->text_template[language], variables);
+        layout_raw(l, string("\n"));
+    }
+}
+
+
+
+
+/* ---- Running (terminal mode) ---- */
+
+// slot is the one of the scene in the scene table, the cache of the layouts uses it
+void print_scene(Layout* l, Scene* scene, u64 slot, u64 language, s64* variables) {
+    
+    u8  fixed = !l->no_cache && scene_layout_is_fixed(scene, language);
+    u64 key   = slot * max_language_count + language;
+    
+    if (fixed) {
+        String* cached = hash_map(u64, String, get)(&l->cache, key);
+        if (cached) {
+            terminal_write(*cached);
+            return;
+        }
     }
+    
+    layout_scene(l, scene, language, variables);
+    String out = { l->data, l->count };
+    
+    if (fixed) {
+        String copy = { memory_alloc(memory_layout, out.count), out.count };
+        if (copy.data) {
+            memcpy(copy.data, out.data, out.count);
+            hash_map(u64, String, put)(&l->cache, key, copy);
+        }
+    }
+    
+    terminal_write(out);
 }
 
-void run_story(Story* story) {
+// note: session can be NULL, then we start from the start label
+// note: watcher can be NULL, otherwise we reload the story when the file changes
+void run_story(Story* story, Session* session, FileWatcher* watcher) {
+    
+    LanguageTable* lang_table = &story->lang_table;
     
-    HashTable*     table       = &story->scene_table;
-    LanguageTable* lang_table  = &story->lang_table;
-    String current_scene_label = story->start_label;
-    String quit_label          = story->quit_label;
+    Session new_session;
+    if (!session) {
+        session_start(story, &new_session);
+        session = &new_session;
+    }
     
-    u64 language = 0; 
+    Layout layout;
+    layout_init(&layout, 0);
+    layout.no_cache = story->cache != NULL;
+    terminal_watch_resize();
     
     while (1) {
         
-        if (string_equal(current_scene_label, quit_label)) break;
+        if (session->scene == story->quit_index) break;
 
-        HashTableEntry* entry = table_get_entry(table, current_scene_label);
-        assert(entry != NULL);
-        
-        Scene* scene = &entry->value;
-        print_scene(scene, language);
+        TraceSpan span = trace_begin("show_scene");
+        Scene* scene = story_get_scene(story, session->scene);
+        layout_update_width(&layout);
+        print_scene(&layout, scene, session->scene, session->language, session->variables);
+        trace_end(span);
         
         ask_again:
         printf("> ");
 
+        if (watcher && !file_watcher_wait(watcher, 0)) {
+            printf("\n");
+            TraceSpan reload_span = trace_begin("reload");
+            story_reload(story, session);
+            story_watch_includes(story, watcher);
+            layout_clear(&layout); // the slots and the texts can be different now
+            trace_end(reload_span);
+            continue;
+        }
+        
+        TraceSpan input_span = trace_begin("wait_input");
         String line = string_trim_spaces(read_line());
+        trace_end(input_span);
+        if (feof(stdin) && !line.count) break;
 
         if (string_equal(line, string("quit"))  || string_equal(line, string("exit")))  break;
         if (string_equal(line, string("scene")) || string_equal(line, string("print"))) continue;
@@ -494,6 +2639,12 @@ void run_story(Story* story) {
                 "    Print Current Scene:\n"
                 "    > scene\n"
                 "    \n"
+                "    Save Game (add \"history\" to also save the chosen options):\n"
+                "    > save foo.sav\n"
+                "    \n"
+                "    Load Game:\n"
+                "    > load foo.sav\n"
+                "    \n"
                 "    Quit Game:\n"
                 "    > quit\n"
                 "=======================\n"
@@ -523,7 +2674,52 @@ void run_story(Story* story) {
                 goto ask_again;
             }
             
-            language = index;
+            session->language = index;
+        
+        } else if (string_equal(command, string("save"))) {
+            
+            String path         = string_eat_by_spaces(&line);
+            u8     with_history = string_equal(string_trim_spaces(line), string("history"));
+            
+            if (!path.count) {
+                printf("You need to provide a file to save to!\n");
+                goto ask_again;
+            }
+            
+            char* c_path = temp_alloc(path.count + 1);
+            memcpy(c_path, path.data, path.count);
+            c_path[path.count] = 0;
+            
+            if (session_save(story, session, with_history, c_path)) print(string("Saved to \"@\".\n"), path);
+            else                                                    print(string("Cannot save to \"@\".\n"), path);
+            
+            temp_free(path.count + 1);
+            goto ask_again;
+        
+        } else if (string_equal(command, string("load"))) {
+            
+            String path = string_trim_spaces(line);
+            
+            if (!path.count) {
+                printf("You need to provide a file to load!\n");
+                goto ask_again;
+            }
+            
+            char* c_path = temp_alloc(path.count + 1);
+            memcpy(c_path, path.data, path.count);
+            c_path[path.count] = 0;
+            
+            Session loaded;
+            u8 ok = session_load(story, c_path, &loaded);
+            temp_free(path.count + 1);
+            
+            if (!ok) {
+                print(string("Cannot load \"@\", or it is not saved from this story.\n"), path);
+                goto ask_again;
+            }
+            
+            free(session->history);
+            *session = loaded;
         
         } else {
             
@@ -535,12 +2731,26 @@ void run_story(Story* story) {
                     goto ask_again;
                 }
             
-                if (option_index < 1 || option_index > scene->option_count) {
+                // the number is of the shown options, find which one it is
+                u64 chosen = scene->option_count;
+                for (u64 i = 0, shown = 0; i < scene->option_count && option_index >= 1; i++) {
+                    if (!option_is_available(scene, &scene->options[i], session->variables)) continue;
+                    if (++shown == option_index) {
+                        chosen = i;
+                        break;
+                    }
+                }
+                
+                if (chosen == scene->option_count) {
                     print(string("There is no option @!\n"), command);
                     goto ask_again;
                 }
+                
+                Option* option = &scene->options[chosen];
+                if (option->effect) script_run(scene->code + option->effect - 1, session->variables);
 
-                current_scene_label = scene->options[option_index - 1].link;
+                session_push_choice(session, chosen);
+                session->scene = option->link_index;
             
             } else {
         
@@ -549,273 +2759,807 @@ void run_story(Story* story) {
             }
         }
     }
+    
+    layout_free(&layout);
 }
 
 
 
 
 
-/* ---- Export ---- */
+/* ---- Pruning ---- */
+
+/*
+    What the exporters leave out: the scenes that can't be reached from the start label, 
+    and the languages a build doesn't need. Nothing is left out by default.
+    
+    note: the quit label is always kept, the exported code needs it even if no option goes there
+*/
+
+typedef struct {
+    u8* dropped;                             // per slot, 1 if the scene is left out, NULL if we keep all
+    u64 languages[max_language_count];       // the kept languages as index in story->lang_table, in the same order
+    u64 language_count;
+    u64 dropped_count;
+} ExportFilter;
+
+ExportFilter export_filter_all(Story* story) {
+    ExportFilter filter = { .language_count = story->lang_table.count };
+    for (u64 i = 0; i < filter.language_count; i++) filter.languages[i] = i;
+    return filter;
+}
+
+u8 export_filter_keeps(ExportFilter* filter, u64 index) {
+    return !filter->dropped || !filter->dropped[index];
+}
+
+// breadth first from the start label over the links, everything we don't get to is dropped
+// note: expects all scenes parsed
+void export_filter_reachable_only(Story* story, ExportFilter* filter) {
+    
+    HashTable* table = &story->scene_table;
+    
+    u8*  reached = memory_calloc(memory_export, table->size, sizeof(u8));
+    u64* queue   = memory_alloc(memory_export, table->size * sizeof(u64));
+    u64  head    = 0;
+    u64  tail    = 0;
+    
+    u64 start;
+    u8 ok = table_get_index(table, story->start_label, &start);
+    assert(ok);
+    
+    reached[start]             = 1;
+    reached[story->quit_index] = 1;
+    queue[tail++]              = start;
+    
+    while (head < tail) {
+        Scene* scene = &table->values[queue[head++]];
+        for (u64 i = 0; i < scene->option_count; i++) {
+            u64 link = scene->options[i].link_index;
+            if (reached[link]) continue;
+            reached[link] = 1;
+            queue[tail++] = link;
+        }
+    }
+    
+    filter->dropped       = memory_calloc(memory_export, table->size, sizeof(u8));
+    filter->dropped_count = 0;
+    for (u64 i = 0; i < table->size; i++) {
+        if (!table->entries[i].occupied || reached[i]) continue;
+        filter->dropped[i] = 1;
+        filter->dropped_count++;
+    }
+    
+    memory_free(reached);
+    memory_free(queue);
+}
+
+// list is like "en,zh", gives 0 and the unknown language in unknown_out if there is one
+u8 export_filter_languages(Story* story, ExportFilter* filter, String list, String* unknown_out) {
+    
+    u8 keep[max_language_count] = {0};
+    
+    while (list.count) {
+        String language = string_trim_spaces(string_eat_by_separator(&list, string(",")));
+        if (!language.count) continue;
+        
+        u64 index;
+        if (!language_table_get_index(&story->lang_table, language, &index)) {
+            *unknown_out = language;
+            return 0;
+        }
+        keep[index] = 1;
+    }
+    
+    // the story order, so the first language is still the default one if we keep it
+    filter->language_count = 0;
+    for (u64 i = 0; i < story->lang_table.count; i++) {
+        if (keep[i]) filter->languages[filter->language_count++] = i;
+    }
+    
+    return 1;
+}
+
+// the flags of the export commands, after the story is parsed since they depend on it
+ExportFilter export_filter_from_args(Story* story, char** args, int arg_count) {
+    
+    ExportFilter filter = export_filter_all(story);
+    
+    for (int i = 0; i < arg_count; i++) {
+        
+        if (strcmp(args[i], "--reachable-only") == 0) {
+            
+            export_filter_reachable_only(story, &filter);
+        
+        } else if (strcmp(args[i], "--languages") == 0) {
+            
+            if (i + 1 >= arg_count) hard_error("--languages needs a list like en,zh.\n");
+            
+            String unknown;
+            if (!export_filter_languages(story, &filter, c_string_to_string(args[i + 1]), &unknown)) {
+                print(string("Error: The story does not contain language \"@\".\n"), unknown);
+                hard_exit();
+            }
+            if (!filter.language_count) hard_error("--languages needs at least one language.\n");
+            i++;
+        
+        } else {
+            
+            hard_error("Unknown option \"%s\" for export.\n", args[i]);
+        }
+    }
+    
+    return filter;
+}
 
-u8 export_story_to_graphviz_dot_file(Story* story, char* file_name) {
+// what we left out, so a smaller build is not a surprise
+void export_filter_report(Story* story, ExportFilter* filter) {
+    
+    HashTable* table = &story->scene_table;
+    
+    if (filter->dropped_count) {
+        
+        printf("Dropped %llu scenes not reachable from ", filter->dropped_count);
+        print(string("[@]:\n"), story->start_label);
+        
+        u64         count;
+        SceneOrder* order = story_scene_order(story, &count);
+        for (u64 i = 0; i < count; i++) {
+            u64 index = order[i].index;
+            if (!filter->dropped[index]) continue;
+            printf("    %s:%llu: ", story->files[table->values[index].file].name, table->values[index].line);
+            print(string("[@]\n"), table->entries[index].key);
+        }
+        memory_free(order);
+    }
     
-    FILE* f = fopen(file_name, "wb");
-    if (!f) return 0;
+    if (filter->language_count < story->lang_table.count) {
+        
+        printf("Dropped %llu languages:", story->lang_table.count - filter->language_count);
+        
+        u64 next = 0;
+        for (u64 i = 0; i < story->lang_table.count; i++) {
+            if (next < filter->language_count && filter->languages[next] == i) next++;
+            else print(string(" @"), story->lang_table.data[i]);
+        }
+        printf("\n");
+    }
+}
+
+
+
+
+/* ---- Export ---- */
+
+// the exporters only write to w, the caller opens and closes it (see Writer)
+
+void export_story_to_graphviz_dot_file(Story* story, ExportFilter* filter, Writer* w) {
     
     HashTable* table = &story->scene_table;
 
-    fprintf(f, "digraph {\n");
-    fprintf(f, "    node [fontname=\"sans-serif\", shape=\"box\"];\n");
+    writer_view(w, string("digraph {\n"));
+    writer_view(w, string("    node [fontname=\"sans-serif\", shape=\"box\"];\n"));
     
     for (u64 i = 0; i < table->size; i++) {
         
         HashTableEntry* entry = &table->entries[i];
         if (!entry->occupied) continue;
+        if (!export_filter_keeps(filter, i)) continue;
         
-        Scene* scene = &entry->value;
+        Scene* scene = &table->values[i];
         for (u64 i = 0; i < scene->option_count; i++) {
-            file_print(f, string("    \"@\" -> \"@\";\n"), entry->key, scene->options[i].link);
+            writer_print(w, string("    \"@\" -> \"@\";\n"), entry->key, scene->options[i].link);
         }
     }
     
-    fprintf(f, "}\n");
-    
-    fflush(f);
-    fclose(f);
-    
-    return 1;
+    writer_view(w, string("}\n"));
 }
 
 // note: hack
-void file_print_string_as_twee_identifier(FILE* f, String s) {
+void writer_twee_identifier(Writer* w, String s) {
+    
+    // most labels have no '_', so they can be a view
+    u64 start = 0;
     for (u64 i = 0; i < s.count; i++) {
-        u8 c = s.data[i];
-        if (c == '_') {
-            fputc(' ', f);
-        } else {
-            fputc(c, f);
-        }
+        if (s.data[i] != '_') continue;
+        writer_view(w, string_view(s, start, i));
+        writer_u8(w, ' ');
+        start = i + 1;
     }
+    
+    writer_view(w, string_view(s, start, s.count));
 }
 
 // The .twee format for Twine 
 // note: currently we need to set the starting point in Twine manually
-// todo: all the string_equal() with quit label may be slow
-u8 export_story_to_twee(Story* story, u64 language, char* file_name) {
+// note: the language is one of the kept ones in filter, the caller checks it
+void export_story_to_twee(Story* story, ExportFilter* filter, u64 language, Writer* w) {
 
     HashTable* table = &story->scene_table;
 
-    FILE* f = fopen(file_name, "wb");
-    if (!f) return 0;
-
     for (u64 i = 0; i < table->size; i++) {
         
         HashTableEntry* entry = &table->entries[i];
         if (!entry->occupied) continue;
-        if (string_equal(entry->key, story->quit_label)) continue;
+        if (!export_filter_keeps(filter, i)) continue;
+        if (i == story->quit_index) continue;
         
-        Scene* scene = &entry->value;
+        Scene* scene = &table->values[i];
 
-        file_print(f, string(":: "));
-        file_print_string_as_twee_identifier(f, entry->key);
-        file_print(f, string("\n@\n"), scene->text[language]);
+        writer_view(w, string(":: "));
+        writer_twee_identifier(w, entry->key);
+        writer_print(w, string("\n@\n"), scene->text[language]);
         
         for (u64 j = 0; j < scene->option_count; j++) {
             
             Option* option = &scene->options[j];
 
-            if (string_equal(option->link, story->quit_label)) continue;
+            if (option->link_index == story->quit_index) continue;
             
-            file_print(f, string("[[@->"), option->text[language]); 
-            file_print_string_as_twee_identifier(f, option->link);
-            fprintf(f, "]]\n");
+            writer_print(w, string("[[@->"), option->text[language]); 
+            writer_twee_identifier(w, option->link);
+            writer_view(w, string("]]\n"));
         }
         
-        fprintf(f, "\n");
+        writer_u8(w, '\n');
     }
+}
+
+typedef struct {
+    Story*        story;
+    ExportFilter* filter;
+    char**        paths;  // per kept language
+    u8*           ok;
+} TweeWork;
 
-    fflush(f);
-    fclose(f);
+void export_twee_language(void* data, u64 index) {
+    
+    TweeWork* work = data;
+    TraceSpan span = trace_begin("export_twee");
+    
+    Writer w;
+    if (writer_open(&w, work->paths[index], writer_gather)) {
+        export_story_to_twee(work->story, work->filter, work->filter->languages[index], &w);
+        work->ok[index] = writer_close(&w);
+    }
+    
+    trace_end(span);
+}
 
-    return 1;
+// one parse, then dir/<language>.twee for every kept language, each written by its own thread
+// note: gives 0 if any of them failed, the ones that didn't fail are still written
+u8 export_story_to_twee_all_languages(Story* story, ExportFilter* filter, char* dir) {
+    
+    if (!make_directory(dir)) return 0;
+    
+    u64   count   = filter->language_count;
+    char* paths[max_language_count];
+    u8    ok[max_language_count] = {0};
+    
+    for (u64 i = 0; i < count; i++) {
+        String language = story->lang_table.data[filter->languages[i]];
+        u64    size     = strlen(dir) + 1 + language.count + 6;
+        paths[i] = malloc(size);
+        snprintf(paths[i], size, "%s/%.*s.twee", dir, (int) language.count, (char*) language.data);
+    }
+    
+    TweeWork work = { story, filter, paths, ok };
+    run_parallel(export_twee_language, &work, count);
+    
+    u8 all_ok = 1;
+    for (u64 i = 0; i < count; i++) {
+        if (ok[i]) printf("Wrote \"%s\".\n", paths[i]);
+        else       printf("Cannot write \"%s\".\n", paths[i]);
+        all_ok &= ok[i];
+        free(paths[i]);
+    }
+    
+    return all_ok;
 }
 
 // for outputting valid C99 identifiers (because a scene label string is in utf-8)
 // todo: maybe this is too long? use compressed base62 or something?
-void file_print_string_as_byte_literal_identifier(FILE* f, String s) {
-    fprintf(f, "identifier_");
+void writer_byte_literal_identifier(Writer* w, String s) {
+    
+    const char* digits = "0123456789abcdef";
+    
+    u8  buffer[256];
+    u64 count = 0;
+    
+    writer_copy(w, string("identifier_"));
     for (u64 i = 0; i < s.count; i++) {
-        fprintf(f, "%x", s.data[i]);
+        
+        if (count + 2 > sizeof(buffer)) {
+            writer_copy(w, (String) { buffer, count });
+            count = 0;
+        }
+        
+        // same as "%x", so no leading zero
+        u8 c = s.data[i];
+        if (c >> 4) buffer[count++] = digits[c >> 4];
+        buffer[count++] = digits[c & 15];
     }
+    writer_copy(w, (String) { buffer, count });
 }
 
-// todo: better and more robust interface, localized help command
-u8 export_story_to_c_code(Story* story, char* file_name) {
+// the same instructions and the same loop as script_run(), see script.c
+void export_script_vm_to_c_code(Story* story, Writer* w) {
     
-    HashTable*     table      = &story->scene_table;
-    LanguageTable* lang_table = &story->lang_table;
+    writer_view(w, string("enum {\n"));
+    for (u64 i = 0; i < op_count; i++) writer_printf(w, "    %s,\n", opcode_names[i]);
+    writer_view(w, string("};\n\n"));
     
-    FILE* f = fopen(file_name, "wb");
-    if (!f) return 0;
-
-    fprintf(
-        f,
-        "#include <stdio.h>\n"
-        "#include <string.h>\n\n"
+    writer_view(
+        w,
+        string(
+            "typedef struct {\n"
+            "    unsigned char op, dst, a, b;\n"
+            "    int           value;\n"
+            "} Instruction;\n\n"
+        )
     );
-
-    fprintf(
-        f,
-        "typedef struct {\n"
-        "    int   link;\n"
-        "    char* text[%llu];\n"
-        "} Choice;\n\n",
-        lang_table->count
+    
+    writer_printf(w, "long long variables[%llu] = {", story->var_table.count);
+    for (u64 i = 0; i < story->var_table.count; i++) {
+        writer_printf(w, "%s%lld", i ? ", " : " ", story->var_table.initial[i]);
+    }
+    writer_view(w, string(" };\n\n"));
+    
+    writer_view(
+        w,
+        string(
+            "typedef unsigned long long u64;\n\n"
+            "long long run(const Instruction* it) {\n"
+            "    long long r[16] = {0};\n"
+            "    for (;; it++) {\n"
+            "        long long a = r[it->a], b = r[it->b];\n"
+            "        switch (it->op) {\n"
+            "            case op_end:    return 0;\n"
+            "            case op_return: return a;\n"
+            "            case op_const:  r[it->dst] = it->value;                 break;\n"
+            "            case op_load:   r[it->dst] = variables[it->value];      break;\n"
+            "            case op_store:  variables[it->value] = a;               break;\n"
+            "            case op_add:    r[it->dst] = (long long) ((u64) a + (u64) b); break;\n"
+            "            case op_sub:    r[it->dst] = (long long) ((u64) a - (u64) b); break;\n"
+            "            case op_mul:    r[it->dst] = (long long) ((u64) a * (u64) b); break;\n"
+            "            case op_div:    r[it->dst] = b == 0 ? 0 : b == -1 ? (long long) (0 - (u64) a) : a / b; break;\n"
+            "            case op_mod:    r[it->dst] = b == 0 || b == -1 ? 0 : a % b; break;\n"
+            "            case op_eq:     r[it->dst] = a == b;                    break;\n"
+            "            case op_ne:     r[it->dst] = a != b;                    break;\n"
+            "            case op_lt:     r[it->dst] = a <  b;                    break;\n"
+            "            case op_le:     r[it->dst] = a <= b;                    break;\n"
+            "            case op_gt:     r[it->dst] = a >  b;                    break;\n"
+            "            case op_ge:     r[it->dst] = a >= b;                    break;\n"
+            "            case op_and:    r[it->dst] = a && b;                    break;\n"
+            "            case op_or:     r[it->dst] = a || b;                    break;\n"
+            "            case op_not:    r[it->dst] = !a;                        break;\n"
+            "            case op_neg:    r[it->dst] = (long long) (0 - (u64) a); break;\n"
+            "        }\n"
+            "    }\n"
+            "}\n\n"
+            "typedef struct {\n"
+            "    const char* text;\n"
+            "    int         variable;\n"
+            "} Segment;\n\n"
+            "void print_text(const char* text, const Segment* segment) {\n"
+            "    if (!segment) {\n"
+            "        printf(\"%s\", text);\n"
+            "        return;\n"
+            "    }\n"
+            "    for (;; segment++) {\n"
+            "        printf(\"%s\", segment->text);\n"
+            "        if (segment->variable < 0) return;\n"
+            "        printf(\"%lld\", variables[segment->variable]);\n"
+            "    }\n"
+            "}\n\n"
+        )
     );
+}
 
-    fprintf(
-        f,
-        "typedef struct {\n"
-        "    char*  text[%llu];\n"
-        "    Choice choices[8];\n"
-        "    int    choice_count;\n"
-        "} Scene;\n\n",
-        lang_table->count
-    );
+// the segments of the texts of a scene or an option, by language
+void writer_c_text_templates(Writer* w, Story* story, ExportFilter* filter, String label, u16* text_template) {
+    
+    writer_u8(w, '{');
+    
+    u8 any = 0;
+    for (u64 i = 0; i < filter->language_count; i++) {
+        
+        u16 at = text_template[filter->languages[i]];
+        if (!at) continue;
+        
+        writer_print(w, string(" [@] = segments_"), story->lang_table.data[filter->languages[i]]);
+        writer_byte_literal_identifier(w, label);
+        writer_printf(w, " + %u,", at - 1);
+        any = 1;
+    }
+    
+    writer_view(w, any ? string(" }") : string(" 0 }"));
+}
+
+// one array per scene that has conditions or effects, and one for the segments of its texts
+void export_script_code_to_c_code(Story* story, ExportFilter* filter, Writer* w) {
+    
+    HashTable* table = &story->scene_table;
+    
+    for (u64 i = 0; i < table->size; i++) {
+        
+        HashTableEntry* entry = &table->entries[i];
+        Scene*          scene = &table->values[i];
+        if (!entry->occupied || i == story->quit_index || !export_filter_keeps(filter, i) || !scene->code_count) continue;
+        
+        writer_view(w, string("const Instruction code_"));
+        writer_byte_literal_identifier(w, entry->key);
+        writer_view(w, string("[] = {\n"));
+        
+        for (u64 j = 0; j < scene->code_count; j++) {
+            Instruction* it = &scene->code[j];
+            writer_printf(w, "    { %s, %u, %u, %u, %d },\n", opcode_names[it->op], it->dst, it->a, it->b, it->value);
+        }
+        
+        writer_view(w, string("};\n\n"));
+    }
+    
+    for (u64 i = 0; i < table->size; i++) {
+        
+        HashTableEntry* entry = &table->entries[i];
+        Scene*          scene = &table->values[i];
+        if (!entry->occupied || i == story->quit_index || !export_filter_keeps(filter, i) || !scene->segment_count) continue;
+        
+        writer_view(w, string("const Segment segments_"));
+        writer_byte_literal_identifier(w, entry->key);
+        writer_view(w, string("[] = {\n"));
+        
+        for (u64 j = 0; j < scene->segment_count; j++) {
+            TextSegment* it = &scene->segments[j];
+            writer_view(w, string("    { "));
+            writer_quoted_string(w, it->literal);
+            writer_printf(w, ", %d },\n", it->variable);
+        }
+        
+        writer_view(w, string("};\n\n"));
+    }
+}
+
+// todo: better and more robust interface, localized help command
+// find_scene() for the generated code, the same steps as perfect_hash_get(), see hash_table.c
+void export_lookup_to_c_code(Story* story, ExportFilter* filter, Writer* w) {
+    
+    HashTable* table = &story->scene_table;
+    
+    u64  count = 0;
+    u64* slots = memory_alloc(memory_export, table->size * sizeof(u64));
+    for (u64 i = 0; i < table->size; i++) {
+        if (table->entries[i].occupied && export_filter_keeps(filter, i)) slots[count++] = i;
+    }
+    
+    String* labels = memory_alloc(memory_export, count * sizeof(String));
+    for (u64 i = 0; i < count; i++) labels[i] = table->entries[slots[i]].key;
+    
+    // the labels are unique, so this can't fail
+    PerfectHash lookup;
+    u8 built = perfect_hash_build(&lookup, labels, count, memory_export);
+    assert(built);
+    
+    writer_view(w, string("const char* labels[] = {\n"));
+    for (u64 i = 0; i < count; i++) {
+        writer_view(w, string("    ["));
+        writer_byte_literal_identifier(w, labels[i]);
+        writer_view(w, string("] = "));
+        writer_quoted_string(w, labels[i]);
+        writer_view(w, string(",\n"));
+    }
+    writer_view(w, string("};\n\n"));
     
-    fprintf(
-        f,
-        "void print_scene(Scene* scene, int language) {\n"
-        "    printf(\"\\n%%s\\n\", scene->text[language]);\n"
-        "    for (int i = 0; i < scene->choice_count; i++) {\n"
-        "        printf(\"[%%d] %%s\\n\", i + 1, scene->choices[i].text[language]);\n"
+    writer_printf(w, "const unsigned int lookup_displacements[%llu][2] = {\n", lookup.bucket_count);
+    for (u64 i = 0; i < lookup.bucket_count; i++) {
+        writer_printf(w, "    { %u, %u },\n", lookup.displacements[2 * i], lookup.displacements[2 * i + 1]);
+    }
+    writer_view(w, string("};\n\n"));
+    
+    u64* by_place = memory_alloc(memory_export, count * sizeof(u64));
+    for (u64 i = 0; i < count; i++) by_place[perfect_hash_get(&lookup, labels[i])] = i;
+    
+    writer_printf(w, "const int lookup_scenes[%llu] = {\n", count);
+    for (u64 i = 0; i < count; i++) {
+        writer_view(w, string("    "));
+        writer_byte_literal_identifier(w, labels[by_place[i]]);
+        writer_view(w, string(",\n"));
+    }
+    writer_view(w, string("};\n\n"));
+    
+    writer_printf(
+        w,
+        "int find_scene(const char* label) {\n"
+        "    unsigned long long hash = 0xcbf29ce484222325ULL ^ %uULL;\n"
+        "    for (const unsigned char* c = (const unsigned char*) label; *c; c++) {\n"
+        "        hash ^= *c;\n"
+        "        hash *= 0x100000001b3ULL;\n"
         "    }\n"
-        "}\n\n"
+        "    hash ^= hash >> 33;\n"
+        "    hash *= 0xff51afd7ed558ccdULL;\n"
+        "    hash ^= hash >> 33;\n"
+        "    hash *= 0xc4ceb9fe1a85ec53ULL;\n"
+        "    hash ^= hash >> 33;\n"
+        "    const unsigned int* d = lookup_displacements[hash %% %lluULL];\n"
+        "    unsigned long long f1 = (hash >> 32) %% %lluULL;\n"
+        "    unsigned long long f2 = ((hash * 0x9e3779b97f4a7c15ULL) >> 32) %% %lluULL;\n"
+        "    int scene = lookup_scenes[(f1 + d[0] * f2 + d[1]) %% %lluULL];\n"
+        "    return strcmp(labels[scene], label) == 0 ? scene : -1;\n"
+        "}\n\n",
+        lookup.seed, lookup.bucket_count, count, count, count
+    );
+    
+    perfect_hash_free(&lookup);
+    memory_free(by_place);
+    memory_free(labels);
+    memory_free(slots);
+}
+
+void export_story_to_c_code(Story* story, ExportFilter* filter, Writer* w) {
+    
+    HashTable*     table          = &story->scene_table;
+    LanguageTable* lang_table     = &story->lang_table;
+    u64*           languages      = filter->languages;  // index in lang_table of each language we export
+    u64            language_count = filter->language_count;
+    
+    // a story without variables gives the same code as before we had them
+    u8 has_script = story->var_table.count > 0;
+    
+    writer_view(
+        w,
+        string(
+            "#include <stdio.h>\n"
+            "#include <string.h>\n\n"
+        )
     );
+
+    if (has_script) export_script_vm_to_c_code(story, w);
+
+    if (has_script) {
+        
+        writer_printf(
+            w,
+            "typedef struct {\n"
+            "    int            link;\n"
+            "    char*          text[%llu];\n"
+            "    int            condition;\n"
+            "    int            effect;\n"
+            "    const Segment* text_template[%llu];\n"
+            "} Choice;\n\n",
+            language_count, language_count
+        );
+
+        writer_printf(
+            w,
+            "typedef struct {\n"
+            "    char*              text[%llu];\n"
+            "    Choice             choices[8];\n"
+            "    int                choice_count;\n"
+            "    const Instruction* code;\n"
+            "    const Segment*     text_template[%llu];\n"
+            "} Scene;\n\n",
+            language_count, language_count
+        );
+    
+    } else {
     
-    fprintf(f, "enum {\n");
-    for (u64 i = 0; i < lang_table->count; i++) {
-        file_print(f, string("    @,\n"), lang_table->data[i]); // todo: is it better to also byte literal this?
+        writer_printf(
+            w,
+            "typedef struct {\n"
+            "    int   link;\n"
+            "    char* text[%llu];\n"
+            "} Choice;\n\n",
+            language_count
+        );
+
+        writer_printf(
+            w,
+            "typedef struct {\n"
+            "    char*  text[%llu];\n"
+            "    Choice choices[8];\n"
+            "    int    choice_count;\n"
+            "} Scene;\n\n",
+            language_count
+        );
     }
-    fprintf(f, "};\n\n");
+    
+    if (has_script) {
+        
+        writer_view(
+            w,
+            string(
+                "int is_available(Scene* scene, int i) {\n"
+                "    int condition = scene->choices[i].condition;\n"
+                "    return !condition || run(scene->code + condition - 1) != 0;\n"
+                "}\n\n"
+                "void print_scene(Scene* scene, int language) {\n"
+                "    printf(\"\\n\");\n"
+                "    print_text(scene->text[language], scene->text_template[language]);\n"
+                "    printf(\"\\n\");\n"
+                "    for (int i = 0, shown = 0; i < scene->choice_count; i++) {\n"
+                "        if (!is_available(scene, i)) continue;\n"
+                "        printf(\"[%d] \", ++shown);\n"
+                "        print_text(scene->choices[i].text[language], scene->choices[i].text_template[language]);\n"
+                "        printf(\"\\n\");\n"
+                "    }\n"
+                "}\n\n"
+            )
+        );
+    
+    } else {
+        
+        writer_view(
+            w,
+            string(
+                "void print_scene(Scene* scene, int language) {\n"
+                "    printf(\"\\n%s\\n\", scene->text[language]);\n"
+                "    for (int i = 0; i < scene->choice_count; i++) {\n"
+                "        printf(\"[%d] %s\\n\", i + 1, scene->choices[i].text[language]);\n"
+                "    }\n"
+                "}\n\n"
+            )
+        );
+    }
+    
+    writer_view(w, string("enum {\n"));
+    for (u64 i = 0; i < language_count; i++) {
+        writer_print(w, string("    @,\n"), lang_table->data[languages[i]]); // todo: is it better to also byte literal this?
+    }
+    writer_view(w, string("};\n\n"));
 
-    fprintf(f, "enum {\n");
+    writer_view(w, string("enum {\n"));
     for (u64 i = 0; i < table->size; i++) {
         
         HashTableEntry* entry = &table->entries[i];
         if (!entry->occupied) continue;
+        if (!export_filter_keeps(filter, i)) continue;
         
-        fprintf(f, "    ");
-        file_print_string_as_byte_literal_identifier(f, entry->key);
-        fprintf(f, ",\n");
+        writer_view(w, string("    "));
+        writer_byte_literal_identifier(w, entry->key);
+        writer_view(w, string(",\n"));
     }
-    fprintf(f, "};\n\n");
+    writer_view(w, string("};\n\n"));
 
-    u64 quit_index = 0;
-    {
-        u8 ok = table_get_index(table, story->quit_label, &quit_index);
-        assert(ok);
-    }
+    if (has_script) export_script_code_to_c_code(story, filter, w);
 
-    fprintf(f, "Scene scenes[] = {\n");
+    writer_view(w, string("Scene scenes[] = {\n"));
     for (u64 i = 0; i < table->size; i++) {
         
         HashTableEntry* entry = &table->entries[i];
         if (!entry->occupied) continue;
-        if (i == quit_index)  continue;
+        if (i == story->quit_index) continue;
+        if (!export_filter_keeps(filter, i)) continue;
         
-        fprintf(f, "    [");
-        file_print_string_as_byte_literal_identifier(f, entry->key);
-        fprintf(f, "] = {\n");
+        writer_view(w, string("    ["));
+        writer_byte_literal_identifier(w, entry->key);
+        writer_view(w, string("] = {\n"));
         
-        file_print(f, string("        {\n"));
-        Scene* scene = &entry->value;
-        for (u64 j = 0; j < lang_table->count; j++) {
-            file_print(f, string("            [@] = "), lang_table->data[j]);
-            file_print_quoted_string(f, scene->text[j]);
-            file_print(f, string(",\n"));
+        writer_view(w, string("        {\n"));
+        Scene* scene = &table->values[i];
+        for (u64 j = 0; j < language_count; j++) {
+            writer_print(w, string("            [@] = "), lang_table->data[languages[j]]);
+            writer_quoted_string(w, scene->text[languages[j]]);
+            writer_view(w, string(",\n"));
         }
-        file_print(f, string("        },\n"));
+        writer_view(w, string("        },\n"));
         
-        file_print(f, string("        {\n"));
+        writer_view(w, string("        {\n"));
         for (u64 j = 0; j < scene->option_count; j++) {
 
             Option* option = &scene->options[j];
 
-            file_print(f, string("            {\n"));
-            fprintf(f, "                ");
-            file_print_string_as_byte_literal_identifier(f, option->link);
-            fprintf(f, ",\n");
+            writer_view(w, string("            {\n"));
+            writer_view(w, string("                "));
+            writer_byte_literal_identifier(w, option->link);
+            writer_view(w, string(",\n"));
             
-            file_print(f, string("                {\n"));
-            for (u64 k = 0; k < lang_table->count; k++) {
-                file_print(f, string("                    [@] = "), lang_table->data[k]);
-                file_print_quoted_string(f, option->text[k]);
-                file_print(f, string(",\n"));
+            writer_view(w, string("                {\n"));
+            for (u64 k = 0; k < language_count; k++) {
+                writer_print(w, string("                    [@] = "), lang_table->data[languages[k]]);
+                writer_quoted_string(w, option->text[languages[k]]);
+                writer_view(w, string(",\n"));
+            }
+            writer_view(w, string("                },\n"));
+
+            if (has_script) {
+                writer_printf(w, "                %u,\n                %u,\n                ", option->condition, option->effect);
+                writer_c_text_templates(w, story, filter, entry->key, option->text_template);
+                writer_view(w, string(",\n"));
             }
-            file_print(f, string("                },\n"));
 
-            file_print(f, string("            },\n"));
+            writer_view(w, string("            },\n"));
             
         }
-        file_print(f, string("        },\n"));
+        writer_view(w, string("        },\n"));
         
-        fprintf(f, "        %llu\n", scene->option_count); 
+        writer_printf(w, "        %llu%s\n", scene->option_count, has_script ? "," : ""); 
+        
+        if (has_script) {
+            writer_view(w, string("        "));
+            if (scene->code_count) {
+                writer_view(w, string("code_"));
+                writer_byte_literal_identifier(w, entry->key);
+            } else {
+                writer_view(w, string("0"));
+            }
+            writer_view(w, string(",\n        "));
+            writer_c_text_templates(w, story, filter, entry->key, scene->text_template);
+            writer_view(w, string("\n"));
+        }
         
-        file_print(f, string("    },\n"));
+        writer_view(w, string("    },\n"));
     }
-    fprintf(f, "};\n\n");
-
-    fprintf(
-        f, 
-        "int main() {\n"
-        "\n"    
-        "    setvbuf(stdout, NULL, _IONBF, 0);\n"
-        "\n"
-        "    int  language = 0;\n"
-        "    int  current_scene_index = "
+    writer_view(w, string("};\n\n"));
+
+    export_lookup_to_c_code(story, filter, w);
+
+    writer_view(
+        w, 
+        string(
+            "int main() {\n"
+            "\n"    
+            "    setvbuf(stdout, NULL, _IONBF, 0);\n"
+            "\n"
+            "    int  language = 0;\n"
+            "    int  current_scene_index = "
+        )
     );
 
-    file_print_string_as_byte_literal_identifier(f, story->start_label);
-
-    fprintf(
-        f, 
-        ";\n"
-        "    char input[256];\n"
-        "\n"
-        "    while (1) {\n"
-        "\n"        
-        "        if (current_scene_index == "
+    writer_byte_literal_identifier(w, story->start_label);
+
+    writer_view(
+        w, 
+        string(
+            ";\n"
+            "    char input[256];\n"
+            "\n"
+            "    while (1) {\n"
+            "\n"        
+            "        if (current_scene_index == "
+        )
     );
     
-    file_print_string_as_byte_literal_identifier(f, story->quit_label);
-    
-    fprintf(
-        f,
-        ") break;\n"
-        "\n"
-        "        Scene* scene = &scenes[current_scene_index];\n"
-        "        print_scene(scene, language);\n"
-        "\n"        
-        "        ask_again:\n"
-        "        printf(\"> \");\n"
-        "        fgets(input, sizeof(input), stdin);\n"
-        "\n"
-        "        if (strstr(input, \"quit\")  || strstr(input, \"exit\"))  break;\n"
-        "        if (strstr(input, \"scene\") || strstr(input, \"print\")) continue;\n"
-        "\n"        
-        "        if (strstr(input, \"lang\")) {\n"
+    writer_byte_literal_identifier(w, story->quit_label);
+    
+    writer_view(
+        w,
+        string(
+            ") break;\n"
+            "\n"
+            "        Scene* scene = &scenes[current_scene_index];\n"
+            "        print_scene(scene, language);\n"
+            "\n"        
+            "        ask_again:\n"
+            "        printf(\"> \");\n"
+            "        fgets(input, sizeof(input), stdin);\n"
+            "\n"
+            "        if (strncmp(input, \"goto \", 5) == 0) {\n"
+            "            input[strcspn(input, \"\\n\")] = 0;\n"
+            "            int found = find_scene(input + 5);\n"
+            "            if (found < 0) {\n"
+            "                printf(\"There is no scene called \\\"%s\\\".\\n\", input + 5);\n"
+            "                goto ask_again;\n"
+            "            }\n"
+            "            current_scene_index = found;\n"
+            "            goto next;\n"
+            "        }\n"
+            "\n"
+            "        if (strstr(input, \"quit\")  || strstr(input, \"exit\"))  break;\n"
+            "        if (strstr(input, \"scene\") || strstr(input, \"print\")) continue;\n"
+            "\n"        
+            "        if (strstr(input, \"lang\")) {\n"
+        )
     );
 
-    fprintf(f, "            const char* langs[] = {\n");
-    for (u64 i = 0; i < lang_table->count; i++) {
-        String lang = lang_table->data[i];
-        file_print(f, string("                [@] = \"@\",\n"), lang, lang);
+    writer_view(w, string("            const char* langs[] = {\n"));
+    for (u64 i = 0; i < language_count; i++) {
+        String lang = lang_table->data[languages[i]];
+        writer_print(w, string("                [@] = \"@\",\n"), lang, lang);
     }
-    fprintf(f, "            };\n");
+    writer_view(w, string("            };\n"));
 
-    fprintf(
-        f, 
+    writer_printf(
+        w, 
         "            for (int i = 0; i < %llu; i++) {\n"
         "                if (strstr(input, langs[i])) {\n"
         "                    language = i;\n"
@@ -824,35 +3568,56 @@ u8 export_story_to_c_code(Story* story, char* file_name) {
         "            }\n"
         "            goto ask_again;\n"
         "        }\n\n",
-        lang_table->count
-    );
-
-    fprintf(
-        f, 
-        "        {\n"
-        "            const char* nums[] = {\"1\", \"2\", \"3\", \"4\", \"5\", \"6\", \"7\", \"8\"};\n"
-        "            for (int i = 0; i < scene->choice_count; i++) {\n"
-        "                if (strstr(input, nums[i])) {\n"
-        "                    current_scene_index = scene->choices[i].link;\n"
-        "                    goto next;\n"
-        "                }\n"
-        "            }\n"
-        "        }\n\n"
+        language_count
     );
 
-    fprintf(
-        f, 
-        "        printf(\"We don't know what you want to do!\\nType the option number to choose it.\\n\");\n"
-        "        goto ask_again;\n" 
-        "\n"        
-        "        next: continue;\n"
-        "    }\n"
-        "}\n"
-    );
+    if (has_script) {
+        
+        writer_view(
+            w, 
+            string(
+                "        {\n"
+                "            const char* nums[] = {\"1\", \"2\", \"3\", \"4\", \"5\", \"6\", \"7\", \"8\"};\n"
+                "            for (int i = 0, shown = 0; i < scene->choice_count; i++) {\n"
+                "                if (!is_available(scene, i)) continue;\n"
+                "                if (strstr(input, nums[shown++])) {\n"
+                "                    Choice* choice = &scene->choices[i];\n"
+                "                    if (choice->effect) run(scene->code + choice->effect - 1);\n"
+                "                    current_scene_index = choice->link;\n"
+                "                    goto next;\n"
+                "                }\n"
+                "            }\n"
+                "        }\n\n"
+            )
+        );
     
-    fflush(f);
-    fclose(f);
+    } else {
     
-    return 1;
-}
+        writer_view(
+            w, 
+            string(
+                "        {\n"
+                "            const char* nums[] = {\"1\", \"2\", \"3\", \"4\", \"5\", \"6\", \"7\", \"8\"};\n"
+                "            for (int i = 0; i < scene->choice_count; i++) {\n"
+                "                if (strstr(input, nums[i])) {\n"
+                "                    current_scene_index = scene->choices[i].link;\n"
+                "                    goto next;\n"
+                "                }\n"
+                "            }\n"
+                "        }\n\n"
+            )
+        );
+    }
 
+    writer_view(
+        w, 
+        string(
+            "        printf(\"We don't know what you want to do!\\nType the option number to choose it.\\n\");\n"
+            "        goto ask_again;\n" 
+            "\n"        
+            "        next: continue;\n"
+            "    }\n"
+            "}\n"
+        )
+    );
+}
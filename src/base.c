@@ -92,3 +92,11 @@ void temp_info() {
         a->data, a->size, a->allocated, a->highest
     );
 }
+
+
+
+
+/* ==== Errors ==== */
+
+// in backend.c, since story check collects what it says, declared here so the code before it can fail with it too (out of memory and the like)
+void hard_error(char* s, ...);
@@ -0,0 +1,419 @@
+/* ==== Bench ==== */
+
+/* ---- Story Generator ---- */
+
+// a story with a known shape, so benchmarks don't depend on a file we have to keep around
+
+typedef struct {
+    u64 scene_count;
+    u64 language_count;
+    u64 option_count;    // per scene
+    u64 text_bytes;      // per scene text, option texts are a quarter of it
+    u64 seed;
+} StoryShape;
+
+typedef struct {
+    u8* data;
+    u64 count;
+    u64 allocated;
+} ByteBuffer;
+
+void byte_buffer_push(ByteBuffer* b, String s) {
+    
+    if (b->count + s.count > b->allocated) {
+        u64 wanted = b->allocated ? b->allocated : 65536;
+        while (wanted < b->count + s.count) wanted *= 2;
+        b->data = realloc(b->data, wanted);
+        if (!b->data) hard_error("Out of memory when generating a story.\n");
+        b->allocated = wanted;
+    }
+    
+    memcpy(b->data + b->count, s.data, s.count);
+    b->count += s.count;
+}
+
+void byte_buffer_printf(ByteBuffer* b, char* format, ...) {
+    
+    char buffer[256];
+    
+    va_list args;
+    va_start(args, format);
+    int count = vsnprintf(buffer, sizeof(buffer), format, args);
+    va_end(args);
+    
+    if (count > 0) byte_buffer_push(b, (String) { (u8*) buffer, (u64) count < sizeof(buffer) ? (u64) count : sizeof(buffer) - 1 });
+}
+
+// xorshift64, good enough for made up text
+u64 random_next(u64* state) {
+    u64 x = *state;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    return *state = x;
+}
+
+// words of lowercase letters, ends with a letter, so trimming doesn't change it
+void generate_text(ByteBuffer* b, u64* random, u64 count) {
+    
+    u8  line[1024];
+    u64 acc = 0;
+    
+    if (count > sizeof(line)) count = sizeof(line);
+    if (count < 1)            count = 1;
+    
+    while (acc < count) {
+        u64 word = 1 + random_next(random) % 9;
+        for (u64 i = 0; i < word && acc < count; i++) line[acc++] = 'a' + random_next(random) % 26;
+        if (acc + 1 < count) line[acc++] = ' ';
+    }
+    
+    byte_buffer_push(b, (String) { line, acc });
+}
+
+// scene i always has an option to scene i + 1, so everything is reachable, the other options go anywhere
+String generate_story(StoryShape shape) {
+    
+    ByteBuffer b      = {0};
+    u64        random = shape.seed ? shape.seed : 0x9e3779b97f4a7c15;
+    
+    if (shape.scene_count < 1)    shape.scene_count = 1;
+    if (shape.language_count < 1) shape.language_count = 1;
+    if (shape.language_count >= max_language_count) shape.language_count = max_language_count - 1;
+    if (shape.option_count < 1)   shape.option_count = 1;
+    if (shape.option_count > 8)   shape.option_count = 8;
+    
+    byte_buffer_printf(&b, "languages:\n");
+    for (u64 i = 0; i < shape.language_count; i++) byte_buffer_printf(&b, "lang%llu\n", i);
+    byte_buffer_printf(&b, "\nstart: [s0]\nquit:  [quit]\n\n");
+    
+    for (u64 i = 0; i < shape.scene_count; i++) {
+        
+        byte_buffer_printf(&b, "\n\n[s%llu]\n", i); // a scene ends with a blank line after its last option
+        for (u64 j = 0; j < shape.language_count; j++) {
+            byte_buffer_printf(&b, "lang%llu: ", j);
+            generate_text(&b, &random, shape.text_bytes);
+            byte_buffer_push(&b, string("\n"));
+        }
+        
+        for (u64 k = 0; k < shape.option_count; k++) {
+            
+            u64 link = k == 0 ? i + 1 : random_next(&random) % (shape.scene_count + 1);
+            
+            if (link >= shape.scene_count) byte_buffer_printf(&b, "\n%llu. [quit]\n", k + 1);
+            else                           byte_buffer_printf(&b, "\n%llu. [s%llu]\n", k + 1, link);
+            
+            for (u64 j = 0; j < shape.language_count; j++) {
+                byte_buffer_printf(&b, "lang%llu: ", j);
+                generate_text(&b, &random, shape.text_bytes / 4);
+                byte_buffer_push(&b, string("\n"));
+            }
+        }
+    }
+    
+    return (String) { b.data, b.count };
+}
+
+// --scenes N --languages L --options K --text-bytes B --seed S, gives 0 if args[*i] is none of them
+u8 story_shape_eat_arg(StoryShape* shape, char** args, int arg_count, int* i) {
+    
+    char* names[]  = { "--scenes", "--languages", "--options", "--text-bytes", "--seed" };
+    u64*  fields[] = { &shape->scene_count, &shape->language_count, &shape->option_count, &shape->text_bytes, &shape->seed };
+    
+    for (u64 j = 0; j < count_of(names); j++) {
+        
+        if (strcmp(args[*i], names[j]) != 0) continue;
+        
+        if (*i + 1 >= arg_count || !parse_u64(c_string_to_string(args[*i + 1]), fields[j])) {
+            hard_error("%s needs a number.\n", names[j]);
+        }
+        
+        *i += 1;
+        return 1;
+    }
+    
+    return 0;
+}
+
+
+
+
+/* ---- Export Benchmark ---- */
+
+typedef enum {
+    bench_export_c,
+    bench_export_dot,
+    bench_export_twee,
+    bench_export_json,
+    bench_export_bin,
+} BenchExporter;
+
+int compare_f64(const void* a, const void* b) {
+    f64 x = *(f64*) a;
+    f64 y = *(f64*) b;
+    return (x > y) - (x < y);
+}
+
+/*
+    Every exporter with both writer backends, writer_stdio is how the exporters used to write.
+    The syscalls come from /proc/self/io, so they count what the kernel saw, not what we think we did.
+*/
+void run_export_benchmark(char* story_path, char* out_dir, u64 repeat) {
+    
+    Story story = {0};
+    parse_file_to_story(story_path, &story, 0);
+    
+    ExportFilter filter = export_filter_all(&story);
+    
+    char* names[]    = { "c", "dot", "twee" };
+    char* backends[] = { "stdio", "writev" };
+    
+    if (repeat < 1)  repeat = 1;
+    if (repeat > 99) repeat = 99;
+    
+    printf("%-8s %-8s %12s %10s %10s %10s\n", "export", "backend", "bytes", "syscalls", "ms", "MB/s");
+    
+    for (u64 exporter = 0; exporter < count_of(names); exporter++) {
+        
+        for (u64 backend = 0; backend < count_of(backends); backend++) {
+            
+            u64 size = strlen(out_dir) + 16;
+            char* path = malloc(size);
+            snprintf(path, size, "%s/bench.%s", out_dir, names[exporter]);
+            
+            f64 times[99];
+            u64 bytes    = 0;
+            u64 syscalls = 0;
+            
+            for (u64 run = 0; run < repeat; run++) {
+                
+                u64 calls_before = get_write_syscall_count();
+                f64 start        = get_time();
+                
+                Writer w;
+                if (!writer_open(&w, path, backend == 0 ? writer_stdio : writer_gather)) hard_error("Cannot write \"%s\".\n", path);
+                
+                switch (exporter) {
+                    case bench_export_c:    export_story_to_c_code(&story, &filter, &w);                 break;
+                    case bench_export_dot:  export_story_to_graphviz_dot_file(&story, &filter, &w);      break;
+                    case bench_export_twee: export_story_to_twee(&story, &filter, 0, &w);                break;
+                }
+                
+                bytes = w.written;
+                if (!writer_close(&w)) hard_error("Cannot write \"%s\".\n", path);
+                
+                times[run] = get_time() - start;
+                syscalls   = get_write_syscall_count() - calls_before;
+            }
+            
+            qsort(times, repeat, sizeof(f64), compare_f64);
+            f64 median = times[repeat / 2];
+            
+            printf(
+                "%-8s %-8s %12llu %10llu %10.3f %10.1f\n", 
+                names[exporter], backends[backend], bytes, syscalls, median * 1000, median > 0 ? bytes / median / 1e6 : 0
+            );
+            
+            free(path);
+        }
+    }
+}
+
+
+
+
+/* ---- Suite ---- */
+
+/*
+    For each size, makes a story with that many scenes and times every step on it, repeat times.
+    The output is one line per step, tab separated, so runs from two builds can be diffed or loaded anywhere:
+    
+        benchmark  scenes  count  unit  runs  median_us  p99_us
+    
+    count is what one run does in unit (bytes, lookups or scenes), so the throughput is count / median.
+    p99 is by nearest rank, so with less than 100 runs it is the slowest one.
+*/
+
+#define bench_max_repeat 1000
+
+void bench_report(char* name, u64 scene_count, u64 count, char* unit, f64* times, u64 runs) {
+    
+    qsort(times, runs, sizeof(f64), compare_f64);
+    
+    u64 rank = (runs * 99 + 99) / 100;
+    printf("%s\t%llu\t%llu\t%s\t%llu\t%.1f\t%.1f\n", name, scene_count, count, unit, runs, times[runs / 2] * 1e6, times[rank - 1] * 1e6);
+}
+
+void bench_parse(char* name, char* path, u64 scene_count, u64 bytes, u8 lazy, u8 cached, f64* times, u64 repeat) {
+    
+    for (u64 run = 0; run < repeat; run++) {
+        
+        Story story = { .parse_cache = cached };
+        
+        f64 start = get_time();
+        parse_file_to_story(path, &story, lazy);
+        times[run] = get_time() - start;
+        
+        story_free(&story);
+    }
+    
+    bench_report(name, scene_count, bytes, "bytes", times, repeat);
+}
+
+void bench_lookup(char* name, HashTable* table, String* keys, u64 key_count, u64 scene_count, f64* times, u64 repeat) {
+    
+    u64 found = 0;
+    
+    for (u64 run = 0; run < repeat; run++) {
+        
+        f64 start = get_time();
+        for (u64 i = 0; i < key_count; i++) {
+            u64 index;
+            found += table_get_index(table, keys[i], &index);
+        }
+        times[run] = get_time() - start;
+    }
+    
+    assert(found == 0 || found == key_count * repeat);
+    bench_report(name, scene_count, key_count, "lookups", times, repeat);
+}
+
+void run_bench_suite(char* out_dir, StoryShape shape, u64* sizes, u64 size_count, u64 repeat) {
+    
+    if (repeat < 1)                repeat = 1;
+    if (repeat > bench_max_repeat) repeat = bench_max_repeat;
+    
+    f64*  times = malloc(repeat * sizeof(f64));
+    u64   size  = strlen(out_dir) + 64;
+    char* path  = malloc(size);
+    char* out   = malloc(size);
+    
+    printf("benchmark\tscenes\tcount\tunit\truns\tmedian_us\tp99_us\n");
+    
+    for (u64 s = 0; s < size_count; s++) {
+        
+        shape.scene_count = sizes[s];
+        snprintf(path, size, "%s/bench-%llu.story", out_dir, shape.scene_count);
+        
+        String generated = generate_story(shape);
+        if (!save_file(generated, path)) hard_error("Cannot write \"%s\".\n", path);
+        u64 bytes = generated.count;
+        free(generated.data);
+        
+        
+        /* ---- Load and parse ---- */
+        
+        for (u64 run = 0; run < repeat; run++) {
+            f64 start = get_time();
+            String file = load_file(path);
+            times[run] = get_time() - start;
+            if (!file.count) hard_error("Cannot open file \"%s\".\n", path);
+            memory_free(file.data);
+        }
+        bench_report("load_file", shape.scene_count, bytes, "bytes", times, repeat);
+        
+        bench_parse("parse",      path, shape.scene_count, bytes, 0, 0, times, repeat);
+        bench_parse("parse_lazy", path, shape.scene_count, bytes, 1, 0, times, repeat);
+        
+        // the first one fills the parse cache
+        Story warm = { .parse_cache = 1 };
+        parse_file_to_story(path, &warm, 0);
+        story_free(&warm);
+        bench_parse("parse_cached", path, shape.scene_count, bytes, 0, 1, times, repeat);
+        
+        
+        /* ---- Lookup ---- */
+        
+        Story story = {0};
+        parse_file_to_story(path, &story, 0);
+        
+        HashTable* table = &story.scene_table;
+        
+        String*    keys  = malloc(table->entry_count * sizeof(String));
+        u64        count = 0;
+        for (u64 i = 0; i < table->size; i++) {
+            if (table->entries[i].occupied) keys[count++] = table->entries[i].key;
+        }
+        bench_lookup("lookup_hit", table, keys, count, shape.scene_count, times, repeat);
+        
+        // same length and shape as the labels, but not in the story
+        u8* names = malloc(count * 24);
+        for (u64 i = 0; i < count; i++) {
+            char* name = (char*) names + i * 24;
+            keys[i] = (String) { (u8*) name, snprintf(name, 24, "m%llu", i) };
+        }
+        bench_lookup("lookup_miss", table, keys, count, shape.scene_count, times, repeat);
+        
+        free(names);
+        free(keys);
+        
+        
+        /* ---- Render ---- */
+        
+        // print_scene() is what the player waits on, stdout goes to /dev/null so we time our side of it
+        // at 80 columns, and the layout cache is dropped before each run, so every scene is wrapped
+        int saved = stdout_redirect("/dev/null");
+        if (saved >= 0) {
+            
+            Layout layout;
+            layout_init(&layout, 80);
+            
+            for (u64 run = 0; run < repeat; run++) {
+                layout_clear(&layout);
+                f64 start = get_time();
+                for (u64 i = 0; i < table->size; i++) {
+                    if (story_is_defined(&story, i)) print_scene(&layout, &table->values[i], i, 0, story.var_table.initial);
+                }
+                times[run] = get_time() - start;
+            }
+            
+            layout_free(&layout);
+            stdout_restore(saved);
+            bench_report("print_scene", shape.scene_count, shape.scene_count, "scenes", times, repeat);
+        }
+        
+        
+        /* ---- Export ---- */
+        
+        // same order as BenchExporter
+        char* names_of[] = { "export_c", "export_dot", "export_twee", "export_json", "export_bin" };
+        char* ext_of[]   = { "c", "dot", "twee", "json", "bin" };
+        
+        ExportFilter filter = export_filter_all(&story);
+        
+        for (u64 e = 0; e < count_of(names_of); e++) {
+            
+            snprintf(out, size, "%s/bench-%llu.%s", out_dir, shape.scene_count, ext_of[e]);
+            u64 written = 0;
+            
+            for (u64 run = 0; run < repeat; run++) {
+                
+                f64 start = get_time();
+                
+                Writer w;
+                if (!writer_open(&w, out, writer_gather)) hard_error("Cannot write \"%s\".\n", out);
+                
+                switch (e) {
+                    case bench_export_c:    export_story_to_c_code(&story, &filter, &w);             break;
+                    case bench_export_dot:  export_story_to_graphviz_dot_file(&story, &filter, &w);  break;
+                    case bench_export_twee: export_story_to_twee(&story, &filter, 0, &w);            break;
+                    case bench_export_json: export_story_to_json(&story, &filter, &w);               break;
+                    case bench_export_bin:  export_story_to_bin(&story, &filter, &w);                break;
+                }
+                
+                written = w.written;
+                if (!writer_close(&w)) hard_error("Cannot write \"%s\".\n", out);
+                
+                times[run] = get_time() - start;
+            }
+            
+            bench_report(names_of[e], shape.scene_count, written, "bytes", times, repeat);
+        }
+        
+        story_free(&story);
+    }
+    
+    free(out);
+    free(path);
+    free(times);
+}
@@ -0,0 +1,124 @@
+/* ==== Check ==== */
+
+/*
+    "story check" parses every scene like an eager run, but an error doesn't stop it:
+    the errors go to the Diagnostics (see Utils in backend.c), a scene with an error is left at that error,
+    and the check goes on from the next label. A broken link or a redundant label doesn't even stop its scene.
+    An error in the header stops everything, since we can't find the scenes without it.
+
+    At the end, one line per error, sorted by file and line, so a machine can read them:
+
+        path:line: kind: [label] message
+
+    the line is 0 for an error that is not at a line, and [label] is the scene the error is in, if it's in one.
+    
+    note: this never reads or writes the parse cache, a cached file would not have its errors
+*/
+
+int compare_diagnostic(const void* a, const void* b) {
+    Diagnostic* x = (Diagnostic*) a;
+    Diagnostic* y = (Diagnostic*) b;
+    if (x->file != y->file) return (x->file > y->file) - (x->file < y->file);
+    if (x->line != y->line) return (x->line > y->line) - (x->line < y->line);
+    return (x->order > y->order) - (x->order < y->order);
+}
+
+// with its own trap, so the loop over the scenes has nothing a longjmp can clobber
+void check_scene(Story* story, u64 index) {
+    
+    jmp_buf trap;
+    error_trap = &trap;
+    
+    if (!setjmp(trap)) parse_scene(story, &story->scene_table.values[index]);
+    
+    error_trap = NULL;
+}
+
+// parses the header and the labels, then every scene in file order, gives 0 if the header has an error
+u8 check_file(char* file_name, Story* story, u64* scene_count_out) {
+    
+    jmp_buf trap;
+    error_trap = &trap;
+    
+    // lazy, so we parse the scenes ourselves, see check_scene()
+    u8 ok = !setjmp(trap);
+    if (ok) parse_file_to_story(file_name, story, 1);
+    
+    error_trap = NULL;
+    if (!ok) return 0;
+        
+    HashTable*  table = &story->scene_table;
+    SceneOrder* order = story_scene_order(story, scene_count_out);
+    
+    for (u64 i = 0; i < *scene_count_out; i++) {
+        diagnostics->label = table->entries[order[i].index].key;
+        check_scene(story, order[i].index);
+    }
+    
+    diagnostics->label = (String) {0};
+    memory_free(order);
+    
+    return 1;
+}
+
+// a story from a pipe is parsed as it comes in (see stream.c), which stops at the errors in the same places as above
+u8 check_stream(char* file_name, Story* story, StoryStream* s) {
+    
+    jmp_buf trap;
+    error_trap = &trap;
+    
+    u8 ok = !setjmp(trap);
+    if (ok) {
+        stream_open(s, file_name, story);
+        while (stream_next_scene(s)) {}
+        stream_finish(s);
+    }
+    
+    error_trap = NULL;
+    return ok;
+}
+
+// gives the number of errors
+u64 story_check(char* file_name) {
+    
+    TraceSpan span = trace_begin("check");
+    
+    Diagnostics d      = { .arena = { .tag = memory_check } };
+    Story       story  = {0};
+    StoryStream stream = {0};
+    
+    diagnostics = &d;
+    
+    u8  piped       = path_is_stdin(file_name);
+    u64 scene_count = 0;
+    u8  ok          = piped ? check_stream(file_name, &story, &stream) : check_file(file_name, &story, &scene_count);
+    
+    if (piped) scene_count = stream.scene_count;
+    
+    diagnostics = NULL;
+    
+    if (d.count) qsort(d.data, d.count, sizeof(Diagnostic), compare_diagnostic);
+    
+    for (u64 i = 0; i < d.count; i++) {
+        
+        Diagnostic* it   = &d.data[i];
+        char*       name = story.files ? story.files[it->file].name : file_name;
+        
+        printf("%s:%llu: %s: ", name, it->line, it->kind);
+        if (it->label.count) print(string("[@] "), it->label);
+        print(string("@\n"), it->message);
+    }
+    
+    if (d.count) printf("%llu error%s in \"%s\".\n", d.count, d.count == 1 ? "" : "s", file_name);
+    else         printf("No errors in \"%s\", %llu scenes.\n", file_name, scene_count);
+    
+    u64 error_count = d.count;
+    
+    if (piped) stream_free(&stream);
+    if (ok)    story_free(&story);
+    arena_free(&d.arena);
+    memory_free(d.data);
+    
+    trace_end(span);
+    return error_count;
+}
@@ -0,0 +1,100 @@
+/* ==== Coverage ==== */
+
+/*
+    Translation coverage from the LanguageMask that parse_scene() records for every text field,
+    so it costs one parse: a field is the text of a scene or of an option, and it's complete
+    when its mask has all the languages.
+*/
+
+void report_coverage(Story* story) {
+
+    HashTable* table          = &story->scene_table;
+    u64        language_count = story->lang_table.count;
+    LanguageMask all          = (LanguageMask) ((1u << language_count) - 1);
+
+    // in file order, so the report is sorted by line
+    u64         count;
+    SceneOrder* order = story_scene_order(story, &count);
+
+
+    /* ---- Totals ---- */
+
+    u64 field_count    = 0;
+    u64 complete_count = 0;
+    u64 present_count[max_language_count] = {0};
+
+    for (u64 i = 0; i < count; i++) {
+
+        Scene* scene = &table->values[order[i].index];
+
+        for (u64 j = 0; j <= scene->option_count; j++) {
+            
+            LanguageMask mask = j ? scene->options[j - 1].text_mask : scene->text_mask;
+            
+            field_count++;
+            complete_count += mask == all;
+            
+            // one step per language that has it
+            for (LanguageMask m = mask; m; m &= m - 1) {
+                u64 language = 0;
+                while (!((m >> language) & 1)) language++;
+                present_count[language]++;
+            }
+        }
+    }
+
+    printf("Coverage of \"%s\": %llu scenes, %llu text fields, %llu complete.\n\n", story->files[0].name, count, field_count, complete_count);
+
+    for (u64 i = 0; i < language_count; i++) {
+        f64 percent = field_count ? 100.0 * present_count[i] / field_count : 100.0;
+        print(string("@"), story->lang_table.data[i]);
+        printf("\t%6.2f%%  %llu / %llu\n", percent, present_count[i], field_count);
+    }
+    
+
+    /* ---- Missing fields ---- */
+
+    for (u64 pass = 0; pass < 2; pass++) {
+
+        u8 printed_title = 0;
+
+        for (u64 i = 0; i < count; i++) {
+
+            HashTableEntry* entry = &table->entries[order[i].index];
+            Scene*          scene = &table->values[order[i].index];
+
+            for (u64 j = 0; j <= scene->option_count; j++) {
+
+                LanguageMask mask = j ? scene->options[j - 1].text_mask : scene->text_mask;
+                
+                // first the fields that miss some languages, then the ones that are empty in all of them
+                if (mask == all)                continue;
+                if ((pass == 0) != (mask != 0)) continue;
+
+                if (!printed_title) {
+                    printf(pass == 0 ? "\nMissing translations:\n" : "\nEmpty in every language:\n");
+                    printed_title = 1;
+                }
+
+                u64 line = j ? scene_get_line(story, scene, scene->options[j - 1].link) : scene->line;
+
+                printf("%s:%llu: ", story->files[scene->file].name, line);
+                print(string("[@] "), entry->key);
+                
+                if (j) printf("option %llu", j);
+                else   printf("text");
+                
+                if (pass == 0) {
+                    printf(":");
+                    for (u64 k = 0; k < language_count; k++) {
+                        if (!((mask >> k) & 1)) print(string(" @"), story->lang_table.data[k]);
+                    }
+                }
+                
+                printf("\n");
+            }
+        }
+    }
+
+    memory_free(order);
+}
@@ -0,0 +1,287 @@
+/* ==== Daemon ==== */
+
+/*
+    Keeps a parsed story in memory and answers queries over a local socket, for tools that would otherwise parse the whole file again.
+    
+    Queries (one per connection, the reply ends when the connection is closed):
+    
+        def [label]         gives "line N" of the label (and of "file" with includes), or "not found"
+        refs [label]        gives "[from] line N" for every scene that has an option linking to the label
+        missing language    gives "[label] line N" for every scene that misses the language in its text or in an option
+    
+    The label can be written with or without brackets.
+*/
+
+
+
+
+/* ---- Index ---- */
+
+typedef struct {
+    u64*          ref_offsets; // per slot, the scenes that link to slot i are ref_sources[ref_offsets[i] .. ref_offsets[i] + ref_counts[i]]
+    u64*          ref_counts;
+    u64*          ref_sources;
+    LanguageMask* missing;     // per slot, bit n is set if language n is missing in the scene text or in any option
+} StoryIndex;
+
+void story_index_free(StoryIndex* index) {
+    free(index->ref_offsets);
+    free(index->ref_counts);
+    free(index->ref_sources);
+    free(index->missing);
+    *index = (StoryIndex) {0};
+}
+
+// the definitions are the scene table itself, here we build what needs a full walk
+// note: expects all scenes parsed
+void story_index_build(Story* story, StoryIndex* index) {
+    
+    story_index_free(index);
+    
+    HashTable*   table = &story->scene_table;
+    LanguageMask all   = (LanguageMask) ((1u << story->lang_table.count) - 1);
+    
+    index->ref_offsets = calloc(table->size + 1, sizeof(u64));
+    index->ref_counts  = calloc(table->size,     sizeof(u64));
+    index->missing     = calloc(table->size,     sizeof(LanguageMask));
+    if (!index->ref_offsets || !index->ref_counts || !index->missing) hard_error("Out of memory when indexing the story.\n");
+
+    // count the links to each slot, then turn the counts into offsets
+    u64 link_count = 0;
+    for (u64 i = 0; i < table->size; i++) {
+        
+        Scene* scene = &table->values[i];
+        if (!table->entries[i].occupied || !scene->line) continue;
+        
+        LanguageMask present = scene->text_mask;
+        for (u64 j = 0; j < scene->option_count; j++) {
+            index->ref_offsets[scene->options[j].link_index + 1]++;
+            present &= scene->options[j].text_mask;
+        }
+        
+        index->missing[i] = all & ~present;
+        link_count += scene->option_count;
+    }
+    
+    for (u64 i = 0; i < table->size; i++) index->ref_offsets[i + 1] += index->ref_offsets[i];
+    
+    index->ref_sources = malloc((link_count ? link_count : 1) * sizeof(u64));
+    if (!index->ref_sources) hard_error("Out of memory when indexing the story.\n");
+    
+    // slots are walked in order, so 2 options of a scene linking to the same place are next to each other
+    for (u64 i = 0; i < table->size; i++) {
+        
+        Scene* scene = &table->values[i];
+        if (!table->entries[i].occupied || !scene->line) continue;
+        
+        for (u64 j = 0; j < scene->option_count; j++) {
+            
+            u64  to      = scene->options[j].link_index;
+            u64* sources = &index->ref_sources[index->ref_offsets[to]];
+            u64* count   = &index->ref_counts[to];
+            
+            if (*count && sources[*count - 1] == i) continue;
+            sources[(*count)++] = i;
+        }
+    }
+}
+
+
+
+
+/* ---- Serving ---- */
+
+#define daemon_timeout_ms 1000
+
+typedef struct {
+    u8* data;
+    u64 count;
+    u64 allocated;
+} DaemonReply;
+
+void daemon_reply(DaemonReply* r, String s) {
+    
+    if (r->count + s.count > r->allocated) {
+        u64 wanted = r->allocated ? r->allocated : 4096;
+        while (wanted < r->count + s.count) wanted *= 2;
+        u8* data = realloc(r->data, wanted);
+        if (!data) hard_error("Out of memory when answering a query.\n");
+        r->data      = data;
+        r->allocated = wanted;
+    }
+    
+    memcpy(r->data + r->count, s.data, s.count);
+    r->count += s.count;
+}
+
+// "line N", and the file when the story has includes
+void daemon_reply_line(DaemonReply* r, Story* story, Scene* scene) {
+    
+    char line[32];
+    snprintf(line, sizeof(line), "line %llu", scene->line);
+    daemon_reply(r, c_string_to_string(line));
+    
+    if (story->file_count > 1) {
+        daemon_reply(r, string(" of \""));
+        daemon_reply(r, c_string_to_string(story->files[scene->file].name));
+        daemon_reply(r, string("\""));
+    }
+    
+    daemon_reply(r, string("\n"));
+}
+
+void daemon_reply_scene(DaemonReply* r, Story* story, u64 index) {
+    
+    HashTableEntry* entry = &story->scene_table.entries[index];
+    
+    daemon_reply(r, string("["));
+    daemon_reply(r, entry->key);
+    daemon_reply(r, string("] "));
+    daemon_reply_line(r, story, &story->scene_table.values[index]);
+}
+
+// gives the slot of a defined label, with or without brackets
+u8 daemon_find_label(Story* story, String label, u64* index_out) {
+    if (string_is_label(label)) label = string_strip_label(label);
+    if (!table_get_index(&story->scene_table, label, index_out)) return 0;
+    return story_is_defined(story, *index_out);
+}
+
+void daemon_answer(Story* story, StoryIndex* index, String request, DaemonReply* r) {
+
+    HashTable* table = &story->scene_table;
+    
+    String command  = string_eat_by_spaces(&request);
+    String argument = string_trim_spaces(request);
+
+    if (string_equal(command, string("def"))) {
+        
+        u64 slot;
+        if (!daemon_find_label(story, argument, &slot)) {
+            daemon_reply(r, string("not found\n"));
+            return;
+        }
+        
+        daemon_reply_line(r, story, &table->values[slot]);
+    
+    } else if (string_equal(command, string("refs"))) {
+        
+        u64 slot;
+        if (!daemon_find_label(story, argument, &slot)) {
+            daemon_reply(r, string("not found\n"));
+            return;
+        }
+        
+        u64* sources = &index->ref_sources[index->ref_offsets[slot]];
+        for (u64 i = 0; i < index->ref_counts[slot]; i++) {
+            daemon_reply_scene(r, story, sources[i]);
+        }
+    
+    } else if (string_equal(command, string("missing"))) {
+        
+        u64 language;
+        if (!language_table_get_index(&story->lang_table, argument, &language)) {
+            daemon_reply(r, string("unknown language\n"));
+            return;
+        }
+        
+        for (u64 i = 0; i < table->size; i++) {
+            if (table->entries[i].occupied && (index->missing[i] >> language) & 1) daemon_reply_scene(r, story, i);
+        }
+    
+    } else {
+        
+        daemon_reply(r, string("unknown query, use def, refs or missing\n"));
+    }
+}
+
+void run_daemon(Story* story, char* socket_path) {
+    
+    FileWatcher watcher;
+    if (!file_watcher_init(&watcher, story->files[0].name)) hard_error("Cannot watch \"%s\", or watching is not supported on this platform.\n", story->files[0].name);
+    story_watch_includes(story, &watcher);
+    
+    int server = socket_listen(socket_path);
+    if (server < 0) hard_error("Cannot listen on \"%s\".\n", socket_path);
+    
+    StoryIndex index = {0};
+    story_index_build(story, &index);
+
+    // reloading needs a session to keep, we don't have a current scene here
+    Session session = {0};
+    {
+        u8 ok = table_get_index(&story->scene_table, story->start_label, &session.scene);
+        assert(ok);
+    }
+    
+    printf("Serving \"%s\" on \"%s\".\n", story->files[0].name, socket_path);
+    
+    DaemonReply reply   = {0};
+    u8          request[4096];
+    
+    while (1) {
+        
+        if (!file_watcher_wait(&watcher, server)) {
+            
+            // a reload only parses the changed scenes, but the reverse links of any scene can change with them
+            if (story_reload(story, &session)) {
+                story_parse_all(story);
+                story_index_build(story, &index);
+            }
+            story_watch_includes(story, &watcher);
+            continue;
+        }
+        
+        int client = socket_accept(server);
+        if (client < 0) continue;
+        
+        // we serve one client at a time, so one that sends nothing only gets this long before the next one
+        socket_set_timeout(client, daemon_timeout_ms);
+        
+        u64 count     = 0;
+        u8  timed_out = 0;
+        while (count < sizeof(request)) {
+            s64 got = socket_read(client, request + count, sizeof(request) - count);
+            if (got < 0)  timed_out = 1;
+            if (got <= 0) break;
+            count += got;
+            if (memchr(request, '\n', count)) break;
+        }
+        
+        if (timed_out) {
+            socket_close(client);
+            continue;
+        }
+        
+        String line = { request, count };
+        line = string_trim_spaces(string_eat_line(&line));
+        
+        reply.count = 0;
+        daemon_answer(story, &index, line, &reply);
+        
+        // a client that hung up before the reply fails the write, and we just drop it
+        socket_write(client, (String) { reply.data, reply.count });
+        socket_close(client);
+    }
+}
+
+void run_query(char* socket_path, Array(String) words) {
+    
+    int fd = socket_connect(socket_path);
+    if (fd < 0) hard_error("Cannot connect to \"%s\", is the daemon running?\n", socket_path);
+    
+    for (u64 i = 0; i < words.count; i++) {
+        if (i) socket_write(fd, string(" "));
+        socket_write(fd, words.data[i]);
+    }
+    socket_write(fd, string("\n"));
+    
+    u8 buffer[4096];
+    while (1) {
+        s64 count = socket_read(fd, buffer, sizeof(buffer));
+        if (count <= 0) break;
+        print_string((String) { buffer, count });
+    }
+    
+    socket_close(fd);
+}
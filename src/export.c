@@ -0,0 +1,424 @@
+/* ==== Engine Export ==== */
+
+/*
+    Formats for loading a story into a game engine, with every language, and links as scene ids.
+    Both are streamed through the Writer in a few walks over the scene table, so the only memory
+    we need besides the story is the id directory below (one bit and a bit more per slot).
+*/
+
+
+
+
+/* ---- Scene Ids ---- */
+
+/*
+    A scene id is the rank of its slot among the exported slots, so ids are dense from 0,
+    and in slot order, which is the order every exporter walks the table in.
+    The quit slot always has an id, even if it has no scene, since options link to it.
+*/
+
+typedef struct {
+    u64* bits;   // per slot, 1 if it has an id
+    u64* ranks;  // per u64 of bits, the ids before it
+    u64  count;
+} SceneIds;
+
+u64 count_bits_u64(u64 x) {
+    x = x - ((x >> 1) & 0x5555555555555555);
+    x = (x & 0x3333333333333333) + ((x >> 2) & 0x3333333333333333);
+    x = (x + (x >> 4)) & 0x0f0f0f0f0f0f0f0f;
+    return (x * 0x0101010101010101) >> 56;
+}
+
+u8 scene_ids_has(SceneIds* ids, u64 slot) {
+    return (ids->bits[slot / 64] >> (slot % 64)) & 1;
+}
+
+u64 scene_ids_get(SceneIds* ids, u64 slot) {
+    u64 below = ids->bits[slot / 64] & (((u64) 1 << (slot % 64)) - 1);
+    return ids->ranks[slot / 64] + count_bits_u64(below);
+}
+
+SceneIds scene_ids_build(Story* story, ExportFilter* filter) {
+
+    HashTable* table      = &story->scene_table;
+    u64        word_count = (table->size + 63) / 64;
+
+    SceneIds ids = {
+        .bits  = memory_calloc(memory_export, word_count, sizeof(u64)),
+        .ranks = memory_calloc(memory_export, word_count, sizeof(u64)),
+    };
+
+    for (u64 i = 0; i < table->size; i++) {
+
+        HashTableEntry* entry = &table->entries[i];
+        if (!entry->occupied || !export_filter_keeps(filter, i))   continue;
+        if (!table->values[i].line && i != story->quit_index)           continue;
+
+        ids.bits[i / 64] |= (u64) 1 << (i % 64);
+    }
+
+    for (u64 i = 0; i < word_count; i++) {
+        ids.ranks[i] = ids.count;
+        ids.count   += count_bits_u64(ids.bits[i]);
+    }
+
+    return ids;
+}
+
+void scene_ids_free(SceneIds* ids) {
+    memory_free(ids->bits);
+    memory_free(ids->ranks);
+    *ids = (SceneIds) {0};
+}
+
+
+
+
+/* ---- JSON ---- */
+
+/*
+    {
+        "languages": ["en", "zh"],
+        "start": 0,
+        "quit": 2,
+        "scenes": [
+            { "id": 0, "label": "start", "text": { "en": "...", "zh": null }, "options": [ { "link": 1, "text": { ... } } ] },
+            ...
+        ]
+    }
+
+    A missing text is null, and the quit scene has "quit": true. Scenes are in id order.
+    
+    note: from a pipe (see stream.c), ids are in the order the labels first show up, start and quit first,
+          and the scenes are in the order they come in, with quit first
+*/
+
+void writer_json_texts(Writer* w, Story* story, ExportFilter* filter, String* texts) {
+
+    writer_view(w, string("{ "));
+
+    for (u64 i = 0; i < filter->language_count; i++) {
+
+        if (i) writer_view(w, string(", "));
+        writer_quoted_string(w, story->lang_table.data[filter->languages[i]]);
+        writer_view(w, string(": "));
+
+        String text = texts[filter->languages[i]];
+        if (text.count) writer_quoted_string(w, text);
+        else            writer_view(w, string("null"));
+    }
+
+    writer_view(w, string(" }"));
+}
+
+// everything before the scenes, start and quit are scene ids
+void writer_json_header(Writer* w, Story* story, ExportFilter* filter, u64 start, u64 quit) {
+
+    writer_view(w, string("{\n    \"languages\": ["));
+    for (u64 i = 0; i < filter->language_count; i++) {
+        if (i) writer_view(w, string(", "));
+        writer_quoted_string(w, story->lang_table.data[filter->languages[i]]);
+    }
+    writer_view(w, string("],\n"));
+
+    writer_printf(w, "    \"start\": %llu,\n", start);
+    writer_printf(w, "    \"quit\": %llu,\n",  quit);
+    writer_view(w, string("    \"scenes\": [\n"));
+}
+
+// one of the scenes, without the ',' after it, scene is NULL for the quit one,
+// the links are slots that ids turns into scene ids, or they are scene ids already if ids is NULL (see stream.c)
+void writer_json_scene(Writer* w, Story* story, ExportFilter* filter, SceneIds* ids, u64 id, String label, Scene* scene) {
+
+    writer_printf(w, "        { \"id\": %llu, \"label\": ", id);
+    writer_quoted_string(w, label);
+
+    if (!scene) {
+        writer_view(w, string(", \"quit\": true }"));
+        return;
+    }
+
+    writer_view(w, string(", \"text\": "));
+    writer_json_texts(w, story, filter, scene->text);
+
+    writer_view(w, string(", \"options\": ["));
+    for (u64 j = 0; j < scene->option_count; j++) {
+
+        Option* option = &scene->options[j];
+        u64     link   = ids ? scene_ids_get(ids, option->link_index) : option->link_index;
+
+        if (j) writer_view(w, string(", "));
+        writer_printf(w, "{ \"link\": %llu, \"text\": ", link);
+        writer_json_texts(w, story, filter, option->text);
+        writer_view(w, string(" }"));
+    }
+    writer_view(w, string("] }"));
+}
+
+void export_story_to_json(Story* story, ExportFilter* filter, Writer* w) {
+
+    HashTable* table = &story->scene_table;
+    SceneIds   ids   = scene_ids_build(story, filter);
+
+    u64 start;
+    u8 ok = table_get_index(table, story->start_label, &start);
+    assert(ok);
+
+    writer_json_header(w, story, filter, scene_ids_get(&ids, start), scene_ids_get(&ids, story->quit_index));
+
+    for (u64 i = 0; i < table->size; i++) {
+
+        if (!scene_ids_has(&ids, i)) continue;
+
+        u64 id = scene_ids_get(&ids, i);
+        writer_json_scene(w, story, filter, &ids, id, table->entries[i].key, i == story->quit_index ? NULL : &table->values[i]);
+        writer_view(w, id + 1 < ids.count ? string(",\n") : string("\n"));
+    }
+
+    writer_view(w, string("    ]\n}\n"));
+
+    scene_ids_free(&ids);
+}
+
+
+
+
+/* ---- Binary ---- */
+
+/*
+    For engines that want to load the story with one read and use it in place.
+    Everything is little endian, and every reference is an offset from the start of the file.
+
+        BinHeader
+        BinString  languages[language_count]
+        scenes     [scene_count]   each is: BinString label, u32 first_option, u32 option_count, BinString text[language_count]
+        options    [option_count]  each is: u32 link, u32 padding, BinString text[language_count]
+        lookup                     u32 displacements[lookup_bucket_count][2], u32 scenes[scene_count]
+        strings                    languages, then labels and scene texts, then option texts, no terminators
+
+    A BinString is { u32 offset, u32 count }, the offset is from strings_at, and a missing text has count 0.
+    Scene i is at scenes_at + i * (16 + 8 * language_count), scene ids are the same as in export-json.
+
+    The lookup is a minimal perfect hash of the labels (see the Perfect Hash section in hash_table.c, with lookup_seed),
+    the place it gives for a label is an index in lookup.scenes, then compare the label of that scene to tell a miss.
+*/
+
+#define bin_version 2
+
+typedef struct {
+    u8  magic[4];              // "STBN"
+    u32 version;
+    u32 language_count;
+    u32 scene_count;
+    u32 option_count;
+    u32 start;                 // scene id
+    u32 quit;
+    u32 lookup_bucket_count;
+    u32 lookup_seed;
+    u32 padding;
+    u64 languages_at;
+    u64 scenes_at;
+    u64 options_at;
+    u64 lookup_at;
+    u64 strings_at;
+    u64 size;                  // of the whole file
+} BinHeader;
+
+typedef struct {
+    SceneIds    ids;
+    PerfectHash lookup;
+    u64*        lookup_scenes;         // by place
+    u64         option_count;
+    u64         scene_string_count;    // bytes of the languages, labels and scene texts
+    u64         option_string_count;
+} BinCounts;
+
+void writer_bin_string(Writer* w, String s, u64* at) {
+    writer_u32_le(w, (u32) *at);
+    writer_u32_le(w, (u32) s.count);
+    *at += s.count;
+}
+
+// gives 0 if the strings don't fit in u32 offsets
+u8 export_story_to_bin(Story* story, ExportFilter* filter, Writer* w) {
+
+    HashTable* table          = &story->scene_table;
+    u64        language_count = filter->language_count;
+    String*    languages      = story->lang_table.data;
+
+
+    /* ---- Count ---- */
+
+    BinCounts c = { .ids = scene_ids_build(story, filter) };
+
+    for (u64 i = 0; i < language_count; i++) c.scene_string_count += languages[filter->languages[i]].count;
+
+    for (u64 i = 0; i < table->size; i++) {
+
+        if (!scene_ids_has(&c.ids, i)) continue;
+
+        HashTableEntry* entry = &table->entries[i];
+        Scene*          scene = &table->values[i];
+
+        c.scene_string_count += entry->key.count;
+        if (i == story->quit_index) continue;
+
+        for (u64 j = 0; j < language_count; j++) c.scene_string_count += scene->text[filter->languages[j]].count;
+
+        c.option_count += scene->option_count;
+        for (u64 k = 0; k < scene->option_count; k++) {
+            for (u64 j = 0; j < language_count; j++) c.option_string_count += scene->options[k].text[filter->languages[j]].count;
+        }
+    }
+
+    if (c.scene_string_count + c.option_string_count > 0xffffffff || c.ids.count > 0xffffffff || c.option_count > 0xffffffff) {
+        scene_ids_free(&c.ids);
+        return 0;
+    }
+
+    // the labels are unique, so this can't fail
+    String* labels = memory_alloc(memory_export, c.ids.count * sizeof(String));
+    for (u64 i = 0, id = 0; i < table->size; i++) {
+        if (scene_ids_has(&c.ids, i)) labels[id++] = table->entries[i].key;
+    }
+
+    u8 built = perfect_hash_build(&c.lookup, labels, c.ids.count, memory_export);
+    assert(built);
+
+    c.lookup_scenes = memory_alloc(memory_export, c.ids.count * sizeof(u64));
+    for (u64 i = 0; i < c.ids.count; i++) c.lookup_scenes[perfect_hash_get(&c.lookup, labels[i])] = i;
+    memory_free(labels);
+
+    u64 scene_size  = 16 + 8 * language_count;
+    u64 option_size = 8  + 8 * language_count;
+
+    u64 start;
+    u8 ok = table_get_index(table, story->start_label, &start);
+    assert(ok);
+
+    BinHeader h = {
+        .magic               = { 'S', 'T', 'B', 'N' },
+        .version             = bin_version,
+        .language_count      = language_count,
+        .scene_count         = c.ids.count,
+        .option_count        = c.option_count,
+        .start               = scene_ids_get(&c.ids, start),
+        .quit                = scene_ids_get(&c.ids, story->quit_index),
+        .lookup_bucket_count = c.lookup.bucket_count,
+        .lookup_seed         = c.lookup.seed,
+        .languages_at        = sizeof(BinHeader),
+    };
+    h.scenes_at  = h.languages_at + language_count * 8;
+    h.options_at = h.scenes_at    + c.ids.count * scene_size;
+    h.lookup_at  = h.options_at   + c.option_count * option_size;
+    h.strings_at = h.lookup_at    + c.lookup.bucket_count * 8 + c.ids.count * 4;
+    h.size       = h.strings_at   + c.scene_string_count + c.option_string_count;
+
+
+    /* ---- Header and languages ---- */
+
+    writer_copy(w, (String) { h.magic, 4 });
+    writer_u32_le(w, h.version);
+    writer_u32_le(w, h.language_count);
+    writer_u32_le(w, h.scene_count);
+    writer_u32_le(w, h.option_count);
+    writer_u32_le(w, h.start);
+    writer_u32_le(w, h.quit);
+    writer_u32_le(w, h.lookup_bucket_count);
+    writer_u32_le(w, h.lookup_seed);
+    writer_u32_le(w, h.padding);
+    writer_u64_le(w, h.languages_at);
+    writer_u64_le(w, h.scenes_at);
+    writer_u64_le(w, h.options_at);
+    writer_u64_le(w, h.lookup_at);
+    writer_u64_le(w, h.strings_at);
+    writer_u64_le(w, h.size);
+
+    u64 string_at = 0;
+    for (u64 i = 0; i < language_count; i++) writer_bin_string(w, languages[filter->languages[i]], &string_at);
+
+
+    /* ---- Scenes ---- */
+
+    u64 option_at         = 0;
+    u64 option_string_at  = c.scene_string_count;
+
+    for (u64 i = 0; i < table->size; i++) {
+
+        if (!scene_ids_has(&c.ids, i)) continue;
+
+        HashTableEntry* entry = &table->entries[i];
+        Scene*          scene = &table->values[i];
+        u64             count = i == story->quit_index ? 0 : scene->option_count;
+
+        writer_bin_string(w, entry->key, &string_at);
+        writer_u32_le(w, (u32) option_at);
+        writer_u32_le(w, (u32) count);
+
+        for (u64 j = 0; j < language_count; j++) {
+            String text = i == story->quit_index ? (String) {0} : scene->text[filter->languages[j]];
+            writer_bin_string(w, text, &string_at);
+        }
+
+        option_at += count;
+    }
+
+
+    /* ---- Options ---- */
+
+    for (u64 i = 0; i < table->size; i++) {
+
+        if (!scene_ids_has(&c.ids, i) || i == story->quit_index) continue;
+
+        Scene* scene = &table->values[i];
+
+        for (u64 k = 0; k < scene->option_count; k++) {
+
+            Option* option = &scene->options[k];
+
+            writer_u32_le(w, (u32) scene_ids_get(&c.ids, option->link_index));
+            writer_u32_le(w, 0);
+            for (u64 j = 0; j < language_count; j++) writer_bin_string(w, option->text[filter->languages[j]], &option_string_at);
+        }
+    }
+
+
+    /* ---- Lookup ---- */
+
+    for (u64 i = 0; i < 2 * c.lookup.bucket_count; i++) writer_u32_le(w, c.lookup.displacements[i]);
+    for (u64 i = 0; i < c.ids.count; i++)                writer_u32_le(w, (u32) c.lookup_scenes[i]);
+
+
+    /* ---- Strings, in the same order as above ---- */
+
+    for (u64 i = 0; i < language_count; i++) writer_view(w, languages[filter->languages[i]]);
+
+    for (u64 i = 0; i < table->size; i++) {
+
+        if (!scene_ids_has(&c.ids, i)) continue;
+
+        HashTableEntry* entry = &table->entries[i];
+        writer_view(w, entry->key);
+
+        if (i == story->quit_index) continue;
+        for (u64 j = 0; j < language_count; j++) writer_view(w, table->values[i].text[filter->languages[j]]);
+    }
+
+    for (u64 i = 0; i < table->size; i++) {
+
+        if (!scene_ids_has(&c.ids, i) || i == story->quit_index) continue;
+
+        Scene* scene = &table->values[i];
+        for (u64 k = 0; k < scene->option_count; k++) {
+            for (u64 j = 0; j < language_count; j++) writer_view(w, scene->options[k].text[filter->languages[j]]);
+        }
+    }
+
+    assert(w->written == h.size || w->failed);
+
+    scene_ids_free(&c.ids);
+    perfect_hash_free(&c.lookup);
+    memory_free(c.lookup_scenes);
+    return 1;
+}
@@ -1,174 +1,687 @@
+/* ==== Hash Map ==== */
 
-typedef u32 HashFunction(String s);
+/*
+    Define_HashMap(Key, Value) makes HashMap(Key, Value), an open addressing table with triangular probing,
+    and its functions, named with hash_map(Key, Value, function):
 
-typedef struct {
-    String key;      
-    Scene  value;    
-    u32    hash;
-    u32    occupied; 
-} HashTableEntry;
+        Define_HashMap(String, u64);
+        
+        HashMap(String, u64) map = hash_map(String, u64, init)(64, 0.7, memory_table);
+        hash_map(String, u64, put)(&map, string("foo"), 1);
+        u64* value = hash_map(String, u64, get)(&map, string("foo"));   // NULL if it's not there
 
-typedef struct {
-    HashFunction*   hash_function;
-    HashTableEntry* entries;
-    u64             entry_count;
-    u64             size;         // total allocated
-    f64             load_factor;
-} HashTable;
-
-HashTable table_init(u64 size, f64 load_factor, HashFunction* f) {
+    The key type needs hash_map_hash_Key() and hash_map_equal_Key() (see Keys below), the map calls them directly,
+    so they can be inlined, unlike the function pointer we used to have.
+
+    Define_HashMap keeps the value in the entry, for small values, so a hit is one cache line.
+    Define_HashMap_Indirect keeps the values in their own array, map.values[slot], for big values like Scene,
+    so probing only walks the keys and the hashes. Everything else is the same.
+
+    A slot only moves when the map grows or gets a new seed (rehash_count changes), so it can be an id until then.
     
-    if (load_factor <= 0 || load_factor >= 1) load_factor = 0.7;
+    note: a multi-word key or value type needs a typedef first, the names are made with ##
+*/
+
+#define HashMap(Key, Value)             HashMap_ ## Key ## _ ## Value
+#define HashMapEntry(Key, Value)        HashMapEntry_ ## Key ## _ ## Value
+#define hash_map(Key, Value, function)  HashMap_ ## Key ## _ ## Value ## _ ## function
+
+#define Define_HashMap(Key, Value)          Define_HashMap_Layout(Key, Value, Value value;, 0, hash_map_value_inline)
+#define Define_HashMap_Indirect(Key, Value) Define_HashMap_Layout(Key, Value, , 1, hash_map_value_indirect)
+
+#define hash_map_value_inline(map, index)   (&(map)->entries[index].value)
+#define hash_map_value_indirect(map, index) (&(map)->values[index])
+
+// the longest probe we put up with before rebalance, normal label sets stay well below it
+#define table_probe_limit(size)  (12 + 2 * table_log2(size))
+#define table_max_reseed         4
+
+u64 table_log2(u64 x) {
+    u64 result = 0;
+    while (x > 1) {
+        x >>= 1;
+        result++;
+    }
+    return result;
+}
+
+// note: comments in here are /* */, since a // would eat the rest of the macro
+
+#define Define_HashMap_Layout(Key, Value, value_field, indirect, value_of)                                              \
+typedef struct {                                                                                                        \
+    Key key;                                                                                                            \
+    value_field                                                                                                         \
+    u32 hash;                                                                                                           \
+    u16 occupied;                                                                                                       \
+    u16 deleted;    /* removed, probing goes on past it */                                                              \
+} HashMapEntry(Key, Value);                                                                                             \
+                                                                                                                        \
+typedef struct {                                                                                                        \
+    HashMapEntry(Key, Value)* entries;                                                                                  \
+    Value*    values;          /* per slot with Define_HashMap_Indirect, NULL otherwise */                              \
+    u64       entry_count;                                                                                              \
+    u64       deleted_count;                                                                                            \
+    u64       size;            /* total allocated */                                                                    \
+    f64       load_factor;                                                                                              \
+    MemoryTag tag;                                                                                                      \
+    u32       seed;            /* 0 until a probe gets too long, see rebalance */                                       \
+    u32       max_probe;       /* the longest probe of an insert since the last rehash */                               \
+    u64       rehash_count;    /* every time the slots move, growing or a new seed */                                   \
+    u64       reseed_count;                                                                                             \
+} HashMap(Key, Value);                                                                                                  \
+                                                                                                                        \
+/* with Define_HashMap_Indirect, a map with no values array, for values we keep somewhere else by slot, */              \
+/* then only add(), get_index() and get_entry() make sense, get() and put() need the values */                          \
+HashMap(Key, Value) hash_map(Key, Value, init_keys)(u64 size, f64 load_factor, MemoryTag tag) {                         \
+                                                                                                                        \
+    if (load_factor <= 0 || load_factor >= 1) load_factor = 0.7;                                                        \
+                                                                                                                        \
+    /* find min powers of 2 larger or equal to count */                                                                 \
+    u64 base = 32;                                                                                                      \
+    while (base < size) base *= 2;                                                                                      \
+                                                                                                                        \
+    HashMap(Key, Value) map = { .size = base, .load_factor = load_factor, .tag = tag };                                 \
+    map.entries = memory_calloc(tag, base, sizeof(HashMapEntry(Key, Value)));                                           \
+    return map;                                                                                                         \
+}                                                                                                                       \
+                                                                                                                        \
+HashMap(Key, Value) hash_map(Key, Value, init)(u64 size, f64 load_factor, MemoryTag tag) {                              \
+    HashMap(Key, Value) map = hash_map(Key, Value, init_keys)(size, load_factor, tag);                                  \
+    if (indirect) map.values = memory_calloc(tag, map.size, sizeof(Value));                                             \
+    return map;                                                                                                         \
+}                                                                                                                       \
+                                                                                                                        \
+void hash_map(Key, Value, free)(HashMap(Key, Value)* map) {                                                             \
+    memory_free(map->entries);                                                                                          \
+    memory_free(map->values);                                                                                           \
+    *map = (HashMap(Key, Value)) {0};                                                                                   \
+}                                                                                                                       \
+                                                                                                                        \
+/* puts every entry in new_size slots with the seed, the slots of everything move */                                    \
+u8 hash_map(Key, Value, rehash)(HashMap(Key, Value)* map, u64 new_size, u32 seed) {                                     \
+                                                                                                                        \
+    if (new_size < map->size) return 0; /* handle overflow */                                                           \
+                                                                                                                        \
+    HashMapEntry(Key, Value)* new_entries = memory_calloc(memory_resize, new_size, sizeof(HashMapEntry(Key, Value)));   \
+    Value*                    new_values  = map->values ? memory_calloc(memory_resize, new_size, sizeof(Value)) : NULL; \
+    if (!new_entries || (map->values && !new_values)) {                                                                 \
+        memory_free(new_entries);                                                                                       \
+        memory_free(new_values);                                                                                        \
+        return 0;                                                                                                       \
+    }                                                                                                                   \
+                                                                                                                        \
+    u32 max_probe = 0;                                                                                                  \
+                                                                                                                        \
+    for (u64 i = 0; i < map->size; i++) {                                                                               \
+                                                                                                                        \
+        HashMapEntry(Key, Value)* it = &map->entries[i];                                                                \
+        if (!it->occupied) continue;                                                                                    \
+                                                                                                                        \
+        u32 hash  = seed == map->seed ? it->hash : hash_map_hash_ ## Key(it->key, seed);                                \
+        u64 index = hash & (new_size - 1);                                                                              \
+                                                                                                                        \
+        /* the keys are all different, so we only look for a free slot */                                               \
+        u64 probe_count = 1;                                                                                            \
+        while (new_entries[index].occupied) {                                                                           \
+            index = (index + probe_count) & (new_size - 1); /* triangular probing */                                    \
+            probe_count++;                                                                                              \
+        }                                                                                                               \
+                                                                                                                        \
+        if (probe_count > max_probe) max_probe = probe_count;                                                           \
+                                                                                                                        \
+        new_entries[index]      = *it;                                                                                  \
+        new_entries[index].hash = hash;                                                                                 \
+        if (map->values) new_values[index] = map->values[i];                                                            \
+    }                                                                                                                   \
+                                                                                                                        \
+    memory_free(map->entries);                                                                                          \
+    memory_free(map->values);                                                                                           \
+    memory_retag(new_entries, map->tag);                                                                                \
+    memory_retag(new_values,  map->tag);                                                                                \
+                                                                                                                        \
+    map->entries       = new_entries;                                                                                   \
+    map->values        = new_values;                                                                                    \
+    map->size          = new_size;                                                                                      \
+    map->seed          = seed;                                                                                          \
+    map->max_probe     = max_probe;                                                                                     \
+    map->deleted_count = 0;                                                                                             \
+    map->rehash_count++;                                                                                                \
+                                                                                                                        \
+    return 1;                                                                                                           \
+}                                                                                                                       \
+                                                                                                                        \
+u8 hash_map(Key, Value, resize)(HashMap(Key, Value)* map) {                                                             \
+    return hash_map(Key, Value, rehash)(map, map->size * 2, map->seed);                                                 \
+}                                                                                                                       \
+                                                                                                                        \
+/* a fuller table grows early, otherwise we try other seeds at the same size, and grow if none of them helps */         \
+u8 hash_map(Key, Value, rebalance)(HashMap(Key, Value)* map) {                                                          \
+                                                                                                                        \
+    if ((f64) map->entry_count > (f64) map->size * map->load_factor * 0.75) return hash_map(Key, Value, resize)(map);   \
+                                                                                                                        \
+    u32 seed = map->seed;                                                                                               \
+    for (u64 i = 0; i < table_max_reseed; i++) {                                                                        \
+                                                                                                                        \
+        seed = seed * 0x9e3779b9 + 0x7f4a7c15;                                                                          \
+                                                                                                                        \
+        if (!hash_map(Key, Value, rehash)(map, map->size, seed)) return 0;                                              \
+        map->reseed_count++;                                                                                            \
+                                                                                                                        \
+        if (map->max_probe <= table_probe_limit(map->size)) return 1;                                                   \
+    }                                                                                                                   \
+                                                                                                                        \
+    return hash_map(Key, Value, resize)(map);                                                                           \
+}                                                                                                                       \
+                                                                                                                        \
+u8 hash_map(Key, Value, get_index)(HashMap(Key, Value)* map, Key key, u64* index_out) {                                 \
+                                                                                                                        \
+    *index_out = 0;                                                                                                     \
+                                                                                                                        \
+    u32 hash  = hash_map_hash_ ## Key(key, map->seed);                                                                  \
+    u64 index = hash & (map->size - 1);                                                                                 \
+                                                                                                                        \
+    u64 probe_count = 1;                                                                                                \
+    while (map->entries[index].occupied || map->entries[index].deleted) {                                               \
+                                                                                                                        \
+        HashMapEntry(Key, Value)* entry = &map->entries[index];                                                         \
+        if (entry->occupied && hash == entry->hash && hash_map_equal_ ## Key(key, entry->key)) {                        \
+            *index_out = index;                                                                                         \
+            return 1;                                                                                                   \
+        }                                                                                                               \
+                                                                                                                        \
+        index = (index + probe_count) & (map->size - 1); /* triangular probing */                                       \
+        probe_count++;                                                                                                  \
+                                                                                                                        \
+        if (probe_count >= map->size) return 0; /* we've searched through all the entries, so we don't have it */       \
+    }                                                                                                                   \
+                                                                                                                        \
+    return 0;                                                                                                           \
+}                                                                                                                       \
+                                                                                                                        \
+HashMapEntry(Key, Value)* hash_map(Key, Value, get_entry)(HashMap(Key, Value)* map, Key key) {                          \
+    u64 index;                                                                                                          \
+    if (!hash_map(Key, Value, get_index)(map, key, &index)) return NULL;                                                \
+    return &map->entries[index];                                                                                        \
+}                                                                                                                       \
+                                                                                                                        \
+Value* hash_map(Key, Value, get)(HashMap(Key, Value)* map, Key key) {                                                   \
+    u64 index;                                                                                                          \
+    if (!hash_map(Key, Value, get_index)(map, key, &index)) return NULL;                                                \
+    return value_of(map, index);                                                                                        \
+}                                                                                                                       \
+                                                                                                                        \
+/* puts the key if it's not there, and gives its slot, 0 if we are out of memory, the value is left as it was */        \
+u8 hash_map(Key, Value, add)(HashMap(Key, Value)* map, Key key, u64* index_out) {                                       \
+                                                                                                                        \
+    if ((f64) (map->entry_count + map->deleted_count + 1) > (f64) map->size * map->load_factor) {                       \
+        TraceSpan span = trace_begin("table_resize");                                                                   \
+        u8 ok = map->deleted_count > map->entry_count ? hash_map(Key, Value, rehash)(map, map->size, map->seed) : hash_map(Key, Value, resize)(map); \
+        trace_end(span);                                                                                                \
+        if (!ok) return 0;                                                                                              \
+    }                                                                                                                   \
+                                                                                                                        \
+    u32 hash  = hash_map_hash_ ## Key(key, map->seed);                                                                  \
+    u64 index = hash & (map->size - 1);                                                                                 \
+                                                                                                                        \
+    u64 reuse       = map->size; /* the first removed slot on the way, if any */                                        \
+    u64 reuse_probe = 0;                                                                                                \
+                                                                                                                        \
+    u64 probe_count = 1;                                                                                                \
+    while (map->entries[index].occupied || map->entries[index].deleted) {                                               \
+                                                                                                                        \
+        HashMapEntry(Key, Value)* entry = &map->entries[index];                                                         \
+        if (entry->occupied && hash == entry->hash && hash_map_equal_ ## Key(key, entry->key)) {                        \
+            *index_out = index;                                                                                         \
+            return 1;                                                                                                   \
+        }                                                                                                               \
+                                                                                                                        \
+        if (!entry->occupied && reuse == map->size) {                                                                   \
+            reuse       = index;                                                                                        \
+            reuse_probe = probe_count;                                                                                  \
+        }                                                                                                               \
+                                                                                                                        \
+        index = (index + probe_count) & (map->size - 1); /* triangular probing */                                       \
+        probe_count++;                                                                                                  \
+                                                                                                                        \
+        if (probe_count >= map->size && reuse == map->size) return 0; /* we've searched through all the entries */      \
+        if (probe_count >= map->size) break;                                                                            \
+    }                                                                                                                   \
+                                                                                                                        \
+    if (reuse != map->size) {                                                                                           \
+        index       = reuse;                                                                                            \
+        probe_count = reuse_probe;                                                                                      \
+        map->deleted_count--;                                                                                           \
+    }                                                                                                                   \
+                                                                                                                        \
+    map->entries[index] = (HashMapEntry(Key, Value)) { .key = key, .hash = hash, .occupied = 1 };                       \
+    map->entry_count++;                                                                                                 \
+                                                                                                                        \
+    if (probe_count > map->max_probe) map->max_probe = probe_count;                                                     \
+                                                                                                                        \
+    if (probe_count > table_probe_limit(map->size)) {                                                                   \
+                                                                                                                        \
+        TraceSpan span = trace_begin("table_rebalance");                                                                \
+        u8 ok = hash_map(Key, Value, rebalance)(map);                                                                   \
+        trace_end(span);                                                                                                \
+        if (!ok) return 0;                                                                                              \
+                                                                                                                        \
+        return hash_map(Key, Value, get_index)(map, key, index_out);                                                    \
+    }                                                                                                                   \
+                                                                                                                        \
+    *index_out = index;                                                                                                 \
+    return 1;                                                                                                           \
+}                                                                                                                       \
+                                                                                                                        \
+/* gives where the value is now, NULL if we are out of memory */                                                        \
+Value* hash_map(Key, Value, put)(HashMap(Key, Value)* map, Key key, Value value) {                                      \
+    u64 index;                                                                                                          \
+    if (!hash_map(Key, Value, add)(map, key, &index)) return NULL;                                                      \
+    *value_of(map, index) = value;                                                                                      \
+    return value_of(map, index);                                                                                        \
+}                                                                                                                       \
+                                                                                                                        \
+/* leaves a tombstone, so the keys after it on the same probe can still be found */                                     \
+u8 hash_map(Key, Value, remove)(HashMap(Key, Value)* map, Key key) {                                                    \
+                                                                                                                        \
+    u64 index;                                                                                                          \
+    if (!hash_map(Key, Value, get_index)(map, key, &index)) return 0;                                                   \
+                                                                                                                        \
+    map->entries[index].occupied = 0;                                                                                   \
+    map->entries[index].deleted  = 1;                                                                                   \
+    if (!indirect || map->values) *value_of(map, index) = (Value) {0};                                                  \
+                                                                                                                        \
+    map->entry_count--;                                                                                                 \
+    map->deleted_count++;                                                                                               \
+                                                                                                                        \
+    return 1;                                                                                                           \
+}                                                                                                                       \
+                                                                                                                        \
+/* moves *index to the next slot with an entry, for (u64 i = 0; hash_map(K, V, next)(&map, &i); i++) walks all of them */ \
+u8 hash_map(Key, Value, next)(HashMap(Key, Value)* map, u64* index) {                                                   \
+    while (*index < map->size && !map->entries[*index].occupied) (*index)++;                                            \
+    return *index < map->size;                                                                                          \
+}                                                                                                                       \
+                                                                                                                        \
+/* so the user can put a ';' after Define_HashMap(), like after Define_Array() */                                       \
+u8 hash_map(Key, Value, next)(HashMap(Key, Value)* map, u64* index)
+
+
+
+
+/* ==== Hash Functions ==== */
+
+// with a seed, the bits are mixed at the end, so similar labels don't stay close in the low bits
+u32 hash_finish(u32 hash) {
+    hash ^= hash >> 16;
+    hash *= 0x85ebca6b;
+    hash ^= hash >> 13;
+    hash *= 0xc2b2ae35;
+    hash ^= hash >> 16;
+    return hash;
+}
+
+u32 get_hash_djb2(String s, u32 seed) {
     
-    // find min powers of 2 larger or equal to count
-    {
-        u64 base = 32;
-        while (base < size) base *= 2;
-        size = base;
+    u32 hash = 5381 ^ seed;
+    for (u64 i = 0; i < s.count; i++) {
+        hash += (hash << 5) + s.data[i];
     }
     
-    return (HashTable) {
-        .hash_function = f,
-        .entries       = calloc(size, sizeof(HashTableEntry)),
-        .entry_count   = 0,
-        .size          = size,
-        .load_factor   = load_factor,
-    };
+    return seed ? hash_finish(hash) : hash;
 }
 
-// todo: validate
-u8 table_resize(HashTable* table) {
-        
-    u64 new_size = table->size * 2;
-    if (new_size < table->size) return 0; // handle overflow
+// note: seed 0 is plain fnv1a, which is what the slots of a story have always been
+u32 get_hash_fnv1a(String s, u32 seed) {
 
-    HashTableEntry* new_entries = calloc(new_size, sizeof(HashTableEntry));
-    if (!new_entries) return 0;
+    u32 hash = 0x811c9dc5 ^ seed;
+    for (u64 i = 0; i < s.count; i++) {
+        hash ^= (u32) s.data[i];
+        hash *= 0x01000193;
+    }
     
-    // re-slot all old entries. todo: is this slow? 
-    for (u64 i = 0; i < table->size; i++) {
+    return seed ? hash_finish(hash) : hash;
+}
 
-        HashTableEntry* it = &table->entries[i];
-        if (!it->occupied) continue;
-        
-        u32 hash  = it->hash;
-        u64 index = hash & (new_size - 1);
-        
-        u64 probe_count = 1;
-        while (new_entries[index].occupied) {
-            
-            HashTableEntry* entry = &new_entries[index];
-            if (hash == entry->hash && string_equal(it->key, entry->key)) {
-                goto next;
-            }
-            
-            index = (index + probe_count) & (new_size - 1); // triangular probing
-            probe_count++;
 
-            if (probe_count >= new_size) return 0; // should not happen?
-        }
-        
-        new_entries[index] = *it;
-        next: continue;
+// for content hashing, where 32 bits are not enough to tell files apart
+u64 get_hash_fnv1a_64(String s) {
+
+    u64 hash = 0xcbf29ce484222325;
+    for (u64 i = 0; i < s.count; i++) {
+        hash ^= (u64) s.data[i];
+        hash *= 0x100000001b3;
     }
     
-    free(table->entries);
-    table->entries = new_entries;
-    table->size    = new_size;
+    return hash;
+}
+
+
 
-    return 1;
+/* ---- Keys ---- */
+
+u32 hash_map_hash_String(String key, u32 seed) {
+    return get_hash_fnv1a(key, seed);
 }
 
-// todo: validate
-HashTableEntry* table_put(HashTable* table, String key, Scene value) {
-   
-    if ((f64) (table->entry_count + 1) > (f64) table->size * table->load_factor) { 
-        u8 ok = table_resize(table);
-        if (!ok) return NULL;
-    }
-    
-    u32 hash  = table->hash_function(key);
-    u64 index = hash & (table->size - 1);
-    
-    u64 probe_count = 1;
-    while (table->entries[index].occupied) {
-        
-        HashTableEntry* entry = &table->entries[index];
-        if (hash == entry->hash && string_equal(key, entry->key)) {
-            entry->value = value; // update value
-            return entry;
-        }
-        
-        index = (index + probe_count) & (table->size - 1); // triangular probing
-        probe_count++;
-        
-        if (probe_count >= table->size) return NULL; // we've searched through all the entries
+u8 hash_map_equal_String(String a, String b) {
+    return string_equal(a, b);
+}
+
+// murmur3 fmix64, then folded to 32 bits
+u32 hash_map_hash_u64(u64 key, u32 seed) {
+    key ^= seed;
+    key ^= key >> 33;
+    key *= 0xff51afd7ed558ccd;
+    key ^= key >> 33;
+    key *= 0xc4ceb9fe1a85ec53;
+    key ^= key >> 33;
+    return (u32) key;
+}
+
+u8 hash_map_equal_u64(u64 a, u64 b) {
+    return a == b;
+}
+
+
+
+
+/* ==== Perfect Hash ==== */
+
+/*
+    For a fixed set of keys (the labels of an exported story), a minimal perfect hash gives each key
+    its own place in [0, count), so a lookup is one hash, one place and one compare to tell a miss,
+    with no probing and no empty places. This is CHD (compress, hash and displace):
+
+        hash   = perfect_hash_key(key, seed)
+        bucket = hash % bucket_count
+        f1     = (hash >> 32) % count
+        f2     = ((hash * 0x9e3779b97f4a7c15) >> 32) % count
+        place  = (f1 + d0 * f2 + d1) % count, with { d0, d1 } = displacements[bucket]
+
+    The buckets are placed biggest first, each with the first { d0, d1 } that puts all of its keys in free places,
+    a bucket of one key just takes the next free place. The exporters write the same steps out, so keep them in sync.
+*/
+
+#define perfect_hash_keys_per_bucket  4
+#define perfect_hash_max_seed         8
+#define perfect_hash_max_tries        (1 << 20)   // per bucket, a bucket that can't be placed in this many gets a new seed
+
+typedef struct {
+    u32  seed;
+    u64  count;          // of keys, and of places
+    u64  bucket_count;
+    u32* displacements;  // d0 and d1 of each bucket
+} PerfectHash;
+
+u64 perfect_hash_key(String key, u32 seed) {
+
+    u64 hash = 0xcbf29ce484222325 ^ seed;
+    for (u64 i = 0; i < key.count; i++) {
+        hash ^= (u64) key.data[i];
+        hash *= 0x100000001b3;
     }
-    
-    table->entries[index] = (HashTableEntry) { key, value, hash, 1 };
-    table->entry_count++;
 
-    return &table->entries[index];
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccd;
+    hash ^= hash >> 33;
+    hash *= 0xc4ceb9fe1a85ec53;
+    hash ^= hash >> 33;
+    return hash;
 }
 
-// todo: validate
-u8 table_get_index(HashTable* table, String key, u64* index_out) {
+// the place of the key if it's one of the keys, some place otherwise, so the caller still has to compare
+u64 perfect_hash_get(PerfectHash* ph, String key) {
 
-    *index_out = 0;
+    u64  hash = perfect_hash_key(key, ph->seed);
+    u32* d    = &ph->displacements[2 * (hash % ph->bucket_count)];
+    u64  f1   = (hash >> 32) % ph->count;
+    u64  f2   = ((hash * 0x9e3779b97f4a7c15) >> 32) % ph->count;
 
-    u32 hash  = table->hash_function(key);
-    u64 index = hash & (table->size - 1);
-    
-    u64 probe_count = 1;
-    while (table->entries[index].occupied) {
-        
-        HashTableEntry* entry = &table->entries[index];
-        if (hash == entry->hash) {
-            if (string_equal(key, entry->key)) {
-                *index_out = index;
-                return 1;
+    return (f1 + d[0] * f2 + d[1]) % ph->count;
+}
+
+typedef struct {
+    u64 bucket;
+    u64 f1;
+    u64 f2;
+} PerfectHashKey;
+
+int compare_perfect_hash_key(const void* a, const void* b) {
+    u64 x = ((PerfectHashKey*) a)->bucket;
+    u64 y = ((PerfectHashKey*) b)->bucket;
+    return x < y ? -1 : x > y;
+}
+
+typedef struct {
+    u64 first;   // in the sorted keys
+    u64 count;
+} PerfectHashBucket;
+
+// biggest first, then by bucket, so the result only depends on the keys
+int compare_perfect_hash_bucket(const void* a, const void* b) {
+    PerfectHashBucket* x = (PerfectHashBucket*) a;
+    PerfectHashBucket* y = (PerfectHashBucket*) b;
+    if (x->count != y->count) return x->count > y->count ? -1 : 1;
+    return x->first < y->first ? -1 : x->first > y->first;
+}
+
+// gives 0 if no seed works, which only happens with duplicate keys, or with no keys
+u8 perfect_hash_build(PerfectHash* out, String* keys, u64 count, MemoryTag tag) {
+
+    if (!count) return 0;
+
+    u64 bucket_count = (count + perfect_hash_keys_per_bucket - 1) / perfect_hash_keys_per_bucket;
+
+    PerfectHashKey*    hashed  = memory_alloc(tag, count * sizeof(PerfectHashKey));
+    PerfectHashBucket* buckets = memory_alloc(tag, bucket_count * sizeof(PerfectHashBucket));
+    u8*                taken   = NULL;
+    u64*               places  = memory_alloc(tag, count * sizeof(u64));   // of the bucket we are placing
+    u32*               d       = memory_alloc(tag, 2 * bucket_count * sizeof(u32));
+
+    u8 ok = 0;
+    for (u32 seed = 0; seed < perfect_hash_max_seed && !ok; seed++) {
+
+        for (u64 i = 0; i < count; i++) {
+            u64 hash = perfect_hash_key(keys[i], seed);
+            hashed[i] = (PerfectHashKey) {
+                .bucket = hash % bucket_count,
+                .f1     = (hash >> 32) % count,
+                .f2     = ((hash * 0x9e3779b97f4a7c15) >> 32) % count,
+            };
+        }
+        qsort(hashed, count, sizeof(PerfectHashKey), compare_perfect_hash_key);
+
+        for (u64 i = 0, k = 0; i < bucket_count; i++) {
+            buckets[i].first = k;
+            while (k < count && hashed[k].bucket == i) k++;
+            buckets[i].count = k - buckets[i].first;
+        }
+        qsort(buckets, bucket_count, sizeof(PerfectHashBucket), compare_perfect_hash_bucket);
+
+        memory_free(taken);
+        taken = memory_calloc(tag, count, sizeof(u8));
+        memset(d, 0, 2 * bucket_count * sizeof(u32));
+
+        ok = 1;
+        u64 free_place = 0;
+        for (u64 i = 0; i < bucket_count && ok; i++) {
+
+            PerfectHashBucket* bucket = &buckets[i];
+            if (!bucket->count) break;
+
+            PerfectHashKey* first  = &hashed[bucket->first];
+            u32*            result = &d[2 * first->bucket];
+
+            if (bucket->count == 1) {
+                while (taken[free_place]) free_place++;
+                taken[free_place] = 1;
+                result[1] = (u32) ((free_place + count - first->f1) % count);
+                continue;
             }
+
+            u64 tries  = 0;
+            u8  placed = 0;
+            for (u64 d0 = 0; d0 < count && !placed && tries < perfect_hash_max_tries; d0++) {
+                for (u64 d1 = 0; d1 < count && !placed && tries < perfect_hash_max_tries; d1++, tries++) {
+
+                    u64 k = 0;
+                    for (; k < bucket->count; k++) {
+
+                        u64 place = (first[k].f1 + d0 * first[k].f2 + d1) % count;
+                        if (taken[place]) break;
+
+                        taken[place] = 1;
+                        places[k]    = place;
+                    }
+
+                    if (k == bucket->count) {
+                        placed    = 1;
+                        result[0] = (u32) d0;
+                        result[1] = (u32) d1;
+                    } else {
+                        for (u64 j = 0; j < k; j++) taken[places[j]] = 0;
+                    }
+                }
+            }
+
+            if (!placed) ok = 0;
+        }
+
+        if (ok) {
+            *out = (PerfectHash) {
+                .seed          = seed,
+                .count         = count,
+                .bucket_count  = bucket_count,
+                .displacements = d,
+            };
         }
-        
-        index = (index + probe_count) & (table->size - 1); // triangular probing
-        probe_count++;
-        
-        if (probe_count >= table->size) return 0; // we've searched through all the entries, so we don't have it
     }
-    
-    return 0;
+
+    memory_free(hashed);
+    memory_free(buckets);
+    memory_free(taken);
+    memory_free(places);
+    if (!ok) memory_free(d);
+
+    return ok;
 }
 
-HashTableEntry* table_get_entry(HashTable* table, String key) {
-    u64 index;
-    u8 ok = table_get_index(table, key, &index);
-    if (!ok) return NULL;
-    return &table->entries[index];
+void perfect_hash_free(PerfectHash* ph) {
+    memory_free(ph->displacements);
+    *ph = (PerfectHash) {0};
 }
 
 
 
 
-/* ==== Hash Functions ==== */
+/* ==== Scene Table ==== */
+
+/*
+    The labels of a story, the slot of a label is the id of its scene (see Session),
+    so slots must only depend on the labels. A Scene is big, so the values are in their own array,
+    and with a scene cache there is no values array at all (see SceneCache in backend.c).
+*/
+
+Define_HashMap_Indirect(String, Scene);
+
+typedef HashMap(String, Scene)      HashTable;
+typedef HashMapEntry(String, Scene) HashTableEntry;
+
+#define table_init       hash_map(String, Scene, init)
+#define table_init_keys  hash_map(String, Scene, init_keys)
+#define table_free       hash_map(String, Scene, free)
+#define table_rehash     hash_map(String, Scene, rehash)
+#define table_resize     hash_map(String, Scene, resize)
+#define table_rebalance  hash_map(String, Scene, rebalance)
+#define table_get_index  hash_map(String, Scene, get_index)
+#define table_get        hash_map(String, Scene, get)
+#define table_get_entry  hash_map(String, Scene, get_entry)
+#define table_put        hash_map(String, Scene, put)
+#define table_add        hash_map(String, Scene, add)
+
+
 
-u32 get_hash_djb2(String s) {
+
+/* ---- Stats ---- */
+
+#define table_histogram_count 17
+
+typedef struct {
+    u64 hit_histogram[table_histogram_count];  // [i] is a probe of i + 1 slots, the last one is that or longer
+    f64 hit_mean;
+    u64 hit_max;
+    f64 miss_mean;                             // from every slot, as if the hash of the missing key could be anything
+    u64 miss_max;
+    u64 cluster_histogram[6];                  // runs of full slots: 1, 2-3, 4-7, 8-15, 16-31, 32 and more
+    u64 cluster_count;
+    f64 cluster_mean;
+    u64 cluster_max;
+} TableStats;
+
+TableStats table_get_stats(HashTable* table) {
     
-    u32 hash = 5381;
-    for (u64 i = 0; i < s.count; i++) {
-        hash += (hash << 5) + s.data[i];
+    TableStats stats = {0};
+    u64        mask  = table->size - 1;
+    
+    u64 hit_total = 0;
+    for (u64 i = 0; i < table->size; i++) {
+        
+        if (!table->entries[i].occupied) continue;
+        
+        u64 index       = table->entries[i].hash & mask;
+        u64 probe_count = 1;
+        while (index != i) {
+            index = (index + probe_count) & mask;
+            probe_count++;
+        }
+        
+        hit_total += probe_count;
+        if (probe_count > stats.hit_max) stats.hit_max = probe_count;
+        stats.hit_histogram[probe_count < table_histogram_count ? probe_count - 1 : table_histogram_count - 1]++;
     }
     
-    return hash;
-}
-
-u32 get_hash_fnv1a(String s) {
-
-    u32 hash = 0x811c9dc5;
-    for (u64 i = 0; i < s.count; i++) {
-        hash ^= (u32) s.data[i];
-        hash *= 0x01000193;
+    u64 miss_total = 0;
+    for (u64 i = 0; i < table->size; i++) {
+        
+        u64 index       = i;
+        u64 probe_count = 1;
+        while (table->entries[index].occupied && probe_count < table->size) {
+            index = (index + probe_count) & mask;
+            probe_count++;
+        }
+        
+        miss_total += probe_count;
+        if (probe_count > stats.miss_max) stats.miss_max = probe_count;
     }
     
-    return hash;
+    // clusters can go around the end, so we start after an empty slot
+    u64 start = 0;
+    while (start < table->size && table->entries[start].occupied) start++;
+    
+    u64 run         = 0;
+    u64 run_total   = 0;
+    for (u64 i = 1; i <= table->size; i++) {
+        
+        if (table->entries[(start + i) & mask].occupied) {
+            run++;
+            continue;
+        }
+        
+        if (!run) continue;
+        
+        u64 bucket = 0;
+        while (bucket < count_of(stats.cluster_histogram) - 1 && run >= ((u64) 2 << bucket)) bucket++;
+        
+        stats.cluster_histogram[bucket]++;
+        stats.cluster_count++;
+        run_total += run;
+        if (run > stats.cluster_max) stats.cluster_max = run;
+        run = 0;
+    }
+    
+    if (table->entry_count)  stats.hit_mean     = (f64) hit_total  / table->entry_count;
+    if (table->size)         stats.miss_mean    = (f64) miss_total / table->size;
+    if (stats.cluster_count) stats.cluster_mean = (f64) run_total  / stats.cluster_count;
+    
+    return stats;
 }
-
@@ -1,15 +1,39 @@
+#define _POSIX_C_SOURCE 200809L // for fileno(), clock_gettime() and the like in platform.c, the rest is C99
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdarg.h>
 #include <string.h>
 #include <assert.h>
+#include <setjmp.h>
+#include <signal.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+#if defined(__GNUC__) && defined(__x86_64__)
+#include <tmmintrin.h> // SSSE3, only used by code built for it and picked at runtime, see the UTF-8 section in string.c
+#endif
 
 
 #include "base.c"
+#include "platform.c"
+#include "trace.c"
+#include "memory.c"
 #include "string.c"
 #include "types.c"
 #include "hash_table.c"
+#include "writer.c"
+#include "script.c"
 #include "backend.c"
+#include "export.c"
+#include "stream.c"
+#include "daemon.c"
+#include "search.c"
+#include "coverage.c"
+#include "check.c"
+#include "bench.c"
 
 
 
@@ -30,13 +54,59 @@ int main(int arg_count, char** args) {
     }
 
     char* example_string = 
-        "Example Usages:\n"
-        "story run          foo.story\n"
-        "story export       foo.story foo.c\n"
-        "story export-graph foo.story foo.dot\n"
-        "story export-twee  foo.story foo.twee en_us\n"
+        "Example Usages (any command can take --trace trace.json, --mem-report and --parse-cache, and foo.story can be - for stdin, except for run):\n"
+        "story run          foo.story [--eager] [--max-resident MB] [--watch]\n"
+        "story export       foo.story foo.c            [--reachable-only] [--languages en,zh]\n"
+        "story export-graph foo.story foo.dot          [--reachable-only]\n"
+        "story export-twee  foo.story foo.twee en_us   [--reachable-only]\n"
+        "story export-twee  foo.story out_dir --all-languages [--reachable-only] [--languages en,zh]\n"
+        "story export-json  foo.story foo.json         [--reachable-only] [--languages en,zh]\n"
+        "story export-bin   foo.story foo.bin          [--reachable-only] [--languages en,zh]\n"
+        "story index        foo.story [foo.story.idx]\n"
+        "story grep         foo.story \"some text\" [foo.story.idx]\n"
+        "story coverage     foo.story\n"
+        "story check        foo.story\n"
+        "story stats        foo.story [--table]\n"
+        "story daemon       foo.story foo.sock\n"
+        "story query        foo.sock refs [foo]\n"
+        "story bench-export out_dir [foo.story] [--repeat N]\n"
+        "story bench        out_dir [--sizes 1000,10000] [--repeat N] [--languages L] [--options K] [--text-bytes B]\n"
+        "story generate     foo.story [--scenes N] [--languages L] [--options K] [--text-bytes B] [--seed S]\n"
     ;
 
+    // with --parse-cache, the commands that parse every scene keep what they parsed in .story-cache/ for the next run
+    u8 parse_cache = 0;
+
+    // --trace, --mem-report and --parse-cache work with every command, so we take them out before the commands look at their flags
+    for (int i = 1; i < arg_count; i++) {
+        
+        if (strcmp(args[i], "--trace") == 0) {
+            
+            if (i + 1 >= arg_count) hard_error("--trace needs an output filename, like --trace trace.json\n");
+            trace_enable(args[i + 1]);
+            
+            for (int j = i; j + 2 < arg_count; j++) args[j] = args[j + 2];
+            arg_count -= 2;
+            i--;
+        
+        } else if (strcmp(args[i], "--mem-report") == 0) {
+            
+            memory_enable_tracking();
+            
+            for (int j = i; j + 1 < arg_count; j++) args[j] = args[j + 1];
+            arg_count -= 1;
+            i--;
+        
+        } else if (strcmp(args[i], "--parse-cache") == 0) {
+            
+            parse_cache = 1;
+            
+            for (int j = i; j + 1 < arg_count; j++) args[j] = args[j + 1];
+            arg_count -= 1;
+            i--;
+        }
+    }
+
     if (arg_count < 2) hard_error("You need to specify a command!\n%s", example_string);
 
     char* command = args[1];
@@ -47,12 +117,45 @@ int main(int arg_count, char** args) {
 
     } else if (strcmp(command, "run") == 0) {
         
-        if (arg_count < 3) hard_error("You need to provide a file to run!\n");
+        if (arg_count < 3)          hard_error("You need to provide a file to run!\n");
+        if (path_is_stdin(args[2])) hard_error("The choices are read from stdin, so run needs the story in a file.\n");
+        
+        Story story = { .parse_cache = parse_cache };
+        
+        // scenes are parsed when we first visit them, unless we want to validate the whole file first
+        u8 eager = 0;
+        u8 watch = 0;
+        
+        for (int i = 3; i < arg_count; i++) {
+            if (strcmp(args[i], "--eager") == 0) {
+                eager = 1;
+            } else if (strcmp(args[i], "--watch") == 0) {
+                watch = 1;
+            } else if (strcmp(args[i], "--max-resident") == 0) {
+                u64 mb;
+                if (i + 1 >= arg_count || !parse_u64(c_string_to_string(args[i + 1]), &mb)) {
+                    hard_error("--max-resident needs a size in MB.\n");
+                }
+                story_enable_scene_cache(&story, mb * 1024 * 1024);
+                i++;
+            } else {
+                hard_error("Unknown option \"%s\" for run.\n", args[i]);
+            }
+        }
+        
+        FileWatcher watcher;
+        if (watch) {
+            if (story.cache)                         hard_error("--watch cannot be used with --max-resident.\n");
+            if (!file_watcher_init(&watcher, args[2])) hard_error("Cannot watch \"%s\", or watching is not supported on this platform.\n", args[2]);
+            
+            // we poll stdin before each read_line(), so no line can wait in a stdio buffer where poll() can't see it
+            setvbuf(stdin, NULL, _IONBF, 0);
+        }
         
-        Story story = {0};
-        parse_file_to_story(args[2], &story);
+        parse_file_to_story(args[2], &story, !eager);
+        if (watch) story_watch_includes(&story, &watcher);
         
-        run_story(&story);
+        run_story(&story, NULL, watch ? &watcher : NULL);
     
     } else if (strcmp(command, "export") == 0 || strcmp(command, "export-c") == 0) {
         
@@ -62,36 +165,78 @@ int main(int arg_count, char** args) {
         char* input    = args[2];
         char* output   = args[3];
         
-        Story story = {0};
-        parse_file_to_story(input, &story);
+        Story story = { .parse_cache = parse_cache };
+        parse_file_to_story(input, &story, 0);
+        
+        ExportFilter filter = export_filter_from_args(&story, args + 4, arg_count - 4);
         
-        u8 ok = export_story_to_c_code(&story, output);
+        TraceSpan span = trace_begin("export_c");
+        Writer    w;
+        u8 ok = writer_open(&w, output, writer_gather);
+        if (ok) {
+            export_story_to_c_code(&story, &filter, &w);
+            ok = writer_close(&w);
+        }
+        trace_end(span);
         if (!ok) hard_error("Cannot export \"%s\" to \"%s\".\n", input, output);
 
         printf("Exported \"%s\" to \"%s\".\n", input, output);
+        export_filter_report(&story, &filter);
     
     } else if (strcmp(command, "export-twee") == 0) {
     
         if (arg_count < 3) hard_error("Missing input filename.\n");
         if (arg_count < 4) hard_error("Missing output filename for \"%s\".\n", args[2]);
-        if (arg_count < 5) hard_error("Missing export language for \"%s\".\n", args[2]);
+        if (arg_count < 5) hard_error("Missing export language for \"%s\", or --all-languages.\n", args[2]);
         
         char* input    = args[2];
         char* output   = args[3];
         char* language = args[4];
 
-        Story story = {0};
-        parse_file_to_story(input, &story);
+        Story story = { .parse_cache = parse_cache };
+        parse_file_to_story(input, &story, 0);
+        
+        ExportFilter filter = export_filter_from_args(&story, args + 5, arg_count - 5);
+        
+        if (strcmp(language, "--all-languages") == 0) {
+            
+            // output is a directory here
+            u8 ok = export_story_to_twee_all_languages(&story, &filter, output);
+            if (!ok) hard_error("Cannot export \"%s\" to \"%s\".\n", input, output);
+            
+            printf("Exported \"%s\" to \"%s\" in %llu languages.\n", input, output, filter.language_count);
+            export_filter_report(&story, &filter);
+            
+        } else {
         
-        u64 language_index = 0;
-        if (!language_table_get_index(&story.lang_table, c_string_to_string(language), &language_index)) {
-            hard_error("The file \"%s\" does not contain language \"%s\".", input, language); 
+            u64 language_index = 0;
+            if (!language_table_get_index(&story.lang_table, c_string_to_string(language), &language_index)) {
+                hard_error("The file \"%s\" does not contain language \"%s\".", input, language); 
+            }
+            
+            // twee has one language, so the only thing --languages can do is leaving it out
+            u8 kept = 0;
+            for (u64 i = 0; i < filter.language_count; i++) kept |= filter.languages[i] == language_index;
+            if (!kept) hard_error("--languages leaves out \"%s\", which is the language to export.\n", language);
+           
+            TraceSpan span = trace_begin("export_twee");
+            Writer    w;
+            u8 ok = writer_open(&w, output, writer_gather);
+            if (ok) {
+                export_story_to_twee(&story, &filter, language_index, &w);
+                ok = writer_close(&w);
+            }
+            trace_end(span);
+            if (!ok) hard_error("Cannot export \"%s\" to \"%s\".\n", input, output);
+            
+            printf("Exported \"%s\" to \"%s\".\n", input, output);
+            export_filter_report(&story, &filter);
         }
-       
-        u8 ok = export_story_to_twee(&story, language_index, output);
-        if (!ok) hard_error("Cannot export \"%s\" to \"%s\".\n", input, output);
+    
+    } else if ((strcmp(command, "export-graph") == 0 || strcmp(command, "export-json") == 0) && arg_count >= 4 && path_is_stdin(args[2]) && stream_can_export(args + 4, arg_count - 4)) {
         
-        printf("Exported \"%s\" to \"%s\".\n", input, output);
+        // these two can write each scene as it comes in from the pipe, see stream.c
+        stream_export(args[2], args[3], strcmp(command, "export-json") == 0, args + 4, arg_count - 4);
     
     } else if (strcmp(command, "export-graph") == 0) {
         
@@ -101,14 +246,243 @@ int main(int arg_count, char** args) {
         char* input    = args[2];
         char* output   = args[3];
         
-        Story story = {0};
-        parse_file_to_story(input, &story);
+        Story story = { .parse_cache = parse_cache };
+        parse_file_to_story(input, &story, 0);
+        
+        ExportFilter filter = export_filter_from_args(&story, args + 4, arg_count - 4);
+        
+        TraceSpan span = trace_begin("export_graph");
+        Writer    w;
+        u8 ok = writer_open(&w, output, writer_gather);
+        if (ok) {
+            export_story_to_graphviz_dot_file(&story, &filter, &w);
+            ok = writer_close(&w);
+        }
+        trace_end(span);
+        if (!ok) hard_error("Cannot export \"%s\" to \"%s\".\n", input, output);
+        
+        printf("Exported \"%s\" to \"%s\".\n", input, output);
+        export_filter_report(&story, &filter);
+        
+    } else if (strcmp(command, "export-json") == 0 || strcmp(command, "export-bin") == 0) {
+        
+        if (arg_count < 3) hard_error("Missing input filename.\n");
+        if (arg_count < 4) hard_error("Missing output filename for \"%s\".\n", args[2]);
+        
+        char* input    = args[2];
+        char* output   = args[3];
+        u8    binary   = strcmp(command, "export-bin") == 0;
+        
+        Story story = { .parse_cache = parse_cache };
+        parse_file_to_story(input, &story, 0);
+        
+        ExportFilter filter = export_filter_from_args(&story, args + 4, arg_count - 4);
         
-        u8 ok = export_story_to_graphviz_dot_file(&story, output);
+        TraceSpan span = trace_begin(binary ? "export_bin" : "export_json");
+        Writer    w;
+        u8 ok = writer_open(&w, output, writer_gather);
+        if (ok) {
+            if (binary) {
+                if (!export_story_to_bin(&story, &filter, &w)) {
+                    writer_close(&w);
+                    hard_error("\"%s\" is too big for export-bin, offsets are 32 bits.\n", input);
+                }
+            } else {
+                export_story_to_json(&story, &filter, &w);
+            }
+            ok = writer_close(&w);
+        }
+        trace_end(span);
         if (!ok) hard_error("Cannot export \"%s\" to \"%s\".\n", input, output);
         
         printf("Exported \"%s\" to \"%s\".\n", input, output);
+        export_filter_report(&story, &filter);
+        
+    } else if (strcmp(command, "index") == 0) {
+        
+        if (arg_count < 3) hard_error("Missing input filename.\n");
+        
+        char* input = args[2];
+        char* index = arg_count > 3 ? args[3] : default_index_path(input);
+        
+        build_search_index(input, index);
+    
+    } else if (strcmp(command, "grep") == 0) {
+        
+        if (arg_count < 3) hard_error("Missing input filename.\n");
+        if (arg_count < 4) hard_error("Missing text to search for.\n");
+        
+        char* input = args[2];
+        char* index = arg_count > 4 ? args[4] : default_index_path(input);
+        
+        run_grep(input, index, c_string_to_string(args[3]));
+    
+    } else if (strcmp(command, "coverage") == 0) {
+        
+        if (arg_count < 3) hard_error("Missing input filename.\n");
         
+        Story story = { .parse_cache = parse_cache };
+        parse_file_to_story(args[2], &story, 0);
+        
+        report_coverage(&story);
+    
+    } else if (strcmp(command, "check") == 0) {
+        
+        if (arg_count < 3) hard_error("Missing input filename.\n");
+        
+        if (story_check(args[2])) exit(1);
+    
+    } else if (strcmp(command, "daemon") == 0) {
+        
+        if (arg_count < 3) hard_error("Missing input filename.\n");
+        if (arg_count < 4) hard_error("Missing socket path for \"%s\".\n", args[2]);
+        
+        Story story = { .parse_cache = parse_cache };
+        parse_file_to_story(args[2], &story, 0);
+        
+        run_daemon(&story, args[3]);
+    
+    } else if (strcmp(command, "query") == 0) {
+        
+        if (arg_count < 3) hard_error("Missing socket path.\n");
+        if (arg_count < 4) hard_error("Missing query, use def, refs or missing.\n");
+        
+        String words[16];
+        u64    count = 0;
+        for (int i = 3; i < arg_count && count < count_of(words); i++) words[count++] = c_string_to_string(args[i]);
+        
+        run_query(args[2], (Array(String)) { words, count });
+    
+    } else if (strcmp(command, "bench-export") == 0) {
+        
+        if (arg_count < 3) hard_error("Missing output directory.\n");
+        
+        char* out_dir = args[2];
+        char* input   = NULL;
+        u64   repeat  = 5;
+        
+        for (int i = 3; i < arg_count; i++) {
+            if (strcmp(args[i], "--repeat") == 0) {
+                if (i + 1 >= arg_count || !parse_u64(c_string_to_string(args[i + 1]), &repeat)) {
+                    hard_error("--repeat needs a number.\n");
+                }
+                i++;
+            } else {
+                input = args[i];
+            }
+        }
+        
+        if (!make_directory(out_dir)) hard_error("Cannot make directory \"%s\".\n", out_dir);
+        
+        // without a story, we make one that is big enough to see the difference
+        if (!input) {
+            
+            u64 size = strlen(out_dir) + 16;
+            input = malloc(size);
+            snprintf(input, size, "%s/bench.story", out_dir);
+            
+            String generated = generate_story((StoryShape) { .scene_count = 20000, .language_count = 3, .option_count = 3, .text_bytes = 120 });
+            if (!save_file(generated, input)) hard_error("Cannot write \"%s\".\n", input);
+            
+            printf("Generated \"%s\", %llu bytes.\n", input, generated.count);
+            free(generated.data);
+        }
+        
+        run_export_benchmark(input, out_dir, repeat);
+    
+    } else if (strcmp(command, "stats") == 0) {
+        
+        if (arg_count < 3) hard_error("Missing input filename.\n");
+        
+        u8 show_table = 0;
+        for (int i = 3; i < arg_count; i++) {
+            if (strcmp(args[i], "--table") == 0) show_table = 1;
+            else                                 hard_error("Unknown option \"%s\" for stats.\n", args[i]);
+        }
+        
+        Story story = { .parse_cache = parse_cache };
+        parse_file_to_story(args[2], &story, 0);
+        
+        HashTable* table = &story.scene_table;
+        
+        u64 scene_count  = 0;
+        u64 option_count = 0;
+        u64 bytes        = 0;
+        for (u64 i = 0; i < table->size; i++) {
+            if (!story_is_defined(&story, i)) continue;
+            scene_count++;
+            option_count += table->values[i].option_count;
+        }
+        for (u64 i = 0; i < story.file_count; i++) bytes += story.files[i].data.count;
+        
+        printf("Scenes:    %llu, with %llu options\n", scene_count, option_count);
+        printf("Languages: %llu\n", story.lang_table.count);
+        printf("Files:     %llu, %llu bytes\n", story.file_count, bytes);
+        
+        if (show_table) {
+            printf("\nScene Table:\n");
+            print_table_stats(table);
+        }
+    
+    } else if (strcmp(command, "bench") == 0) {
+        
+        if (arg_count < 3) hard_error("Missing output directory.\n");
+        
+        char*      out_dir = args[2];
+        u64        repeat  = 11;
+        u64        sizes[16];
+        u64        size_count = 0;
+        StoryShape shape   = { .language_count = 3, .option_count = 3, .text_bytes = 120 };
+        
+        for (int i = 3; i < arg_count; i++) {
+            if (story_shape_eat_arg(&shape, args, arg_count, &i)) continue;
+            if (strcmp(args[i], "--repeat") == 0) {
+                if (i + 1 >= arg_count || !parse_u64(c_string_to_string(args[i + 1]), &repeat)) {
+                    hard_error("--repeat needs a number.\n");
+                }
+                i++;
+            } else if (strcmp(args[i], "--sizes") == 0) {
+                if (i + 1 >= arg_count) hard_error("--sizes needs a list of scene counts, like 1000,10000.\n");
+                String list = c_string_to_string(args[i + 1]);
+                while (list.count) {
+                    if (size_count == count_of(sizes)) hard_error("--sizes can have at most %llu sizes.\n", (u64) count_of(sizes));
+                    if (!parse_u64(string_trim_spaces(string_eat_by_separator(&list, string(","))), &sizes[size_count++])) {
+                        hard_error("--sizes needs a list of scene counts, like 1000,10000.\n");
+                    }
+                }
+                i++;
+            } else {
+                hard_error("Unknown option \"%s\" for bench.\n", args[i]);
+            }
+        }
+        
+        if (!size_count) {
+            sizes[0] = 1000;
+            sizes[1] = 10000;
+            sizes[2] = 100000;
+            size_count = 3;
+        }
+        
+        if (!make_directory(out_dir)) hard_error("Cannot make directory \"%s\".\n", out_dir);
+        
+        run_bench_suite(out_dir, shape, sizes, size_count, repeat);
+    
+    } else if (strcmp(command, "generate") == 0) {
+        
+        if (arg_count < 3) hard_error("Missing output filename.\n");
+        
+        char*      output = args[2];
+        StoryShape shape  = { .scene_count = 1000, .language_count = 2, .option_count = 3, .text_bytes = 120 };
+        
+        for (int i = 3; i < arg_count; i++) {
+            if (!story_shape_eat_arg(&shape, args, arg_count, &i)) hard_error("Unknown option \"%s\" for generate.\n", args[i]);
+        }
+        
+        String generated = generate_story(shape);
+        if (!save_file(generated, output)) hard_error("Cannot write \"%s\".\n", output);
+        
+        printf("Generated \"%s\", %llu bytes.\n", output, generated.count);
+    
     } else {
     
         hard_error("Unknown command \"%s\".\n%s", command, example_string);
@@ -0,0 +1,234 @@
+/* ==== Memory ==== */
+
+/*
+    The big allocations go through memory_alloc() with a tag for what they are for, so --mem-report can tell
+    where the memory goes. Without --mem-report these are plain malloc() and free(), so the tracking costs nothing,
+    with it every block has a header in front with its size and tag.
+
+    note: tracking is turned on in main() before anything is allocated, and never off,
+          otherwise memory_free() would see blocks without a header
+    note: a block from memory_alloc() must be freed with memory_free(), and the other way around
+*/
+
+typedef enum {
+    memory_file,      // files we load whole, and the scenes we keep with a scene cache
+    memory_table,     // the scene table
+    memory_resize,    // the new scene table while the old one is still there, so only the peak means anything
+    memory_parse,     // label spans, scene order and parse cache buffers
+    memory_export,    // writer buffers, scene ids and pruning
+    memory_script,    // compiled conditions and effects
+    memory_lines,     // line indexes of the files
+    memory_check,     // diagnostics of story check
+    memory_layout,    // scenes wrapped for the terminal, see Layout in backend.c
+    memory_tag_count,
+} MemoryTag;
+
+typedef struct {
+    u64 current;
+    u64 peak;
+    u64 blocks;   // live ones
+} MemoryUsage;
+
+typedef struct {
+    u64 size;   // of the table, in slots
+    u64 entry_count;
+    u64 entry_size;
+} MemoryTableInfo;
+
+typedef struct {
+    u8              tracking;
+    Mutex           lock;
+    MemoryUsage     tags[memory_tag_count];
+    MemoryTableInfo table;   // the scene table after the last parse
+} Memory;
+
+Memory memory;
+
+// 16 bytes, so the block after it keeps the alignment of malloc()
+typedef struct {
+    u64 size;
+    u64 tag;
+} MemoryHeader;
+
+void memory_count(MemoryTag tag, s64 size, s64 blocks) {
+
+    mutex_lock(&memory.lock);
+
+    MemoryUsage* it = &memory.tags[tag];
+    it->current += size;
+    it->blocks  += blocks;
+    if (it->current > it->peak) it->peak = it->current;
+
+    mutex_unlock(&memory.lock);
+}
+
+void* memory_alloc(MemoryTag tag, u64 size) {
+
+    if (!memory.tracking) return malloc(size);
+
+    MemoryHeader* header = malloc(sizeof(MemoryHeader) + size);
+    if (!header) return NULL;
+
+    *header = (MemoryHeader) { size, tag };
+    memory_count(tag, size, 1);
+
+    return header + 1;
+}
+
+void* memory_calloc(MemoryTag tag, u64 count, u64 size) {
+
+    if (!memory.tracking) return calloc(count, size);
+    if (size && count > (u64) -1 / size) return NULL;
+
+    void* data = memory_alloc(tag, count * size);
+    if (data) memset(data, 0, count * size);
+    return data;
+}
+
+void memory_free(void* data) {
+
+    if (!memory.tracking) {
+        free(data);
+        return;
+    }
+
+    if (!data) return;
+
+    MemoryHeader* header = (MemoryHeader*) data - 1;
+    memory_count(header->tag, -(s64) header->size, -1);
+    free(header);
+}
+
+void* memory_realloc(MemoryTag tag, void* data, u64 size) {
+
+    if (!memory.tracking) return realloc(data, size);
+    if (!data)            return memory_alloc(tag, size);
+
+    MemoryHeader* header = (MemoryHeader*) data - 1;
+    MemoryHeader  old    = *header;
+
+    header = realloc(header, sizeof(MemoryHeader) + size);
+    if (!header) return NULL;
+
+    header->size = size;
+    memory_count(old.tag, (s64) size - (s64) old.size, 0);
+
+    return header + 1;
+}
+
+// for a block that is for something else now
+void memory_retag(void* data, MemoryTag tag) {
+
+    if (!memory.tracking || !data) return;
+
+    MemoryHeader* header = (MemoryHeader*) data - 1;
+    memory_count(header->tag, -(s64) header->size, -1);
+    memory_count(tag, header->size, 1);
+    header->tag = tag;
+}
+
+void memory_note_table(u64 size, u64 entry_count, u64 entry_size) {
+    if (memory.tracking) memory.table = (MemoryTableInfo) { size, entry_count, entry_size };
+}
+
+
+
+
+/* ---- Arena ---- */
+
+/*
+    For many small things that live until the same point, like the messages of story check:
+    a list of blocks we only bump into, and free all at once.
+    Unlike the temp buffer, this grows, so it's fine for an unknown amount.
+*/
+
+#define arena_block_size (64 * 1024)
+
+typedef struct ArenaBlock {
+    struct ArenaBlock* next;
+    u64                used;
+    u64                size;
+} ArenaBlock;  // the data follows
+
+typedef struct {
+    ArenaBlock* head;   // the one we bump into, the rest are full
+    MemoryTag   tag;
+} Arena;
+
+// 8 byte aligned, NULL if out of memory
+void* arena_alloc(Arena* a, u64 size) {
+
+    size = (size + 7) & ~(u64) 7;
+
+    ArenaBlock* block = a->head;
+    if (!block || block->used + size > block->size) {
+
+        u64 wanted = size > arena_block_size ? size : arena_block_size;
+        block = memory_alloc(a->tag, sizeof(ArenaBlock) + wanted);
+        if (!block) return NULL;
+
+        *block  = (ArenaBlock) { a->head, 0, wanted };
+        a->head = block;
+    }
+
+    void* data = (u8*) (block + 1) + block->used;
+    block->used += size;
+    return data;
+}
+
+void arena_free(Arena* a) {
+    for (ArenaBlock* it = a->head; it;) {
+        ArenaBlock* next = it->next;
+        memory_free(it);
+        it = next;
+    }
+    a->head = NULL;
+}
+
+void memory_print_size(u64 bytes, int width) {
+    if      (bytes >= 1024 * 1024) printf("%*.1f MB", width, bytes / (1024.0 * 1024.0));
+    else if (bytes >= 1024)        printf("%*.1f KB", width, bytes / 1024.0);
+    else                           printf("%*llu B ", width, bytes);
+}
+
+// runs at exit, so every command gets one
+void memory_report() {
+
+    char* names[] = { "file", "scene table", "table resize", "parse", "export", "script", "line index", "check", "layout" };
+
+    fflush(stdout);
+    printf("\nMemory:\n%-14s %13s %13s %8s\n", "", "current", "peak", "blocks");
+
+    for (u64 i = 0; i < memory_tag_count; i++) {
+        MemoryUsage* it = &memory.tags[i];
+        printf("%-14s", names[i]);
+        memory_print_size(it->current, 10);
+        printf(" ");
+        memory_print_size(it->peak, 10);
+        printf(" %8llu\n", it->blocks);
+    }
+
+    ArenaBuffer* a = &context.temp_buffer;
+    printf("%-14s", "temp arena");
+    memory_print_size(a->allocated, 10);
+    printf(" ");
+    memory_print_size(a->highest, 10);
+    printf("    (of %llu KB)\n", a->size / 1024);
+
+    MemoryTableInfo* t = &memory.table;
+    if (t->size) {
+        u64 empty = t->size - t->entry_count;
+        printf(
+            "\nScene table: %llu of %llu slots used (%.1f%%), %llu bytes a slot, empty slots take ",
+            t->entry_count, t->size, 100.0 * t->entry_count / t->size, t->entry_size
+        );
+        memory_print_size(empty * t->entry_size, 0);
+        printf("\n");
+    }
+}
+
+void memory_enable_tracking() {
+    mutex_init(&memory.lock);
+    memory.tracking = 1;
+    atexit(memory_report);
+}
@@ -0,0 +1,550 @@
+/* ==== Platform ==== */
+
+// everything that needs more than the C standard library lives here, this only uses base.c so everything else can use it
+
+#ifdef __linux__
+#include <poll.h>
+#include <unistd.h>
+#include <time.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/inotify.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/time.h>
+#include <sys/ioctl.h>
+#endif
+
+
+
+
+/* ---- File Watcher ---- */
+
+/*
+    note: 
+    we watch the directory instead of the file, 
+    because most editors save by writing a new file and renaming it over the old one
+*/
+
+typedef struct {
+    int    fd;
+    char** names;       // of the files in their directories
+    u64    name_count;
+} FileWatcher;
+
+#ifdef __linux__
+
+u8 file_watcher_add(FileWatcher* w, char* path) {
+    
+    char* slash = strrchr(path, '/');
+    char* name  = slash ? slash + 1 : path;
+    
+    for (u64 i = 0; i < w->name_count; i++) {
+        if (strcmp(w->names[i], name) == 0) return 1;
+    }
+    
+    u64   dir_count = slash ? (u64) (slash - path) : 1;
+    char* dir       = temp_alloc(dir_count + 1);
+    memcpy(dir, slash ? path : ".", dir_count);
+    dir[dir_count] = 0;
+    if (!dir_count) dir = "/";
+
+    // adding the same directory again gives the same watch, so this is fine for files next to each other
+    int watch = inotify_add_watch(w->fd, dir, IN_CLOSE_WRITE | IN_MOVED_TO | IN_CREATE);
+    temp_free(dir_count + 1);
+    if (watch < 0) return 0;
+    
+    u64 count = strlen(name) + 1;
+    w->names = realloc(w->names, (w->name_count + 1) * sizeof(char*));
+    w->names[w->name_count] = malloc(count);
+    memcpy(w->names[w->name_count], name, count);
+    w->name_count++;
+    
+    return 1;
+}
+
+u8 file_watcher_init(FileWatcher* w, char* path) {
+    
+    *w = (FileWatcher) {0};
+    
+    w->fd = inotify_init();
+    if (w->fd < 0) return 0;
+    
+    if (!file_watcher_add(w, path)) {
+        close(w->fd);
+        return 0;
+    }
+    
+    return 1;
+}
+
+// reads the pending events, gives if any of them is about our files
+// note: we only compare names, so a file with the same name in another watched directory also counts
+u8 file_watcher_drain(FileWatcher* w) {
+    
+    u8 changed = 0;
+    
+    char buffer[4096] __attribute__ ((aligned(__alignof__(struct inotify_event))));
+    
+    s64 count = read(w->fd, buffer, sizeof(buffer));
+    for (s64 i = 0; i < count;) {
+        struct inotify_event* event = (struct inotify_event*) (buffer + i);
+        for (u64 j = 0; event->len && j < w->name_count; j++) {
+            if (strcmp(event->name, w->names[j]) == 0) changed = 1;
+        }
+        i += sizeof(struct inotify_event) + event->len;
+    }
+    
+    return changed;
+}
+
+// blocks until fd (0 for stdin) has input (gives 1) or the file changed (gives 0)
+u8 file_watcher_wait(FileWatcher* w, int fd) {
+    
+    while (1) {
+        
+        struct pollfd fds[2] = {
+            { .fd = fd,    .events = POLLIN },
+            { .fd = w->fd, .events = POLLIN },
+        };
+        
+        // a SIGWINCH from terminal_watch_resize() stops poll(), the new width is picked up with the next scene, so we wait again
+        if (poll(fds, 2, -1) < 0) {
+            if (errno == EINTR) continue;
+            hard_error("Cannot wait for input and file changes.\n");
+        }
+        
+        if (fds[1].revents & POLLIN) {
+            
+            if (!file_watcher_drain(w)) continue;
+            
+            // an editor save is usually a few events in a row, wait for them to settle so we reload once
+            struct pollfd settle = { .fd = w->fd, .events = POLLIN };
+            while (poll(&settle, 1, 50) > 0) file_watcher_drain(w);
+            
+            return 0;
+        }
+        
+        if (fds[0].revents) return 1;
+    }
+}
+
+#else
+
+u8 file_watcher_add(FileWatcher* w, char* path) {
+    (void) w;
+    (void) path;
+    return 0;
+}
+
+u8 file_watcher_init(FileWatcher* w, char* path) {
+    (void) path;
+    *w = (FileWatcher) {0};
+    return 0;
+}
+
+u8 file_watcher_wait(FileWatcher* w, int fd) {
+    (void) w;
+    (void) fd;
+    return 1;
+}
+
+#endif
+
+
+
+
+/* ---- Threads ---- */
+
+/*
+    The only thing we do with threads: run f(data, i) for every i in [0, count), 
+    each i is taken by whichever thread is free, and this returns when all of them are done.
+    
+    note: f must not touch anything another i can touch, and must not longjmp (see error_trap)
+*/
+
+typedef void ParallelFunction(void* data, u64 index);
+
+#ifdef __linux__
+
+typedef struct {
+    ParallelFunction* f;
+    void*             data;
+    u64               count;
+    u64               next;
+    pthread_mutex_t   lock;
+} ParallelWork;
+
+void* parallel_worker(void* arg) {
+    
+    ParallelWork* work = arg;
+    
+    while (1) {
+        
+        pthread_mutex_lock(&work->lock);
+        u64 index = work->next++;
+        pthread_mutex_unlock(&work->lock);
+        
+        if (index >= work->count) break;
+        work->f(work->data, index);
+    }
+    
+    return NULL;
+}
+
+void run_parallel(ParallelFunction* f, void* data, u64 count) {
+    
+    ParallelWork work = { .f = f, .data = data, .count = count };
+    pthread_mutex_init(&work.lock, NULL);
+    
+    s64 cpu_count    = sysconf(_SC_NPROCESSORS_ONLN);
+    u64 thread_count = cpu_count > 1 ? (u64) cpu_count : 1;
+    if (thread_count > count) thread_count = count;
+    if (thread_count > 16)    thread_count = 16;
+    
+    // this thread is one of the workers
+    pthread_t threads[16];
+    u64       started = 0;
+    for (u64 i = 1; i < thread_count; i++) {
+        if (pthread_create(&threads[started], NULL, parallel_worker, &work) == 0) started++;
+    }
+    
+    parallel_worker(&work);
+    
+    for (u64 i = 0; i < started; i++) pthread_join(threads[i], NULL);
+    pthread_mutex_destroy(&work.lock);
+}
+
+// for the few things threads share, like the trace
+typedef pthread_mutex_t Mutex;
+
+void mutex_init(Mutex* m)   { pthread_mutex_init(m, NULL); }
+void mutex_lock(Mutex* m)   { pthread_mutex_lock(m); }
+void mutex_unlock(Mutex* m) { pthread_mutex_unlock(m); }
+
+// only good for telling threads apart
+u64 get_thread_id() {
+    return (u64) pthread_self();
+}
+
+// gives 1 if it's there after this
+u8 make_directory(char* path) {
+    struct stat info;
+    if (stat(path, &info) == 0) return S_ISDIR(info.st_mode);
+    return mkdir(path, 0777) == 0;
+}
+
+#else
+
+void run_parallel(ParallelFunction* f, void* data, u64 count) {
+    for (u64 i = 0; i < count; i++) f(data, i);
+}
+
+// there is only one thread here
+typedef u8 Mutex;
+
+void mutex_init(Mutex* m)   { (void) m; }
+void mutex_lock(Mutex* m)   { (void) m; }
+void mutex_unlock(Mutex* m) { (void) m; }
+
+u64 get_thread_id() {
+    return 0;
+}
+
+u8 make_directory(char* path) {
+    (void) path;
+    return 0;
+}
+
+#endif
+
+
+
+
+/* ---- Gather Write ---- */
+
+// writes the segments in order with as few calls as we can, and adds the number of calls to call_count
+// note: the segments can be changed by this (after a short write)
+
+#ifdef __linux__
+
+u8 write_segments(FILE* f, String* segments, u64 count, u64* call_count) {
+    
+    int          fd = fileno(f);
+    struct iovec io[1024]; // IOV_MAX on Linux
+    
+    u64 next = 0;
+    while (next < count) {
+        
+        u64 io_count = 0;
+        while (io_count < count_of(io) && next + io_count < count) {
+            io[io_count].iov_base = segments[next + io_count].data;
+            io[io_count].iov_len  = segments[next + io_count].count;
+            io_count++;
+        }
+        
+        ssize_t written = writev(fd, io, io_count);
+        (*call_count)++;
+        
+        if (written < 0 && errno == EINTR) continue;
+        if (written <= 0)                  return 0;
+        
+        // a short write stops in the middle of a segment
+        while (next < count && (u64) written >= segments[next].count) {
+            written -= segments[next].count;
+            next++;
+        }
+        if (written) {
+            segments[next].data  += written;
+            segments[next].count -= written;
+        }
+    }
+    
+    return 1;
+}
+
+#else
+
+u8 write_segments(FILE* f, String* segments, u64 count, u64* call_count) {
+    for (u64 i = 0; i < count; i++) {
+        if (fwrite(segments[i].data, 1, segments[i].count, f) != segments[i].count) return 0;
+    }
+    *call_count += count;
+    return 1;
+}
+
+#endif
+
+
+
+
+/* ---- Clock and Counters ---- */
+
+#ifdef __linux__
+
+// in seconds, only good for differences
+f64 get_time() {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return (f64) t.tv_sec + (f64) t.tv_nsec / 1e9;
+}
+
+// write-like syscalls of this process so far, from /proc/self/io, 0 if we can't know
+u64 get_write_syscall_count() {
+    
+    FILE* f = fopen("/proc/self/io", "rb");
+    if (!f) return 0;
+    
+    char line[128];
+    u64  count = 0;
+    while (fgets(line, sizeof(line), f)) {
+        if (sscanf(line, "syscw: %llu", &count) == 1) break;
+    }
+    
+    fclose(f);
+    return count;
+}
+
+#else
+
+f64 get_time() {
+    return (f64) clock() / CLOCKS_PER_SEC;
+}
+
+u64 get_write_syscall_count() {
+    return 0;
+}
+
+#endif
+
+
+
+
+/* ---- Stdout Redirect ---- */
+
+#ifdef __linux__
+
+// for timing code that prints, gives what stdout_restore() needs, or -1 if it didn't work
+int stdout_redirect(char* path) {
+    
+    fflush(stdout);
+    
+    int saved = dup(STDOUT_FILENO);
+    int fd    = open(path, O_WRONLY);
+    if (saved < 0 || fd < 0 || dup2(fd, STDOUT_FILENO) < 0) {
+        if (saved >= 0) close(saved);
+        if (fd >= 0)    close(fd);
+        return -1;
+    }
+    
+    close(fd);
+    return saved;
+}
+
+void stdout_restore(int saved) {
+    fflush(stdout);
+    dup2(saved, STDOUT_FILENO);
+    close(saved);
+}
+
+#else
+
+int stdout_redirect(char* path) {
+    (void) path;
+    return -1;
+}
+
+void stdout_restore(int saved) {
+    (void) saved;
+}
+
+#endif
+
+
+
+
+/* ---- Terminal ---- */
+
+// set by SIGWINCH, starts at 1 so the first look at the width always happens, see terminal_watch_resize()
+volatile sig_atomic_t terminal_resized = 1;
+
+#ifdef __linux__
+
+void terminal_on_resize(int signal) {
+    (void) signal;
+    terminal_resized = 1;
+}
+
+// columns of the terminal stdout goes to, 0 if it's not a terminal
+u64 terminal_get_width() {
+    struct winsize size;
+    if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &size) < 0) return 0;
+    return size.ws_col;
+}
+
+// note: SA_RESTART, so a resize while we wait for input doesn't look like the end of stdin
+void terminal_watch_resize() {
+    struct sigaction action = { .sa_handler = terminal_on_resize, .sa_flags = SA_RESTART };
+    sigemptyset(&action.sa_mask);
+    sigaction(SIGWINCH, &action, NULL);
+}
+
+// all of s with one write() when the terminal takes it, a slow console shows it at once instead of line by line
+u8 terminal_write(String s) {
+    
+    fflush(stdout);
+    
+    while (s.count) {
+        ssize_t count = write(STDOUT_FILENO, s.data, s.count);
+        if (count < 0 && errno == EINTR) continue;
+        if (count <= 0)                  return 0;
+        s.data  += count;
+        s.count -= count;
+    }
+    
+    return 1;
+}
+
+#else
+
+u64 terminal_get_width() {
+    return 0;
+}
+
+void terminal_watch_resize() {
+}
+
+u8 terminal_write(String s) {
+    return fwrite(s.data, 1, s.count, stdout) == s.count;
+}
+
+#endif
+
+
+
+
+/* ---- Local Socket ---- */
+
+// one request per connection: the client writes a line, then reads until the server closes it
+
+#ifdef __linux__
+
+int socket_listen(char* path) {
+    
+    struct sockaddr_un address = { .sun_family = AF_UNIX };
+    if (strlen(path) >= sizeof(address.sun_path)) return -1;
+    strcpy(address.sun_path, path);
+    
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) return -1;
+    
+    unlink(path); // from a daemon that didn't clean up
+    
+    if (bind(fd, (struct sockaddr*) &address, sizeof(address)) < 0 || listen(fd, 64) < 0) {
+        close(fd);
+        return -1;
+    }
+    
+    return fd;
+}
+
+int socket_connect(char* path) {
+
+    struct sockaddr_un address = { .sun_family = AF_UNIX };
+    if (strlen(path) >= sizeof(address.sun_path)) return -1;
+    strcpy(address.sun_path, path);
+    
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) return -1;
+
+    if (connect(fd, (struct sockaddr*) &address, sizeof(address)) < 0) {
+        close(fd);
+        return -1;
+    }
+    
+    return fd;
+}
+
+int socket_accept(int fd) {
+    return accept(fd, NULL, NULL);
+}
+
+// a read or a write that waits longer fails instead of blocking, so one client can't hold up a server that serves them in turn
+u8 socket_set_timeout(int fd, u64 ms) {
+    struct timeval t = { .tv_sec = ms / 1000, .tv_usec = (ms % 1000) * 1000 };
+    return setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &t, sizeof(t)) == 0 && setsockopt(fd, SOL_SOCKET, SO_SNDTIMEO, &t, sizeof(t)) == 0;
+}
+
+s64 socket_read(int fd, u8* data, u64 count) {
+    return read(fd, data, count);
+}
+
+// send() instead of write(): a peer that already hung up should fail the write, not raise SIGPIPE and kill the process
+u8 socket_write(int fd, String s) {
+    while (s.count) {
+        s64 count = send(fd, s.data, s.count, MSG_NOSIGNAL);
+        if (count <= 0) return 0;
+        s.data  += count;
+        s.count -= count;
+    }
+    return 1;
+}
+
+void socket_close(int fd) {
+    close(fd);
+}
+
+#else
+
+int socket_listen(char* path)                 { (void) path; return -1; }
+int socket_connect(char* path)                { (void) path; return -1; }
+int socket_accept(int fd)                     { (void) fd;   return -1; }
+u8  socket_set_timeout(int fd, u64 ms)        { (void) fd; (void) ms; return 0; }
+s64 socket_read(int fd, u8* data, u64 count)  { (void) fd; (void) data; (void) count; return -1; }
+u8  socket_write(int fd, String s)            { (void) fd; (void) s; return 0; }
+void socket_close(int fd)                     { (void) fd; }
+
+#endif
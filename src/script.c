@@ -0,0 +1,520 @@
+/* ==== Script ==== */
+
+/*
+    Variables and conditions. The header can have a variable list, ended with a blank line like the language list:
+
+        variables:
+        gold = 10
+        has_key
+
+    and an option can have a condition, so it's only shown when that is true, and effects, which run when it's chosen:
+
+        1. [shop]
+        if: gold >= 3 and not has_key
+        do: gold -= 3, has_key = 1
+        en: buy the key
+
+    Values are s64, 0 is false. Expressions have + - * / %, == != < <= > >=, and or not, and parentheses,
+    and division by 0 gives 0. An effect is a list of "variable = expression" (or += -= *=), split by commas.
+
+    parse_scene() compiles these once into instructions for a small register VM, so showing a scene
+    never looks at the text again, an option without a condition costs nothing, and one with a condition
+    is a short loop over a few instructions. The C exporter emits the same instructions and the same loop.
+
+    A text can show a variable with a placeholder, like "You have {gold} gold.", see the Templates section.
+*/
+
+typedef enum {
+    op_end,      // gives 0
+    op_return,   // gives r[a]
+    op_const,    // r[dst] = value
+    op_load,     // r[dst] = variables[value]
+    op_store,    // variables[value] = r[a]
+    op_add,      // r[dst] = r[a] + r[b], and so on
+    op_sub,
+    op_mul,
+    op_div,
+    op_mod,
+    op_eq,
+    op_ne,
+    op_lt,
+    op_le,
+    op_gt,
+    op_ge,
+    op_and,
+    op_or,
+    op_not,      // r[dst] = !r[a]
+    op_neg,      // r[dst] = -r[a]
+    op_count,
+} Opcode;
+
+// for the C exporter, so the exported code has the same numbers
+char* opcode_names[] = {
+    "op_end", "op_return", "op_const", "op_load", "op_store", "op_add", "op_sub", "op_mul", "op_div", "op_mod",
+    "op_eq", "op_ne", "op_lt", "op_le", "op_gt", "op_ge", "op_and", "op_or", "op_not", "op_neg",
+};
+
+#define script_register_count 16
+#define script_max_code       0xfffe  // offsets in Option are u16 and 1-based
+
+typedef struct {
+    String names[max_variable_count];
+    s64    initial[max_variable_count];
+    u64    count;
+} VariableTable;
+
+u8 variable_table_get_index(VariableTable* t, String name, u64* index_out) {
+    for (u64 i = 0; i < t->count; i++) {
+        if (string_equal(t->names[i], name)) {
+            *index_out = i;
+            return 1;
+        }
+    }
+    return 0;
+}
+
+
+
+
+/* ---- VM ---- */
+
+// note: wraps around instead of overflowing, so no input is undefined behavior
+s64 script_run(Instruction* code, s64* variables) {
+
+    s64 r[script_register_count] = {0};
+
+    for (Instruction* it = code;; it++) {
+
+        s64 a = r[it->a];
+        s64 b = r[it->b];
+
+        switch (it->op) {
+            case op_end:    return 0;
+            case op_return: return a;
+            case op_const:  r[it->dst] = it->value;                              break;
+            case op_load:   r[it->dst] = variables[it->value];                   break;
+            case op_store:  variables[it->value] = a;                            break;
+            case op_add:    r[it->dst] = (s64) ((u64) a + (u64) b);              break;
+            case op_sub:    r[it->dst] = (s64) ((u64) a - (u64) b);              break;
+            case op_mul:    r[it->dst] = (s64) ((u64) a * (u64) b);              break;
+            case op_div:    r[it->dst] = b == 0 ? 0 : b == -1 ? (s64) (0 - (u64) a) : a / b; break;
+            case op_mod:    r[it->dst] = b == 0 || b == -1 ? 0 : a % b;         break;
+            case op_eq:     r[it->dst] = a == b;                                 break;
+            case op_ne:     r[it->dst] = a != b;                                 break;
+            case op_lt:     r[it->dst] = a <  b;                                 break;
+            case op_le:     r[it->dst] = a <= b;                                 break;
+            case op_gt:     r[it->dst] = a >  b;                                 break;
+            case op_ge:     r[it->dst] = a >= b;                                 break;
+            case op_and:    r[it->dst] = a && b;                                 break;
+            case op_or:     r[it->dst] = a || b;                                 break;
+            case op_not:    r[it->dst] = !a;                                     break;
+            case op_neg:    r[it->dst] = (s64) (0 - (u64) a);                    break;
+        }
+    }
+}
+
+// an option is there if it has no condition, or its condition is true
+u8 option_is_available(Scene* scene, Option* option, s64* variables) {
+    return !option->condition || script_run(scene->code + option->condition - 1, variables) != 0;
+}
+
+
+
+
+/* ---- Compiler ---- */
+
+typedef struct {
+    String         in;          // what is left of the expression
+    VariableTable* variables;
+    Instruction*   code;
+    u64            count;
+    u64            allocated;
+    u8             top;         // next free register
+    char*          error;       // NULL until something is wrong, then the rest does nothing
+} ScriptCompiler;
+
+void script_error(ScriptCompiler* c, char* error) {
+    if (!c->error) c->error = error;
+}
+
+void script_emit(ScriptCompiler* c, u8 op, u8 dst, u8 a, u8 b, s32 value) {
+
+    if (c->error) return;
+
+    if (c->count == script_max_code) {
+        script_error(c, "Too many conditions and effects in one scene");
+        return;
+    }
+
+    if (c->count == c->allocated) {
+        u64 wanted = c->allocated ? c->allocated * 2 : 16;
+        Instruction* code = memory_realloc(memory_script, c->code, wanted * sizeof(Instruction));
+        if (!code) {
+            script_error(c, "Out of memory");
+            return;
+        }
+        c->code      = code;
+        c->allocated = wanted;
+    }
+
+    c->code[c->count++] = (Instruction) { op, dst, a, b, value };
+}
+
+u8 script_is_name_start(u8 c) {
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || c == '_';
+}
+
+u8 script_is_name_char(u8 c) {
+    return script_is_name_start(c) || (c >= '0' && c <= '9');
+}
+
+void script_skip_spaces(ScriptCompiler* c) {
+    while (c->in.count && (c->in.data[0] == ' ' || c->in.data[0] == '\t')) c->in = string_advance(c->in, 1);
+}
+
+// a symbol, or a word that is not just the start of a longer name
+u8 script_eat(ScriptCompiler* c, String token) {
+
+    script_skip_spaces(c);
+    if (!string_starts_with(c->in, token)) return 0;
+
+    u8 is_word = script_is_name_start(token.data[0]);
+    if (is_word && c->in.count > token.count && script_is_name_char(c->in.data[token.count])) return 0;
+
+    c->in = string_advance(c->in, token.count);
+    return 1;
+}
+
+String script_eat_name(ScriptCompiler* c) {
+
+    script_skip_spaces(c);
+
+    u64 count = 0;
+    if (c->in.count && script_is_name_start(c->in.data[0])) {
+        while (count < c->in.count && script_is_name_char(c->in.data[count])) count++;
+    }
+
+    String name = { c->in.data, count };
+    c->in = string_advance(c->in, count);
+    return name;
+}
+
+// a name in the variable list, but not a word we use
+u8 script_is_valid_name(String name) {
+
+    if (!name.count || !script_is_name_start(name.data[0])) return 0;
+    for (u64 i = 1; i < name.count; i++) {
+        if (!script_is_name_char(name.data[i])) return 0;
+    }
+
+    return !string_equal(name, string("and")) && !string_equal(name, string("or")) && !string_equal(name, string("not"));
+}
+
+// a number that fits in an instruction
+u8 script_parse_number(String s, s64* out) {
+
+    u8 negative = string_starts_with_u8(s, '-');
+    if (negative) s = string_advance(s, 1);
+
+    u64 value;
+    if (!s.count || !parse_u64(s, &value) || value > 0x7fffffff) return 0;
+
+    *out = negative ? -(s64) value : (s64) value;
+    return 1;
+}
+
+u8 script_or(ScriptCompiler* c);
+
+u8 script_new_register(ScriptCompiler* c) {
+    if (c->top == script_register_count) {
+        script_error(c, "The expression is too deep");
+        return 0;
+    }
+    return c->top++;
+}
+
+u8 script_primary(ScriptCompiler* c) {
+
+    script_skip_spaces(c);
+
+    if (script_eat(c, string("("))) {
+        u8 r = script_or(c);
+        if (!script_eat(c, string(")"))) script_error(c, "Missing \")\"");
+        return r;
+    }
+
+    if (c->in.count && c->in.data[0] >= '0' && c->in.data[0] <= '9') {
+
+        u64 count = 0;
+        while (count < c->in.count && script_is_name_char(c->in.data[count])) count++;
+
+        s64 value = 0;
+        if (!script_parse_number((String) { c->in.data, count }, &value)) script_error(c, "Invalid number, or it is too big");
+        c->in = string_advance(c->in, count);
+
+        u8 r = script_new_register(c);
+        script_emit(c, op_const, r, 0, 0, (s32) value);
+        return r;
+    }
+
+    String name = script_eat_name(c);
+
+    u64 slot = 0;
+    if (!name.count)                                                  script_error(c, "Expected a number, a variable or \"(\"");
+    else if (!variable_table_get_index(c->variables, name, &slot))   script_error(c, "Unknown variable");
+
+    u8 r = script_new_register(c);
+    script_emit(c, op_load, r, 0, 0, (s32) slot);
+    return r;
+}
+
+u8 script_unary(ScriptCompiler* c) {
+
+    if (script_eat(c, string("-"))) {
+        u8 r = script_unary(c);
+        script_emit(c, op_neg, r, r, 0, 0);
+        return r;
+    }
+
+    return script_primary(c);
+}
+
+typedef u8 ScriptLevel(ScriptCompiler* c);
+
+// one level of left associative binary operators, the result is in the register of the left side
+u8 script_binary(ScriptCompiler* c, ScriptLevel* next, String* tokens, u8* ops, u64 count) {
+
+    u8 left = next(c);
+
+    while (!c->error) {
+
+        u64 found = count;
+        for (u64 i = 0; i < count && found == count; i++) {
+            if (script_eat(c, tokens[i])) found = i;
+        }
+        if (found == count) break;
+
+        u8 right = next(c);
+        script_emit(c, ops[found], left, left, right, 0);
+        c->top = left + 1;
+    }
+
+    return left;
+}
+
+u8 script_multiply(ScriptCompiler* c) {
+    String tokens[] = { string("*"), string("/"), string("%") };
+    u8     ops[]    = { op_mul, op_div, op_mod };
+    return script_binary(c, script_unary, tokens, ops, count_of(ops));
+}
+
+u8 script_add(ScriptCompiler* c) {
+    String tokens[] = { string("+"), string("-") };
+    u8     ops[]    = { op_add, op_sub };
+    return script_binary(c, script_multiply, tokens, ops, count_of(ops));
+}
+
+u8 script_compare(ScriptCompiler* c) {
+    // the two character ones first, so "<=" is not "<" and then "="
+    String tokens[] = { string("=="), string("!="), string("<="), string(">="), string("<"), string(">") };
+    u8     ops[]    = { op_eq, op_ne, op_le, op_ge, op_lt, op_gt };
+    return script_binary(c, script_add, tokens, ops, count_of(ops));
+}
+
+u8 script_not(ScriptCompiler* c) {
+
+    if (script_eat(c, string("not"))) {
+        u8 r = script_not(c);
+        script_emit(c, op_not, r, r, 0, 0);
+        return r;
+    }
+
+    return script_compare(c);
+}
+
+u8 script_and(ScriptCompiler* c) {
+    String tokens[] = { string("and") };
+    u8     ops[]    = { op_and };
+    return script_binary(c, script_not, tokens, ops, count_of(ops));
+}
+
+u8 script_or(ScriptCompiler* c) {
+    String tokens[] = { string("or") };
+    u8     ops[]    = { op_or };
+    return script_binary(c, script_and, tokens, ops, count_of(ops));
+}
+
+// gives what goes in Option.condition, 0 with c->error set if it's wrong
+u16 script_compile_condition(ScriptCompiler* c, String source) {
+
+    u64 start = c->count;
+
+    c->in  = source;
+    c->top = 0;
+
+    u8 r = script_or(c);
+
+    script_skip_spaces(c);
+    if (c->in.count) script_error(c, "Unexpected text after the expression");
+
+    script_emit(c, op_return, 0, r, 0, 0);
+    return c->error ? 0 : (u16) (start + 1);
+}
+
+// gives what goes in Option.effect, 0 with c->error set if it's wrong
+u16 script_compile_effect(ScriptCompiler* c, String source) {
+
+    u64 start = c->count;
+
+    c->in = source;
+
+    while (!c->error) {
+
+        c->top = 0;
+
+        String name = script_eat_name(c);
+        u64    slot = 0;
+        if (!name.count || !variable_table_get_index(c->variables, name, &slot)) {
+            script_error(c, name.count ? "Unknown variable" : "Expected a variable to set");
+            break;
+        }
+
+        u8 op = 0;
+        if      (script_eat(c, string("+="))) op = op_add;
+        else if (script_eat(c, string("-="))) op = op_sub;
+        else if (script_eat(c, string("*="))) op = op_mul;
+        else if (!script_eat(c, string("="))) {
+            script_error(c, "Expected \"=\", \"+=\", \"-=\" or \"*=\" after the variable");
+            break;
+        }
+
+        u8 r = 0;
+        if (op) {
+            u8 old = script_new_register(c);
+            script_emit(c, op_load, old, 0, 0, (s32) slot);
+            u8 value = script_or(c);
+            script_emit(c, op, old, old, value, 0);
+            r = old;
+        } else {
+            r = script_or(c);
+        }
+        script_emit(c, op_store, 0, r, 0, (s32) slot);
+
+        if (!script_eat(c, string(","))) break;
+    }
+
+    script_skip_spaces(c);
+    if (c->in.count) script_error(c, "Unexpected text after the effect");
+
+    script_emit(c, op_end, 0, 0, 0, 0);
+    return c->error ? 0 : (u16) (start + 1);
+}
+
+// for code we didn't compile ourselves (the parse cache), so script_run() can't go out of bounds with it
+u8 script_code_is_valid(Instruction* code, u64 count, u64 variable_count) {
+
+    for (u64 i = 0; i < count; i++) {
+
+        Instruction* it = &code[i];
+        if (it->op >= op_count)                                                                              return 0;
+        if (it->dst >= script_register_count || it->a >= script_register_count || it->b >= script_register_count) return 0;
+
+        u8 has_variable = it->op == op_load || it->op == op_store;
+        if (has_variable && (it->value < 0 || (u64) it->value >= variable_count)) return 0;
+    }
+
+    // every run stops at the end
+    return !count || code[count - 1].op == op_end || code[count - 1].op == op_return;
+}
+
+
+
+
+/* ---- Templates ---- */
+
+/*
+    A text with placeholders is split once when the scene is parsed, into segments of the text before
+    each placeholder and the variable that goes there, so printing it is only a walk over the segments,
+    and a text without a placeholder is printed as it is. Braces around anything that is not a variable are just text,
+    so a story without variables never has a template.
+*/
+
+#define template_max_segments 0xfffe  // text_template is u16 and 1-based
+
+void scene_free_script(Scene* scene) {
+    memory_free(scene->code);
+    memory_free(scene->segments);
+    scene->code     = NULL;
+    scene->segments = NULL;
+}
+
+// gives what goes in text_template, 0 if the text has no placeholder (or the scene has too many)
+u16 template_split(VariableTable* vars, Scene* scene, String text, u64* allocated) {
+
+    if (!vars->count || !string_contains_u8(text, '{')) return 0;
+
+    u64 start = scene->segment_count;
+    u8* last  = text.data;
+    u8* end   = text.data + text.count;
+
+    for (u8* at = text.data; at < end; at++) {
+
+        if (*at != '{') continue;
+
+        u8* close = at + 1;
+        while (close < end && script_is_name_char(*close)) close++;
+        if (close == end || *close != '}') continue;
+
+        u64 index;
+        if (!variable_table_get_index(vars, (String) { at + 1, close - at - 1 }, &index)) continue;
+
+        // one more for the last segment
+        if (scene->segment_count + 2 > template_max_segments) break;
+
+        if (scene->segment_count + 2 > *allocated) {
+            u64 wanted = *allocated ? *allocated * 2 : 16;
+            TextSegment* segments = memory_realloc(memory_script, scene->segments, wanted * sizeof(TextSegment));
+            if (!segments) break;
+            scene->segments = segments;
+            *allocated      = wanted;
+        }
+
+        scene->segments[scene->segment_count++] = (TextSegment) { { last, at - last }, (s32) index };
+        last = close + 1;
+        at   = close;
+    }
+
+    if (scene->segment_count == start) return 0;
+
+    scene->segments[scene->segment_count++] = (TextSegment) { { last, end - last }, -1 };
+    return (u16) (start + 1);
+}
+
+// call this after the texts of the scene are set
+void scene_split_templates(VariableTable* vars, Scene* scene) {
+
+    if (!vars->count) return;
+
+    u64 allocated = 0;
+
+    for (u64 i = 0; i < max_language_count; i++) scene->text_template[i] = template_split(vars, scene, scene->text[i], &allocated);
+
+    for (u64 j = 0; j < scene->option_count; j++) {
+        Option* option = &scene->options[j];
+        for (u64 i = 0; i < max_language_count; i++) option->text_template[i] = template_split(vars, scene, option->text[i], &allocated);
+    }
+}
+
+void print_template(Scene* scene, String text, u16 text_template, s64* variables) {
+
+    if (!text_template) {
+        print_string(text);
+        return;
+    }
+
+    for (TextSegment* it = scene->segments + text_template - 1;; it++) {
+        print_string(it->literal);
+        if (it->variable < 0) break;
+        printf("%lld", variables[it->variable]);
+    }
+}
@@ -0,0 +1,745 @@
+/* ==== Search ==== */
+
+/*
+    A trigram index over every text field of a story, so "story grep" only reads the candidates
+    from the story file instead of parsing it. A document is one text field: (scene, language, field),
+    where field 0 is the scene text and field n is the text of option n.
+
+    Index file layout (native little endian structs, in this order):
+
+        SearchHeader
+        SearchScene   [scene_count]
+        SearchDocument[document_count]
+        SearchGram    [gram_count]      sorted by gram
+        postings                        per gram, varint deltas of document ids
+        blob                            each language as u8 count + bytes, each file name as u16 count + bytes, then the labels
+
+    Building again reuses the documents and postings of every scene whose body didn't change,
+    so only the changed scenes are parsed.
+*/
+
+#define search_index_version 2
+
+typedef struct {
+    u8  magic[4];         // "STIX"
+    u32 version;
+    u64 file_size;        // of all the story files when the index was built, to tell if the index is stale
+    u64 scene_count;
+    u64 document_count;
+    u64 gram_count;
+    u64 postings_size;
+    u64 blob_size;
+    u64 language_count;
+    u64 file_count;
+} SearchHeader;
+
+typedef struct {
+    u64 body_hash;
+    u64 body_offset;
+    u64 line;
+    u64 label_offset;     // in blob
+    u64 label_count;
+    u64 first_document;
+    u64 document_count;
+} SearchScene;
+
+typedef struct {
+    u64 offset;           // of the text in its story file
+    u32 count;
+    u32 line;
+    u32 scene;
+    u8  language;
+    u8  field;
+    u16 file;             // index in the file names
+} SearchDocument;
+
+typedef struct {
+    u32 gram;
+    u32 document_count;
+    u64 offset;           // in postings
+} SearchGram;
+
+typedef struct {
+    SearchHeader header;
+    u64          scenes_at;  // file offsets of each section
+    u64          documents_at;
+    u64          grams_at;
+    u64          postings_at;
+    u64          blob_at;
+} SearchLayout;
+
+SearchLayout search_layout(SearchHeader header) {
+    SearchLayout l = { .header = header };
+    l.scenes_at    = sizeof(SearchHeader);
+    l.documents_at = l.scenes_at    + header.scene_count    * sizeof(SearchScene);
+    l.grams_at     = l.documents_at + header.document_count * sizeof(SearchDocument);
+    l.postings_at  = l.grams_at     + header.gram_count     * sizeof(SearchGram);
+    l.blob_at      = l.postings_at  + header.postings_size;
+    return l;
+}
+
+u8 search_header_is_valid(SearchHeader* h) {
+    return memcmp(h->magic, "STIX", 4) == 0 && h->version == search_index_version;
+}
+
+/*
+    An index on disk can be stale, cut short or edited, so every count and offset in it is checked
+    before we use it: the sections of the header must add up to the file size, and what points into a section must stay in it.
+    Building treats a bad index as no index, grep stops with an error.
+*/
+
+// note: goes section by section, so a huge count can't overflow the sum
+u8 search_layout_fits(SearchHeader* h, u64 file_size) {
+    
+    u64 left = file_size;
+    if (left < sizeof(SearchHeader)) return 0;
+    left -= sizeof(SearchHeader);
+    
+    if (h->scene_count    > left / sizeof(SearchScene))    return 0;
+    left -= h->scene_count * sizeof(SearchScene);
+    if (h->document_count > left / sizeof(SearchDocument)) return 0;
+    left -= h->document_count * sizeof(SearchDocument);
+    if (h->gram_count     > left / sizeof(SearchGram))     return 0;
+    left -= h->gram_count * sizeof(SearchGram);
+    if (h->postings_size  > left)                          return 0;
+    left -= h->postings_size;
+    
+    return h->blob_size == left && h->language_count <= max_language_count && h->file_count <= 0xffff;
+}
+
+// labels_size is what's left of the blob after the languages and the file names
+u8 search_scene_is_sound(SearchHeader* h, SearchScene* s, u64 labels_size) {
+    return s->label_offset   <= labels_size       && s->label_count    <= labels_size - s->label_offset &&
+           s->first_document <= h->document_count && s->document_count <= h->document_count - s->first_document;
+}
+
+u8 search_document_is_sound(SearchHeader* h, SearchDocument* d) {
+    return d->scene < h->scene_count && d->language < h->language_count && d->file < h->file_count;
+}
+
+
+
+
+/* ---- Building ---- */
+
+// foo.story -> foo.story.idx
+char* default_index_path(char* story_path) {
+    u64   count = strlen(story_path);
+    char* out   = malloc(count + 5);
+    if (!out) hard_error("Out of memory when building the search index.\n");
+    memcpy(out, story_path, count);
+    memcpy(out + count, ".idx", 5);
+    return out;
+}
+
+typedef struct {
+    u64* data;
+    u64  count;
+    u64  allocated;
+} U64Buffer;
+
+void u64_buffer_push(U64Buffer* b, u64 v) {
+    if (b->count == b->allocated) {
+        b->allocated = b->allocated ? b->allocated * 2 : 4096;
+        b->data      = realloc(b->data, b->allocated * sizeof(u64));
+        if (!b->data) hard_error("Out of memory when building the search index.\n");
+    }
+    b->data[b->count++] = v;
+}
+
+int compare_u64(const void* a, const void* b) {
+    u64 x = *(u64*) a;
+    u64 y = *(u64*) b;
+    return (x > y) - (x < y);
+}
+
+// sorts and removes duplicates, gives the new count
+u64 sort_unique_u64(u64* data, u64 count) {
+
+    if (!count) return 0;
+    qsort(data, count, sizeof(u64), compare_u64);
+
+    u64 acc = 1;
+    for (u64 i = 1; i < count; i++) {
+        if (data[i] != data[acc - 1]) data[acc++] = data[i];
+    }
+
+    return acc;
+}
+
+// the document ids of a gram from its varint deltas, gives 0 if they run out or go past the documents,
+// out can be NULL to only check them
+u8 search_decode_postings(SearchHeader* h, String postings, u64 count, U64Buffer* out) {
+    
+    u64 id = 0;
+    for (u64 i = 0; i < count; i++) {
+        
+        u64 delta;
+        if (!string_eat_varint(&postings, &delta)) return 0;
+        if (delta >= h->document_count - id)       return 0; // id is below the count, so this can't wrap
+        
+        id += delta;
+        if (out) u64_buffer_push(out, id);
+    }
+    
+    return 1;
+}
+
+u32 search_gram(u8* s) {
+    return ((u32) s[0] << 16) | ((u32) s[1] << 8) | (u32) s[2];
+}
+
+// pairs are (gram << 32 | document), so sorting them gives the postings in order
+void search_add_document(Story* story, Scene* scene, String text, U64Buffer* pairs, U64Buffer* documents, SearchDocument document) {
+
+    if (!text.count) return;
+
+    document.offset = text.data - story->files[scene->file].data.data;
+    document.file   = scene->file;
+    document.count  = text.count;
+    document.line   = scene_get_line(story, scene, text);
+
+    u64 id    = documents->count / 3;
+    u64 first = pairs->count;
+
+    for (u64 i = 0; i + 3 <= text.count; i++) {
+        u64_buffer_push(pairs, (u64) search_gram(text.data + i) << 32 | id);
+    }
+
+    // a long text repeats a lot of grams, so we don't keep them until the big sort
+    pairs->count = first + sort_unique_u64(pairs->data + first, pairs->count - first);
+
+    // a document is 24 bytes, stored as 3 u64
+    u64 raw[3];
+    memcpy(raw, &document, sizeof(raw));
+    for (u64 i = 0; i < 3; i++) u64_buffer_push(documents, raw[i]);
+}
+
+void build_search_index(char* story_path, char* index_path) {
+
+    assert(sizeof(SearchDocument) == 3 * sizeof(u64));
+
+    Story story = {0};
+    parse_file_to_story(story_path, &story, 1);
+
+    HashTable* table = &story.scene_table;
+
+
+    /* ---- The old index, if it's there and has the same languages ---- */
+
+    String       old               = load_file(index_path);
+    SearchLayout old_layout        = {0};
+    u64          old_labels_at     = 0;  // in old, after the languages and the file names in blob
+    u64*         old_scene_of_slot = NULL;
+
+    if (old.count >= sizeof(SearchHeader)) {
+
+        SearchHeader header;
+        memcpy(&header, old.data, sizeof(header));
+
+        u8 ok = search_header_is_valid(&header) && header.language_count == story.lang_table.count && search_layout_fits(&header, old.count);
+        if (ok) old_layout = search_layout(header);
+
+        if (ok) {
+            String languages = string_view(old, old_layout.blob_at, old.count);
+            for (u64 i = 0; ok && i < header.language_count; i++) {
+                ok = languages.count && 1 + (u64) languages.data[0] <= languages.count;
+                ok = ok && string_equal(story.lang_table.data[i], string_view(languages, 1, 1 + languages.data[0]));
+                if (ok) languages = string_advance(languages, 1 + languages.data[0]);
+            }
+            for (u64 i = 0; ok && i < header.file_count; i++) {
+                ok = languages.count >= 2 && 2 + (u64) (languages.data[0] | languages.data[1] << 8) <= languages.count;
+                if (ok) languages = string_advance(languages, 2 + (languages.data[0] | languages.data[1] << 8));
+            }
+            old_labels_at = languages.data - old.data;
+        }
+        
+        if (ok) {
+            
+            u64             labels_size = old.count - old_labels_at;
+            SearchScene*    scenes      = (SearchScene*)    (old.data + old_layout.scenes_at);
+            SearchDocument* documents   = (SearchDocument*) (old.data + old_layout.documents_at);
+            SearchGram*     grams       = (SearchGram*)     (old.data + old_layout.grams_at);
+            
+            for (u64 i = 0; ok && i < header.scene_count;    i++) ok = search_scene_is_sound(&header, &scenes[i], labels_size);
+            for (u64 i = 0; ok && i < header.document_count; i++) ok = search_document_is_sound(&header, &documents[i]);
+            for (u64 i = 0; ok && i < header.gram_count;     i++) {
+                ok = grams[i].offset <= header.postings_size;
+                ok = ok && search_decode_postings(&header, string_view(old, old_layout.postings_at + grams[i].offset, old_layout.blob_at), grams[i].document_count, NULL);
+            }
+        }
+
+        if (ok) {
+            old_scene_of_slot = malloc(table->size * sizeof(u64));
+            if (!old_scene_of_slot) hard_error("Out of memory when building the search index.\n");
+            for (u64 i = 0; i < table->size; i++) old_scene_of_slot[i] = -1;
+
+            SearchScene* scenes = (SearchScene*) (old.data + old_layout.scenes_at);
+            for (u64 i = 0; i < header.scene_count; i++) {
+                String label = { old.data + old_labels_at + scenes[i].label_offset, scenes[i].label_count };
+                u64 slot;
+                if (table_get_index(table, label, &slot)) old_scene_of_slot[slot] = i;
+            }
+        } else {
+            old_layout = (SearchLayout) {0};
+        }
+    }
+
+
+    /* ---- Documents and grams ---- */
+
+    U64Buffer pairs     = {0};
+    U64Buffer documents = {0};
+    U64Buffer scenes    = {0};  // SearchScene as 7 u64
+
+    u64* document_map = NULL; // old document id -> new, for the scenes we reuse
+    if (old_layout.header.document_count) {
+        document_map = malloc(old_layout.header.document_count * sizeof(u64));
+        if (!document_map) hard_error("Out of memory when building the search index.\n");
+        for (u64 i = 0; i < old_layout.header.document_count; i++) document_map[i] = -1;
+    }
+
+    u64 language_blob_count = 0;
+    for (u64 i = 0; i < story.lang_table.count; i++) language_blob_count += 1 + story.lang_table.data[i].count;
+    
+    u64 file_blob_count = 0;
+    u64 file_size       = 0;
+    for (u64 i = 0; i < story.file_count; i++) {
+        file_blob_count += 2 + strlen(story.files[i].name);
+        file_size       += story.files[i].data.count;
+    }
+
+    u64 label_blob_count = 0;
+    u64 reused_count     = 0;
+    u64 parsed_count     = 0;
+
+    for (u64 slot = 0; slot < table->size; slot++) {
+
+        HashTableEntry* entry = &table->entries[slot];
+        if (!entry->occupied || !table->values[slot].line) continue;
+
+        Scene*      scene = &table->values[slot];
+        SearchScene s     = {
+            .body_hash      = get_hash_fnv1a_64(scene->source),
+            .body_offset    = scene->offset,
+            .line           = scene->line,
+            .label_offset   = label_blob_count,
+            .label_count    = entry->key.count,
+            .first_document = documents.count / 3,
+        };
+
+        u64 old_index = old_scene_of_slot ? old_scene_of_slot[slot] : (u64) -1;
+        SearchScene* old_scene = old_index != (u64) -1 ? &((SearchScene*) (old.data + old_layout.scenes_at))[old_index] : NULL;
+
+        if (old_scene && old_scene->body_hash == s.body_hash) {
+
+            // same body, so the documents only moved
+            SearchDocument* old_documents = (SearchDocument*) (old.data + old_layout.documents_at);
+            for (u64 i = 0; i < old_scene->document_count; i++) {
+
+                SearchDocument d = old_documents[old_scene->first_document + i];
+                d.offset = d.offset - old_scene->body_offset + s.body_offset;
+                d.line   = d.line   - old_scene->line        + s.line;
+                d.scene  = scenes.count / 7;
+                d.file   = scene->file;
+
+                document_map[old_scene->first_document + i] = documents.count / 3;
+
+                u64 raw[3];
+                memcpy(raw, &d, sizeof(raw));
+                for (u64 j = 0; j < 3; j++) u64_buffer_push(&documents, raw[j]);
+            }
+
+            reused_count++;
+
+        } else {
+
+            story_get_scene(&story, slot);
+
+            SearchDocument d = { .scene = scenes.count / 7 };
+            for (u64 i = 0; i < story.lang_table.count; i++) {
+                d.language = i;
+                d.field    = 0;
+                search_add_document(&story, scene, scene->text[i], &pairs, &documents, d);
+                for (u64 j = 0; j < scene->option_count; j++) {
+                    d.field = j + 1;
+                    search_add_document(&story, scene, scene->options[j].text[i], &pairs, &documents, d);
+                }
+            }
+
+            parsed_count++;
+        }
+
+        s.document_count  = documents.count / 3 - s.first_document;
+        label_blob_count += entry->key.count;
+
+        u64 raw[7];
+        memcpy(raw, &s, sizeof(raw));
+        for (u64 i = 0; i < 7; i++) u64_buffer_push(&scenes, raw[i]);
+    }
+
+    // the grams of the reused documents come from the old postings
+    if (document_map) {
+
+        SearchGram* grams = (SearchGram*) (old.data + old_layout.grams_at);
+        for (u64 i = 0; i < old_layout.header.gram_count; i++) {
+
+            String postings = string_view(old, old_layout.postings_at + grams[i].offset, old_layout.blob_at);
+
+            // checked when we loaded it, so each id is below document_count
+            u64 id = 0;
+            for (u64 j = 0; j < grams[i].document_count; j++) {
+                u64 delta;
+                string_eat_varint(&postings, &delta);
+                id += delta;
+                if (document_map[id] != (u64) -1) u64_buffer_push(&pairs, (u64) grams[i].gram << 32 | document_map[id]);
+            }
+        }
+    }
+
+    pairs.count = sort_unique_u64(pairs.data, pairs.count);
+
+
+    /* ---- Postings ---- */
+
+    U64Buffer grams = {0};    // SearchGram as 2 u64
+    u8*       postings      = malloc(pairs.count * 10 + 1);
+    u64       postings_size = 0;
+    if (!postings) hard_error("Out of memory when building the search index.\n");
+
+    for (u64 i = 0; i < pairs.count;) {
+
+        u32 gram = pairs.data[i] >> 32;
+
+        SearchGram g = { gram, 0, postings_size };
+
+        u64 previous = 0;
+        for (; i < pairs.count && (pairs.data[i] >> 32) == gram; i++) {
+            u64 id = pairs.data[i] & 0xffffffff;
+            put_varint(postings, &postings_size, id - previous);
+            previous = id;
+            g.document_count++;
+        }
+
+        u64 raw[2];
+        memcpy(raw, &g, sizeof(raw));
+        u64_buffer_push(&grams, raw[0]);
+        u64_buffer_push(&grams, raw[1]);
+    }
+
+
+    /* ---- Write ---- */
+
+    FILE* f = fopen(index_path, "wb");
+    if (!f) hard_error("Cannot write \"%s\".\n", index_path);
+
+    SearchHeader header = {
+        .magic          = { 'S', 'T', 'I', 'X' },
+        .version        = search_index_version,
+        .file_size      = file_size,
+        .scene_count    = scenes.count / 7,
+        .document_count = documents.count / 3,
+        .gram_count     = grams.count / 2,
+        .postings_size  = postings_size,
+        .blob_size      = language_blob_count + file_blob_count + label_blob_count,
+        .language_count = story.lang_table.count,
+        .file_count     = story.file_count,
+    };
+
+    fwrite(&header,        sizeof(header), 1,               f);
+    fwrite(scenes.data,    sizeof(u64),    scenes.count,    f);
+    fwrite(documents.data, sizeof(u64),    documents.count, f);
+    fwrite(grams.data,     sizeof(u64),    grams.count,     f);
+    fwrite(postings,       1,              postings_size,   f);
+
+    for (u64 i = 0; i < story.lang_table.count; i++) {
+        String language = story.lang_table.data[i];
+        fputc((u8) language.count, f);
+        file_print_string(f, language);
+    }
+    
+    for (u64 i = 0; i < story.file_count; i++) {
+        String name = c_string_to_string(story.files[i].name);
+        fputc((u8) name.count, f);
+        fputc((u8) (name.count >> 8), f);
+        file_print_string(f, name);
+    }
+
+    for (u64 slot = 0; slot < table->size; slot++) {
+        HashTableEntry* entry = &table->entries[slot];
+        if (entry->occupied && table->values[slot].line) file_print_string(f, entry->key);
+    }
+
+    fclose(f);
+
+    printf(
+        "Indexed \"%s\" to \"%s\": %llu scenes parsed, %llu reused, %llu documents, %llu grams.\n",
+        story_path, index_path, parsed_count, reused_count, header.document_count, header.gram_count
+    );
+
+    free(pairs.data);
+    free(documents.data);
+    free(scenes.data);
+    free(grams.data);
+    free(postings);
+    free(document_map);
+    free(old_scene_of_slot);
+    memory_free(old.data);
+}
+
+
+
+
+/* ---- Searching ---- */
+
+u8 read_at(FILE* f, u64 offset, void* data, u64 count) {
+    if (fseek(f, offset, SEEK_SET) != 0) return 0;
+    return fread(data, 1, count, f) == count;
+}
+
+// binary search on the gram table in the file, so we don't need to load it
+u8 search_find_gram(FILE* f, SearchLayout* l, u32 gram, SearchGram* out) {
+
+    u64 low  = 0;
+    u64 high = l->header.gram_count;
+
+    while (low < high) {
+
+        u64 mid = low + (high - low) / 2;
+
+        SearchGram g;
+        if (!read_at(f, l->grams_at + mid * sizeof(SearchGram), &g, sizeof(g))) return 0;
+
+        if      (g.gram < gram) low  = mid + 1;
+        else if (g.gram > gram) high = mid;
+        else {
+            *out = g;
+            return 1;
+        }
+    }
+
+    return 0;
+}
+
+// gives 0 if the postings are not in the file as the gram says
+u8 search_read_postings(FILE* f, SearchLayout* l, SearchGram g, U64Buffer* out) {
+
+    *out = (U64Buffer) {0};
+    if (g.offset > l->header.postings_size) return 0;
+
+    // the postings of the next gram start after this, but we don't know where, so read the most it can be
+    u64 count = (u64) g.document_count * 10;
+    if (count > l->header.postings_size - g.offset) count = l->header.postings_size - g.offset;
+
+    u8* data = malloc(count + 1);
+    if (!data) hard_error("Out of memory when reading the search index.\n");
+    
+    u8 ok = read_at(f, l->postings_at + g.offset, data, count);
+    ok = ok && search_decode_postings(&l->header, (String) { data, count }, g.document_count, out);
+
+    free(data);
+    return ok;
+}
+
+int compare_gram_by_count(const void* a, const void* b) {
+    u32 x = ((SearchGram*) a)->document_count;
+    u32 y = ((SearchGram*) b)->document_count;
+    return (x > y) - (x < y);
+}
+
+void search_index_broken(char* index_path) {
+    hard_error("\"%s\" is broken, run \"story index\" again.\n", index_path);
+}
+
+void run_grep(char* story_path, char* index_path, String query) {
+
+    if (!query.count) hard_error("The query is empty.\n");
+
+    FILE* f = fopen(index_path, "rb");
+    if (!f) hard_error("Cannot open index \"%s\", run \"story index\" first.\n", index_path);
+
+    SearchHeader header;
+    if (!read_at(f, 0, &header, sizeof(header)) || !search_header_is_valid(&header)) {
+        hard_error("\"%s\" is not a search index.\n", index_path);
+    }
+
+    fseek(f, 0, SEEK_END);
+    long index_size = ftell(f);
+    if (index_size < 0 || !search_layout_fits(&header, index_size)) search_index_broken(index_path);
+
+    SearchLayout l = search_layout(header);
+
+    u8* blob = malloc(header.blob_size + 1);
+    if (!blob)                                          hard_error("Out of memory when reading the search index.\n");
+    if (!read_at(f, l.blob_at, blob, header.blob_size)) search_index_broken(index_path);
+
+    String languages[max_language_count];
+    u64    labels_at = 0;
+    for (u64 i = 0; i < header.language_count; i++) {
+        if (labels_at >= header.blob_size || 1 + (u64) blob[labels_at] > header.blob_size - labels_at) search_index_broken(index_path);
+        languages[i] = (String) { blob + labels_at + 1, blob[labels_at] };
+        labels_at   += 1 + blob[labels_at];
+    }
+    
+    // the file names are relative to where we indexed, like story_path
+    FILE** sources   = calloc(header.file_count + 1, sizeof(FILE*));
+    char** names     = calloc(header.file_count + 1, sizeof(char*));
+    u64*   sizes     = calloc(header.file_count + 1, sizeof(u64));
+    u64    file_size = 0;
+    if (!sources || !names || !sizes) hard_error("Out of memory when reading the search index.\n");
+    
+    for (u64 i = 0; i < header.file_count; i++) {
+        
+        if (header.blob_size - labels_at < 2) search_index_broken(index_path);
+        
+        u64 count = blob[labels_at] | blob[labels_at + 1] << 8;
+        if (2 + count > header.blob_size - labels_at) search_index_broken(index_path);
+        
+        names[i] = malloc(count + 1);
+        if (!names[i]) hard_error("Out of memory when reading the search index.\n");
+        memcpy(names[i], blob + labels_at + 2, count);
+        names[i][count] = 0;
+        labels_at += 2 + count;
+        
+        sources[i] = fopen(names[i], "rb");
+        if (!sources[i]) hard_error("Cannot open file \"%s\".\n", names[i]);
+        
+        fseek(sources[i], 0, SEEK_END);
+        sizes[i]   = ftell(sources[i]);
+        file_size += sizes[i];
+    }
+    
+    if (file_size != header.file_size) {
+        printf("Warning: \"%s\" changed after it was indexed, run \"story index\" again.\n", story_path);
+    }
+
+
+    /* ---- Candidates ---- */
+
+    U64Buffer candidates = {0};
+
+    if (query.count < 3) {
+
+        // no gram to look up, so everything is a candidate
+        for (u64 i = 0; i < header.document_count; i++) u64_buffer_push(&candidates, i);
+
+    } else {
+
+        u64         gram_count = query.count - 2;
+        SearchGram* grams      = malloc(gram_count * sizeof(SearchGram));
+        if (!grams) hard_error("Out of memory when reading the search index.\n");
+
+        for (u64 i = 0; i < gram_count; i++) {
+            if (!search_find_gram(f, &l, search_gram(query.data + i), &grams[i])) {
+                gram_count = 0; // a gram no document has
+                break;
+            }
+        }
+
+        // intersect from the rarest, so the list stays short
+        qsort(grams, gram_count, sizeof(SearchGram), compare_gram_by_count);
+
+        for (u64 i = 0; i < gram_count; i++) {
+
+            if (i && grams[i].gram == grams[i - 1].gram) continue;
+
+            U64Buffer list;
+            if (!search_read_postings(f, &l, grams[i], &list)) search_index_broken(index_path);
+
+            if (!i) {
+                candidates = list;
+                continue;
+            }
+
+            u64 acc = 0;
+            for (u64 a = 0, b = 0; a < candidates.count && b < list.count;) {
+                if      (candidates.data[a] < list.data[b]) a++;
+                else if (candidates.data[a] > list.data[b]) b++;
+                else {
+                    candidates.data[acc++] = candidates.data[a];
+                    a++;
+                    b++;
+                }
+            }
+            candidates.count = acc;
+
+            free(list.data);
+            if (!candidates.count) break;
+        }
+
+        free(grams);
+    }
+
+
+    /* ---- Check the candidates against the story file ---- */
+
+    u64 match_count = 0;
+
+    for (u64 i = 0; i < candidates.count; i++) {
+
+        SearchDocument d;
+        SearchScene    s;
+        
+        u8 ok = read_at(f, l.documents_at + candidates.data[i] * sizeof(SearchDocument), &d, sizeof(d));
+        ok = ok && search_document_is_sound(&header, &d);
+        ok = ok && read_at(f, l.scenes_at + d.scene * sizeof(SearchScene), &s, sizeof(s));
+        ok = ok && search_scene_is_sound(&header, &s, header.blob_size - labels_at);
+        if (!ok) search_index_broken(index_path);
+
+        // the story file can be shorter than when we indexed it, then this document is gone,
+        // and checking against the size first means a broken count can't ask for more memory than the file has
+        if (d.offset > sizes[d.file] || d.count > sizes[d.file] - d.offset) continue;
+        
+        u8* data = malloc((u64) d.count + 1);
+        if (!data) hard_error("Out of memory when reading the story.\n");
+        if (!read_at(sources[d.file], d.offset, data, d.count)) {
+            free(data);
+            continue;
+        }
+
+        String    text  = { data, d.count };
+        String    label = { blob + labels_at + s.label_offset, s.label_count };
+        LineIndex lines = line_index_build(text); // d.line is where the text starts, a match can be lines below it
+
+        for (String rest = text; rest.count;) {
+
+            String found = string_find(rest, query);
+            if (!found.count) break;
+
+            // print the whole line the match is on
+            u8* line_start = found.data;
+            while (line_start > text.data && line_start[-1] != '\n') line_start--;
+
+            String line = { line_start, text.data + text.count - line_start };
+            line = string_eat_line(&line);
+
+            u64 line_number = d.line + line_index_get_line(&lines, found.data - text.data) - 1;
+
+            printf("%s:%llu: ", names[d.file], line_number);
+            print(string("[@] @: @\n"), label, languages[d.language], line);
+            match_count++;
+
+            // one line is printed once, even if it matches more than once
+            u8* line_end = line_start + line.count;
+            if (line_end <= found.data) line_end = found.data + 1;
+            rest = (String) { line_end, text.data + text.count - line_end };
+        }
+
+        line_index_free(&lines);
+        free(data);
+    }
+
+    if (!match_count) printf("No match.\n");
+
+    for (u64 i = 0; i < header.file_count; i++) {
+        fclose(sources[i]);
+        free(names[i]);
+    }
+    
+    free(sources);
+    free(names);
+    free(sizes);
+    free(candidates.data);
+    free(blob);
+    fclose(f);
+}
@@ -0,0 +1,396 @@
+/* ==== Stream ==== */
+
+/*
+    A story from a pipe ("-" as the file name) can't be loaded or seeked first, so it's read in chunks and parsed as it comes:
+    a scene is parsed as soon as the next label line (or the end) shows where it ends, given to the caller, then dropped.
+    What we keep is the header, the labels (see Stream Labels in backend.c), and the scene we are on with its lines,
+    so the memory grows with the number of labels, not with the size of the story.
+    The included files are read the same way, one after the other.
+
+    A link can go to a label that comes later, so links are label ids here instead of slots,
+    and they are checked in stream_finish() when everything is read.
+
+    note: only check, export-graph and export-json work like this, the other commands need the whole story, so they load the pipe first
+*/
+
+#define stream_chunk_size (64 * 1024)
+
+typedef struct {
+    Story*       story;
+    StreamLabels labels;
+    FILE*        input;
+    LineReader   reader;
+    LineIndex*   lines;           // of the file we are reading
+    u64          file;
+    u64          start_id;
+    u64          quit_id;
+
+    u8           has_next;        // we have read a label line, and its scene is next
+    u8           next_redundant;  // it's a label we had, only with story check, then we skip the scene
+    String       next_label;      // in labels.keys
+    u64          next_id;
+    u64          next_line;
+    u64          next_line_offset;
+    u64          next_offset;     // of the body
+
+    u8*          body;            // of the scene we are on, we have nothing else of the input
+    u64          body_count;
+    u64          body_allocated;
+
+    Scene        scene;           // the last one stream_next_scene() gave
+    String       label;
+    u64          id;
+    u64          scene_count;
+} StoryStream;
+
+void stream_append(StoryStream* s, String raw) {
+    if (s->body_count + raw.count > s->body_allocated) {
+        while (s->body_count + raw.count > s->body_allocated) s->body_allocated = s->body_allocated ? s->body_allocated * 2 : 65536;
+        s->body = memory_realloc(memory_file, s->body, s->body_allocated);
+        if (!s->body) hard_error("Out of memory when reading a scene from the pipe.\n");
+    }
+    memcpy(s->body + s->body_count, raw.data, raw.count);
+    s->body_count += raw.count;
+}
+
+// the next line, and raw_out is the same line with the '\n', its start goes in the line index, and it's checked for UTF-8
+u8 stream_read_line(StoryStream* s, String* line_out, String* raw_out) {
+
+    LineReader* r = &s->reader;
+    if (!line_reader_next(r, line_out)) return 0;
+
+    String raw = { line_out->data, r->offset - r->line_offset };
+    line_index_scan(s->lines, raw, r->line_offset);
+
+    u64 invalid = utf8_find_invalid(raw);
+    if (invalid != (u64) -1) utf8_error(s->story, s->file, s->lines, r->line_offset + invalid, string_view(raw, 0, invalid + 1));
+
+    *raw_out = raw;
+    return 1;
+}
+
+// a label line we just read, its scene is the next one
+void stream_label_line(StoryStream* s, String label, u64 line_offset, u64 body_offset) {
+
+    u64          line = line_index_get_line(s->lines, line_offset);
+    String       key;
+    StreamLabel* it   = stream_labels_get(&s->labels, label, &key);
+
+    s->has_next         = 1;
+    s->next_redundant   = it->defined;
+    s->next_label       = key;
+    s->next_id          = it->id;
+    s->next_line        = line;
+    s->next_line_offset = line_offset;
+    s->next_offset      = body_offset;
+
+    if (it->defined) {
+        story_soft_error(s->story, s->file, line, "redundant-label", string("Redundant definition of label [@], "), label);
+        return; // only with story check, the first one stays
+    }
+
+    it->defined = 1;
+}
+
+// reads the header, and gets to the first label
+void stream_open(StoryStream* s, char* file_name, Story* story) {
+
+    TraceSpan span = trace_begin("stream_open");
+
+    *s = (StoryStream) { .story = story, .labels = stream_labels_init() };
+
+    s->input = path_is_stdin(file_name) ? stdin : fopen(file_name, "rb");
+    if (!s->input) hard_error("Cannot open file \"%s\".\n", file_name);
+
+    s->reader = line_reader_from_file(s->input, stream_chunk_size);
+
+    // only for the quit label, see parse_header(), the scenes are not in it
+    story->scene_table = table_init(16, 0.7, memory_table);
+    story->stream      = &s->labels;
+
+    // the header ends at the first label line, but we only know it's there after we read it, so we keep all of it,
+    // then it's the same as a header in memory, and the first label is its last line
+    StoryFile main_file = { .name = file_name, .lines = line_index_build((String) {0}) };
+    s->lines = &main_file.lines;
+
+    String line;
+    String raw;
+    String label;
+    u8     has_label = 0;
+    while (stream_read_line(s, &line, &raw)) {
+        stream_append(s, raw);
+        if (line_get_label(line, &label)) {
+            has_label = 1;
+            break;
+        }
+    }
+
+    main_file.data = (String) { s->body, s->body_count };
+    s->body           = NULL;
+    s->body_count     = 0;
+    s->body_allocated = 0;
+
+    LineReader header = line_reader_from_string(main_file.data);
+    parse_header(story, &main_file, &header);
+    s->lines = &story->files[0].lines;
+
+    s->start_id = stream_labels_get(&s->labels, story->start_label, NULL)->id;
+    s->quit_id  = stream_labels_get(&s->labels, story->quit_label,  NULL)->id;
+
+    // label is in the header we kept
+    if (has_label) stream_label_line(s, label, s->reader.line_offset, s->reader.offset);
+
+    trace_end(span);
+}
+
+// moves to the next included file, up to its first label, gives 0 if there are none left
+u8 stream_next_file(StoryStream* s) {
+
+    Story* story = s->story;
+
+    while (!s->has_next && s->file + 1 < story->file_count) {
+
+        if (s->input != stdin) fclose(s->input);
+        free(s->reader.data);
+
+        s->file++;
+        StoryFile* it = &story->files[s->file];
+
+        s->input = fopen(it->name, "rb");
+        if (!s->input) hard_error("Cannot open file \"%s\".\n", it->name);
+
+        it->lines = line_index_build((String) {0});
+        s->lines  = &it->lines;
+        s->reader = line_reader_from_file(s->input, stream_chunk_size);
+
+        String line;
+        String raw;
+        String label;
+        while (stream_read_line(s, &line, &raw)) {
+            if (line_get_label(line, &label)) {
+                stream_label_line(s, label, s->reader.line_offset, s->reader.offset);
+                break;
+            }
+            check_before_first_label(story, s->file, &s->reader, line);
+        }
+    }
+
+    return s->has_next;
+}
+
+// under story check, an error in a scene only stops that scene, like in check_scene()
+u8 stream_parse_scene(Story* story, Scene* scene) {
+
+    if (!diagnostics) {
+        parse_scene(story, scene);
+        return 1;
+    }
+
+    jmp_buf* outer = error_trap;
+    jmp_buf  trap;
+    error_trap = &trap;
+
+    u8 ok = !setjmp(trap);
+    if (ok) parse_scene(story, scene);
+
+    error_trap = outer;
+    return ok;
+}
+
+// the next scene in s->scene, s->label and s->id, it stays until the next call, gives 0 at the end
+u8 stream_next_scene(StoryStream* s) {
+
+    Story* story = s->story;
+
+    while (1) {
+
+        scene_free_script(&s->scene);
+        s->scene = (Scene) {0};
+
+        if (!s->has_next && !stream_next_file(s)) return 0;
+
+        u8     redundant = s->next_redundant;
+        String label     = s->next_label;
+        u64    id        = s->next_id;
+        u64    line      = s->next_line;
+        u64    offset    = s->next_offset;
+
+        s->has_next   = 0;
+        s->body_count = 0;
+        line_index_drop(s->lines, s->next_line_offset);
+
+        // the body goes up to the next label line
+        String text;
+        String raw;
+        String next;
+        while (stream_read_line(s, &text, &raw)) {
+            if (line_get_label(text, &next)) {
+                stream_label_line(s, next, s->reader.line_offset, s->reader.offset);
+                break;
+            }
+            stream_append(s, raw);
+        }
+
+        if (redundant) continue;
+
+        s->scene = (Scene) {
+            .source = { s->body, s->body_count },
+            .file   = s->file,
+            .offset = offset,
+            .line   = line,
+        };
+
+        s->labels.scene_label = label;
+        if (diagnostics) diagnostics->label = label;
+
+        u8 ok = stream_parse_scene(story, &s->scene);
+
+        if (diagnostics) diagnostics->label = (String) {0};
+        if (!ok) continue;
+
+        s->label = label;
+        s->id    = id;
+        s->scene_count++;
+        return 1;
+    }
+}
+
+int compare_stream_link(const void* a, const void* b) {
+    StreamLabel* x = &(*(StreamLabelEntry**) a)->value;
+    StreamLabel* y = &(*(StreamLabelEntry**) b)->value;
+    if (x->file != y->file) return (x->file > y->file) - (x->file < y->file);
+    return (x->line > y->line) - (x->line < y->line);
+}
+
+// what parse_file_to_story() checks before parsing, which we can only check at the end here
+void stream_finish(StoryStream* s) {
+
+    Story* story = s->story;
+
+    if (!stream_labels_get(&s->labels, story->start_label, NULL)->defined) start_label_error(story);
+
+    // the links to labels that never came, at the first link to each, in file order, so without story check we give the first one
+    HashMap(String, StreamLabel)* map = &s->labels.map;
+
+    StreamLabelEntry** missing = memory_alloc(memory_parse, (map->entry_count + 1) * sizeof(StreamLabelEntry*));
+    u64                count   = 0;
+
+    for (u64 i = 0; i < map->size; i++) {
+        StreamLabelEntry* entry = &map->entries[i];
+        if (!entry->occupied || entry->value.defined || !entry->value.line || entry->value.id == s->quit_id) continue;
+        missing[count++] = entry;
+    }
+
+    if (count) qsort(missing, count, sizeof(StreamLabelEntry*), compare_stream_link);
+
+    for (u64 i = 0; i < count; i++) {
+        StreamLabel* it = &missing[i]->value;
+        if (diagnostics) diagnostics->label = it->from;
+        story_soft_error(story, it->file, it->line, "missing-link", string("Cannot find option label [@] in the whole file, "), missing[i]->key);
+    }
+    if (diagnostics) diagnostics->label = (String) {0};
+
+    memory_free(missing);
+}
+
+void stream_free(StoryStream* s) {
+
+    scene_free_script(&s->scene);
+    memory_free(s->body);
+    free(s->reader.data);
+    if (s->input && s->input != stdin) fclose(s->input);
+    stream_labels_free(&s->labels);
+
+    if (s->story) s->story->stream = NULL;
+}
+
+
+
+
+/* ---- Export ---- */
+
+// --reachable-only needs every link before it can drop anything, so with it we load the pipe first
+u8 stream_can_export(char** args, int arg_count) {
+    for (int i = 0; i < arg_count; i++) {
+        if (strcmp(args[i], "--reachable-only") == 0) return 0;
+    }
+    return 1;
+}
+
+// everything that can hit an error, so stream_export() has nothing a longjmp can clobber (same as check_scene())
+void stream_write_export(Writer* w, StoryStream* s, Story* story, ExportFilter* filter, u8 json) {
+
+    if (json) {
+        writer_json_header(w, story, filter, s->start_id, s->quit_id);
+        writer_json_scene(w, story, filter, NULL, s->quit_id, story->quit_label, NULL);
+    } else {
+        writer_view(w, string("digraph {\n"));
+        writer_view(w, string("    node [fontname=\"sans-serif\", shape=\"box\"];\n"));
+    }
+
+    while (stream_next_scene(s)) {
+
+        Scene* scene = &s->scene;
+
+        if (json) {
+            if (s->id == s->quit_id) continue;
+            writer_view(w, string(",\n"));
+            writer_json_scene(w, story, filter, NULL, s->id, s->label, scene);
+        } else {
+            for (u64 i = 0; i < scene->option_count; i++) {
+                writer_print(w, string("    \"@\" -> \"@\";\n"), s->label, scene->options[i].link);
+            }
+        }
+    }
+
+    stream_finish(s);
+
+    if (json) writer_view(w, string("\n    ]\n}\n"));
+    else      writer_view(w, string("}\n"));
+}
+
+/*
+    export-graph and export-json from a pipe, the output is written as the scenes come in.
+    It's the same as export_story_to_graphviz_dot_file() and export_story_to_json(), except for the order (see the JSON section in export.c).
+    The writer is writer_stdio, since a view into a scene is gone after the next one.
+
+    note: an error, even at the end, takes the output file out, so a half written one doesn't look like a result
+*/
+void stream_export(char* input, char* output, u8 json, char** args, int arg_count) {
+
+    TraceSpan span = trace_begin(json ? "export_json" : "export_graph");
+
+    Story       story = {0};
+    StoryStream s;
+
+    stream_open(&s, input, &story);
+
+    ExportFilter filter = export_filter_from_args(&story, args, arg_count);
+
+    Writer w;
+    if (!writer_open(&w, output, writer_stdio)) hard_error("Cannot export \"%s\" to \"%s\".\n", input, output);
+
+    jmp_buf trap;
+    error_trap = &trap;
+
+    u8 ok = !setjmp(trap);
+    if (ok) stream_write_export(&w, &s, &story, &filter, json);
+
+    error_trap = NULL;
+
+    if (!ok) {
+        writer_close(&w);
+        remove(output);
+        exit(1);
+    }
+
+    if (!writer_close(&w)) hard_error("Cannot export \"%s\" to \"%s\".\n", input, output);
+
+    trace_end(span);
+
+    printf("Exported \"%s\" to \"%s\".\n", input, output);
+    export_filter_report(&story, &filter);
+
+    stream_free(&s);
+    story_free(&story);
+}
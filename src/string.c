@@ -347,6 +347,42 @@ u8 parse_u64(String s, u64* out) {
 
 
 
+// LEB128, at most 10 bytes
+void put_varint(u8* out, u64* acc, u64 v) {
+    while (v >= 0x80) {
+        out[(*acc)++] = (u8) (v | 0x80);
+        v >>= 7;
+    }
+    out[(*acc)++] = (u8) v;
+}
+
+u8 string_eat_varint(String* s, u64* out) {
+    
+    *out = 0;
+    
+    for (u64 shift = 0; shift < 64; shift += 7) {
+        if (!s->count) return 0;
+        u8 c = s->data[0];
+        *s = string_advance(*s, 1);
+        *out |= (u64) (c & 0x7f) << shift;
+        if (!(c & 0x80)) return 1;
+    }
+    
+    return 0;
+}
+
+// zigzag, so small negative numbers are short varints too
+void put_varint_signed(u8* out, u64* acc, s64 v) {
+    put_varint(out, acc, ((u64) v << 1) ^ (u64) (v >> 63));
+}
+
+u8 string_eat_varint_signed(String* s, s64* out) {
+    u64 v;
+    if (!string_eat_varint(s, &v)) return 0;
+    *out = (s64) ((v >> 1) ^ (0 - (v & 1)));
+    return 1;
+}
+
 
 
 
@@ -516,10 +552,7 @@ void print_string(String s) {
 }
 
 // todo: not robust, need more testing, handle adjacent items (no space in between)
-void print(String s, ...) {
-    
-    va_list args;
-    va_start(args, s);
+void print_va(String s, va_list args) {
     
     for (u64 i = 0; i < s.count; i++) {
 
@@ -536,10 +569,36 @@ void print(String s, ...) {
 
         putchar(c);
     }
-    
+}
+
+void print(String s, ...) {
+    va_list args;
+    va_start(args, s);
+    print_va(s, args);
     va_end(args);
 }
 
+// same as print(), into out, gives the count it needs, which can be more than capacity (like snprintf())
+u64 format_va(u8* out, u64 capacity, String s, va_list args) {
+    
+    u64 count = 0;
+    for (u64 i = 0; i < s.count; i++) {
+
+        u8 c = s.data[i];
+        if (c == '@' && !(i + 1 < s.count && s.data[i + 1] == '@')) {
+            String it = va_arg(args, String);
+            for (u64 j = 0; j < it.count; j++, count++) if (count < capacity) out[count] = it.data[j];
+            continue;
+        }
+        
+        if (c == '@') i++;
+        if (count < capacity) out[count] = c;
+        count++;
+    }
+    
+    return count;
+}
+
 
 void file_print_string(FILE* f, String s) {
     fwrite(s.data, sizeof(u8), s.count, f);
@@ -604,7 +663,7 @@ String read_line() {
     
     String s = context.input_buffer;
 
-    fgets((char*) s.data, s.count, stdin);
+    if (!fgets((char*) s.data, s.count, stdin)) return (String) {0};
     s.count = strlen((const char*) s.data);
     
     if (s.count == 0) return (String) {0};
@@ -619,25 +678,67 @@ String read_line() {
 
 /* ==== File IO ==== */
 
-// todo: do we really need to switch allocator?
+// "-" as a file name is stdin, like in most command line tools
+u8 path_is_stdin(char* path) {
+    return strcmp(path, "-") == 0;
+}
+
+// for a pipe, which has no size we can get first, so we read it in chunks until it ends
+// note: free it with memory_free()
+String load_stream(FILE* f) {
+    
+    TraceSpan span = trace_begin("load_stream");
+    
+    String out       = {0};
+    u64    allocated = 0;
+    while (1) {
+        
+        if (out.count == allocated) {
+            u64 wanted = allocated ? allocated * 2 : 65536;
+            u8* data   = memory_realloc(memory_file, out.data, wanted);
+            if (!data) {
+                memory_free(out.data);
+                out = (String) {0};
+                break;
+            }
+            out.data  = data;
+            allocated = wanted;
+        }
+        
+        u64 count = fread(out.data + out.count, 1, allocated - out.count, f);
+        if (!count) break;
+        out.count += count;
+    }
+    
+    trace_end(span);
+    return out;
+}
+
+// note: free it with memory_free()
 String load_file(char* path) {
 
+    if (path_is_stdin(path)) return load_stream(stdin);
+
     FILE* f = fopen(path, "rb");
     if (!f) return (String) {0}; // todo: this is not enough, what if we have a file of size 0? 
 
+    TraceSpan span = trace_begin("load_file");
+
     fseek(f, 0, SEEK_END);
     u64 count = ftell(f);
     fseek(f, 0, SEEK_SET);
 
-    u8* data = context.alloc(count);
+    u8* data = memory_alloc(memory_file, count);
     if (!data) {
         fclose(f);
+        trace_end(span);
         return (String) {0}; 
     }
     
     fread(data, 1, count, f);
     fclose(f);
 
+    trace_end(span);
     return (String) {data, count};
 }
 
@@ -654,3 +755,485 @@ u8 save_file(String in, char* path) {
 }
 
 
+
+
+
+
+/* ==== Line Reader ==== */
+
+/*
+    Gives lines one by one, either from a String in memory or from a FILE* in fixed-size chunks,
+    so the same parsing code can work on a loaded file and on a file we don't want to keep in memory.
+    
+    note: with a FILE*, the line is only valid until the next call, copy it if you need it
+    note: like string_eat_line(), the '\n' and a '\r' before it are not included
+*/
+
+typedef struct {
+    FILE* file;         // NULL if we read from memory
+    u8*   data;         // the whole input, or the chunk buffer
+    u64   size;         // allocated size of the chunk buffer
+    u64   start;        // unread bytes are data[start..end]
+    u64   end;
+    u64   offset;       // offset of data[start] in the input
+    u64   line_offset;  // offset of the last line, see the Line Index section for its line number
+} LineReader;
+
+LineReader line_reader_from_string(String s) {
+    return (LineReader) { .data = s.data, .end = s.count };
+}
+
+LineReader line_reader_from_file(FILE* f, u64 chunk_size) {
+    LineReader r = { .file = f, .data = malloc(chunk_size), .size = chunk_size };
+    if (!r.data) hard_error("Out of memory when reading a file.\n");
+    return r;
+}
+
+u8 line_reader_next(LineReader* r, String* line_out) {
+    
+    u8* found = NULL;
+    
+    while (1) {
+        
+        found = r->start < r->end ? memchr(r->data + r->start, '\n', r->end - r->start) : NULL;
+        if (found || !r->file) break;
+
+        // move what we have to the front, grow if a single line doesn't fit, then refill
+        u64 pending = r->end - r->start;
+        memmove(r->data, r->data + r->start, pending);
+        r->start = 0;
+        r->end   = pending;
+        
+        if (r->end == r->size) {
+            u8* data = realloc(r->data, r->size * 2);
+            if (!data) hard_error("Out of memory when reading a line longer than %llu bytes.\n", r->size);
+            r->data  = data;
+            r->size *= 2;
+        }
+        
+        u64 count = fread(r->data + r->end, 1, r->size - r->end, r->file);
+        if (!count) break;
+        r->end += count;
+    }
+
+    if (r->start == r->end) return 0;
+    
+    u64 count   = found ? (u64) (found - (r->data + r->start)) : r->end - r->start;
+    u64 to_skip = found ? count + 1 : count;
+    
+    String line = { r->data + r->start, count };
+    if (string_ends_with_u8(line, '\r')) line.count--;
+    
+    r->line_offset = r->offset;
+    r->start      += to_skip;
+    r->offset     += to_skip;
+
+    *line_out = line;
+    return 1;
+}
+
+// continues from offset in the input
+void line_reader_seek(LineReader* r, u64 offset) {
+    if (r->file) {
+        fseek(r->file, offset, SEEK_SET);
+        r->end = 0;
+    }
+    r->start  = r->file ? 0 : offset;
+    r->offset = offset;
+}
+
+// gives a String that outlives the next line_reader_next()
+String line_reader_keep(LineReader* r, String s) {
+    return r->file ? string_copy(s) : s;
+}
+
+
+
+
+/* ==== UTF-8 ==== */
+
+/*
+    Every story file is checked once when it's loaded, so a bad byte gets an error with a line and a column
+    instead of going into the exported twee, DOT, or C identifiers.
+
+    The fast path is the lookup algorithm of Keiser and Lemire ("Validating UTF-8 In Less Than One Instruction Per Byte"):
+    almost every error is a pattern in the high nibble of a byte, its low nibble and the high nibble of the byte after it,
+    so three table lookups of 16 bytes (pshufb) and two ANDs find them. What that misses is a 3 or 4 byte character
+    without enough continuation bytes, which shows up as a lead 2 or 3 bytes back.
+    A block that is all ASCII skips all of this. The SIMD pass only tells which block is bad, the scalar one finds the byte.
+
+    pshufb is SSSE3, which a default x86-64 build doesn't assume, so that function is built for it and picked at runtime.
+*/
+
+// how many bytes the character with this lead has, counting the lead, 1 for a byte that can't be a lead
+u64 utf8_sequence_count(u8 c) {
+    if (c >= 0xf0) return 4;
+    if (c >= 0xe0) return 3;
+    if (c >= 0xc0) return 2;
+    return 1;
+}
+
+// the offset of the first byte at or after start that is not part of valid UTF-8, or (u64) -1,
+// start has to be at the start of a character
+u64 utf8_find_invalid_scalar(String s, u64 start) {
+
+    u8* p = s.data;
+    u64 n = s.count;
+    u64 i = start;
+    
+    while (i < n) {
+        
+        // 8 bytes of ASCII at a time
+        if (i + 8 <= n) {
+            u64 word;
+            memcpy(&word, p + i, 8);
+            if (!(word & 0x8080808080808080ull)) { i += 8; continue; }
+        }
+        
+        u8 c = p[i];
+        if (c < 0x80) { i++; continue; }
+        
+        // the range of the second byte depends on the lead, to rule out overlong forms, surrogates, and > U+10FFFF
+        u8 low  = 0x80;
+        u8 high = 0xbf;
+        u64 count;
+        if      (c < 0xc2)  return i;   // a continuation byte, or an overlong 2 byte form
+        else if (c < 0xe0)  count = 2;
+        else if (c < 0xf0) {count = 3; if (c == 0xe0) low = 0xa0; if (c == 0xed) high = 0x9f;}
+        else if (c < 0xf5) {count = 4; if (c == 0xf0) low = 0x90; if (c == 0xf4) high = 0x8f;}
+        else                return i;
+        
+        if (i + count > n || p[i + 1] < low || p[i + 1] > high) return i;
+        for (u64 k = 2; k < count; k++) {
+            if ((p[i + k] & 0xc0) != 0x80) return i;
+        }
+        
+        i += count;
+    }
+    
+    return (u64) -1;
+}
+
+#if defined(__GNUC__) && defined(__x86_64__)
+
+// the offset of the first block that has an error, or where the blocks end, the caller goes on from there with the scalar code
+__attribute__ ((target("ssse3")))
+u64 utf8_skip_valid_ssse3(String s) {
+    
+    // the bits are the errors, a byte pair has an error if the three lookups agree on a bit
+    #define too_short      0x01  // 11______ 0_______, or 11______ 11______
+    #define too_long       0x02  // 0_______ 10______
+    #define overlong_3     0x04  // 11100000 100_____
+    #define too_large      0x08  // 11110100 1001____ and up
+    #define surrogate      0x10  // 11101101 101_____
+    #define overlong_2     0x20  // 1100000_ 10______
+    #define too_large_1000 0x40  // 11110101 1000____ and up
+    #define overlong_4     0x40  // 11110000 1000____
+    #define two_conts      0x80  // 10______ 10______
+    #define carry          (too_short | too_long | two_conts)
+    
+    static const u8 byte_1_high_table[16] = {
+        too_long, too_long, too_long, too_long, too_long, too_long, too_long, too_long,
+        two_conts, two_conts, two_conts, two_conts,
+        too_short | overlong_2,
+        too_short,
+        too_short | overlong_3 | surrogate,
+        too_short | too_large | too_large_1000 | overlong_4
+    };
+    
+    static const u8 byte_1_low_table[16] = {
+        carry | overlong_3 | overlong_2 | overlong_4,
+        carry | overlong_2,
+        carry,
+        carry,
+        carry | too_large,
+        carry | too_large | too_large_1000,
+        carry | too_large | too_large_1000,
+        carry | too_large | too_large_1000,
+        carry | too_large | too_large_1000,
+        carry | too_large | too_large_1000,
+        carry | too_large | too_large_1000,
+        carry | too_large | too_large_1000,
+        carry | too_large | too_large_1000,
+        carry | too_large | too_large_1000 | surrogate,
+        carry | too_large | too_large_1000,
+        carry | too_large | too_large_1000
+    };
+    
+    static const u8 byte_2_high_table[16] = {
+        too_short, too_short, too_short, too_short, too_short, too_short, too_short, too_short,
+        too_long | overlong_2 | two_conts | overlong_3 | too_large_1000 | overlong_4,
+        too_long | overlong_2 | two_conts | overlong_3 | too_large,
+        too_long | overlong_2 | two_conts | surrogate  | too_large,
+        too_long | overlong_2 | two_conts | surrogate  | too_large,
+        too_short, too_short, too_short, too_short
+    };
+    
+    #undef too_short
+    #undef too_long
+    #undef overlong_3
+    #undef too_large
+    #undef surrogate
+    #undef overlong_2
+    #undef too_large_1000
+    #undef overlong_4
+    #undef two_conts
+    #undef carry
+    
+    // a block that ends with a lead of a character that doesn't fit in it, needs more bytes after it
+    static const u8 incomplete_table[16] = { 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 255, 0xf0 - 1, 0xe0 - 1, 0xc0 - 1 };
+    
+    const __m128i byte_1_high      = _mm_loadu_si128((const __m128i*) byte_1_high_table);
+    const __m128i byte_1_low       = _mm_loadu_si128((const __m128i*) byte_1_low_table);
+    const __m128i byte_2_high      = _mm_loadu_si128((const __m128i*) byte_2_high_table);
+    const __m128i incomplete_limit = _mm_loadu_si128((const __m128i*) incomplete_table);
+    const __m128i nibble           = _mm_set1_epi8(0x0f);
+    const __m128i zero             = _mm_setzero_si128();
+    
+    __m128i previous   = zero;
+    __m128i incomplete = zero;
+    
+    u64 i = 0;
+    for (; i + 16 <= s.count; i += 16) {
+        
+        __m128i input = _mm_loadu_si128((__m128i*) (s.data + i));
+        __m128i error;
+        
+        if (!_mm_movemask_epi8(input)) {
+            error      = incomplete;
+            incomplete = zero;
+        } else {
+            
+            __m128i previous_1 = _mm_alignr_epi8(input, previous, 15);
+            __m128i previous_2 = _mm_alignr_epi8(input, previous, 14);
+            __m128i previous_3 = _mm_alignr_epi8(input, previous, 13);
+            
+            __m128i special = _mm_and_si128(
+                _mm_and_si128(
+                    _mm_shuffle_epi8(byte_1_high, _mm_and_si128(_mm_srli_epi16(previous_1, 4), nibble)),
+                    _mm_shuffle_epi8(byte_1_low,  _mm_and_si128(previous_1, nibble))
+                ),
+                _mm_shuffle_epi8(byte_2_high, _mm_and_si128(_mm_srli_epi16(input, 4), nibble))
+            );
+            
+            // where the byte has to be the 2nd or 3rd continuation of a 3 or 4 byte character, only the top bit is left set
+            __m128i third_byte  = _mm_subs_epu8(previous_2, _mm_set1_epi8((char) (0xe0 - 0x80)));
+            __m128i fourth_byte = _mm_subs_epu8(previous_3, _mm_set1_epi8((char) (0xf0 - 0x80)));
+            __m128i must_be_23  = _mm_and_si128(_mm_or_si128(third_byte, fourth_byte), _mm_set1_epi8((char) 0x80));
+            
+            error      = _mm_xor_si128(must_be_23, special);
+            incomplete = _mm_subs_epu8(input, incomplete_limit);
+        }
+        
+        if (_mm_movemask_epi8(_mm_cmpeq_epi8(error, zero)) != 0xffff) break;
+        previous = input;
+    }
+    
+    return i;
+}
+
+#endif
+
+// the offset of the first byte that is not part of valid UTF-8, or (u64) -1
+u64 utf8_find_invalid(String s) {
+    
+    u64 start = 0;
+
+#if defined(__GNUC__) && defined(__x86_64__)
+    if (__builtin_cpu_supports("ssse3")) {
+        // the blocks before end are valid, except that the last character may be cut, so we go back to where it starts
+        u64 end = utf8_skip_valid_ssse3(s);
+        start = end > 3 ? end - 3 : 0;
+        while (start < end && (s.data[start] & 0xc0) == 0x80) start++;
+    }
+#endif
+
+    return utf8_find_invalid_scalar(s, start);
+}
+
+// how much of a chunk we can check now, without the start of a character that the next chunk finishes
+u64 utf8_complete_count(String s) {
+    u64 lead = s.count;
+    for (u64 k = 0; k < 3 && lead > 0 && (s.data[lead - 1] & 0xc0) == 0x80; k++) lead--;
+    if (lead == 0) return s.count;
+    lead--;
+    return lead + utf8_sequence_count(s.data[lead]) > s.count ? lead : s.count;
+}
+
+// note: everything before the byte should be valid, or this is off
+u64 utf8_count_characters(String s) {
+    u64 count = 0;
+    for (u64 i = 0; i < s.count; i++) count += (s.data[i] & 0xc0) != 0x80;
+    return count;
+}
+
+// the code point that starts at s.data[*i], and moves *i past it
+// note: expects valid UTF-8 (which a loaded story is), a cut character at the end gives what it has
+u32 utf8_decode(String s, u64* i) {
+
+    u8  lead  = s.data[*i];
+    u64 count = utf8_sequence_count(lead);
+    u32 c     = count == 1 ? lead : lead & (0x7f >> count);
+
+    (*i)++;
+    for (u64 k = 1; k < count && *i < s.count; k++, (*i)++) c = (c << 6) | (s.data[*i] & 0x3f);
+
+    return c;
+}
+
+// columns a code point takes in a terminal: 2 for the wide and fullwidth East Asian ones, 0 for combining marks and controls
+// note: a short list of ranges in the spirit of wcwidth(), which depends on the locale and is not in C99
+u64 utf8_display_width(u32 c) {
+
+    if (c < 0x20 || (c >= 0x7f && c < 0xa0))                     return 0;
+    if (c >= 0x0300 && c <= 0x036f)                              return 0; // combining diacritics
+    if (c >= 0x200b && c <= 0x200f)                              return 0; // zero width space and joiners
+    if (c >= 0xfe00 && c <= 0xfe0f)                              return 0; // variation selectors
+
+    if ((c >= 0x1100  && c <= 0x115f)  ||                                  // hangul jamo
+        (c >= 0x2e80  && c <= 0xa4cf && c != 0x303f) ||                    // CJK radicals to yi
+        (c >= 0xac00  && c <= 0xd7a3)  ||                                  // hangul syllables
+        (c >= 0xf900  && c <= 0xfaff)  ||                                  // CJK compatibility ideographs
+        (c >= 0xfe30  && c <= 0xfe4f)  ||                                  // CJK compatibility forms
+        (c >= 0xff00  && c <= 0xff60)  ||                                  // fullwidth forms
+        (c >= 0xffe0  && c <= 0xffe6)  ||
+        (c >= 0x1f300 && c <= 0x1f64f) ||                                  // emoji
+        (c >= 0x1f900 && c <= 0x1f9ff) ||
+        (c >= 0x20000 && c <= 0x3fffd))                          return 2;
+
+    return 1;
+}
+
+
+
+
+/* ==== Line Index ==== */
+
+/*
+    Where each line of a file starts, built once when the file is loaded, so any offset in the file
+    (or any String view into it) can be turned into its line, and the start of that line, with a binary search,
+    and the parsers don't have to count lines as they go.
+*/
+
+typedef struct {
+    u64* starts;     // starts[i] is the offset of line dropped + i + 1, so starts[0] is 0 if we dropped none
+    u64  count;
+    u64  allocated;
+    u64  dropped;    // lines we forgot, only for a stream, see line_index_drop()
+} LineIndex;
+
+void line_index_reserve(LineIndex* index, u64 wanted) {
+    if (wanted <= index->allocated) return;
+    while (index->allocated < wanted) index->allocated = index->allocated ? index->allocated * 2 : 256;
+    index->starts = memory_realloc(memory_lines, index->starts, index->allocated * sizeof(u64));
+    if (!index->starts) hard_error("Cannot allocate memory for the line index.\n");
+}
+
+// adds the lines that start in data, which is at offset in the file
+void line_index_scan(LineIndex* index, String data, u64 offset) {
+    
+    u64 i = 0;
+
+#if defined(__SSE2__) && defined(__GNUC__)
+    // 16 bytes at a time, then one bit per '\n' in the mask
+    __m128i newline = _mm_set1_epi8('\n');
+    for (; i + 16 <= data.count; i += 16) {
+        
+        u32 mask = (u32) _mm_movemask_epi8(_mm_cmpeq_epi8(_mm_loadu_si128((__m128i*) (data.data + i)), newline));
+        if (!mask) continue;
+        
+        line_index_reserve(index, index->count + 16);
+        while (mask) {
+            index->starts[index->count++] = offset + i + __builtin_ctz(mask) + 1;
+            mask &= mask - 1;
+        }
+    }
+#endif
+    
+    for (; i < data.count; i++) {
+        if (data.data[i] != '\n') continue;
+        line_index_reserve(index, index->count + 1);
+        index->starts[index->count++] = offset + i + 1;
+    }
+}
+
+LineIndex line_index_build(String data) {
+    LineIndex index = {0};
+    line_index_reserve(&index, data.count / 32 + 1);
+    index.starts[index.count++] = 0;
+    line_index_scan(&index, data, 0);
+    return index;
+}
+
+// for a file we don't keep in memory, this reads it once in chunks, and leaves it at the start,
+// as it's the one pass over the file before we scan it, it also gives what utf8_find_invalid() would in invalid_out
+LineIndex line_index_build_from_stream(FILE* f, u64* invalid_out) {
+    
+    LineIndex index = {0};
+    line_index_reserve(&index, 1);
+    index.starts[index.count++] = 0;
+    
+    fseek(f, 0, SEEK_SET);
+    
+    *invalid_out = (u64) -1;
+    
+    // a character can be cut by the end of a chunk, so the bytes of it we have go to the front of the next one
+    u8  chunk[4 + 65536];
+    u64 carried = 0;
+    u64 offset  = 0;
+    while (1) {
+        u64 count = fread(chunk + carried, 1, sizeof(chunk) - 4, f);
+        if (!count) break;
+        line_index_scan(&index, (String) { chunk + carried, count }, offset);
+        
+        String all = { chunk, carried + count };
+        if (*invalid_out == (u64) -1) {
+            u64 complete = utf8_complete_count(all);
+            u64 invalid  = utf8_find_invalid((String) { chunk, complete });
+            if (invalid != (u64) -1) *invalid_out = offset - carried + invalid;
+            carried = invalid == (u64) -1 ? all.count - complete : 0;
+            memmove(chunk, chunk + complete, carried);
+        }
+        
+        offset += count;
+    }
+    
+    // a character cut by the end of the file
+    if (carried && *invalid_out == (u64) -1) *invalid_out = offset - carried;
+    
+    fseek(f, 0, SEEK_SET);
+    return index;
+}
+
+void line_index_free(LineIndex* index) {
+    memory_free(index->starts);
+    *index = (LineIndex) {0};
+}
+
+// from 1, the line that has the byte at offset
+u64 line_index_get_line(LineIndex* index, u64 offset) {
+    
+    // the last start that is <= offset
+    u64 low  = 0;
+    u64 high = index->count;
+    while (high - low > 1) {
+        u64 middle = low + (high - low) / 2;
+        if (index->starts[middle] <= offset) low  = middle;
+        else                                 high = middle;
+    }
+    
+    return index->dropped + low + 1;
+}
+
+// the offset of the line that has the byte at offset
+u64 line_index_get_line_start(LineIndex* index, u64 offset) {
+    return index->starts[line_index_get_line(index, offset) - 1 - index->dropped];
+}
+
+// for input we read once and don't keep, this forgets the lines before the one at offset, the rest keep their numbers
+void line_index_drop(LineIndex* index, u64 offset) {
+    u64 count = line_index_get_line(index, offset) - 1 - index->dropped;
+    memmove(index->starts, index->starts + count, (index->count - count) * sizeof(u64));
+    index->count   -= count;
+    index->dropped += count;
+}
@@ -0,0 +1,121 @@
+/* ==== Trace ==== */
+
+/*
+    Scoped timers for the slow parts (loading, each parse phase, table resizes, exports, the run loop),
+    written as Chrome trace events with --trace out.json, open it in chrome://tracing or ui.perfetto.dev.
+
+        TraceSpan span = trace_begin("parse_scenes");
+        ...
+        trace_end(span);
+
+    Spans can nest and can be on any thread. With tracing off, begin and end are a branch each,
+    so they can stay in the code, but keep them out of per-line loops anyway.
+
+    note: names are not escaped, so they have to be string literals without quotes
+*/
+
+typedef struct {
+    char* name;   // NULL when tracing is off
+    f64   start;
+} TraceSpan;
+
+typedef struct {
+    char* name;
+    f64   start;
+    f64   end;
+    u64   thread;
+} TraceEvent;
+
+typedef struct {
+    u8          enabled;
+    char*       path;
+    f64         origin;
+    TraceEvent* events;
+    u64         count;
+    u64         allocated;
+    Mutex       lock;
+} Trace;
+
+Trace trace;
+
+TraceSpan trace_begin(char* name) {
+    if (!trace.enabled) return (TraceSpan) {0};
+    return (TraceSpan) { name, get_time() };
+}
+
+void trace_end(TraceSpan span) {
+
+    if (!span.name) return;
+
+    TraceEvent event = { span.name, span.start, get_time(), get_thread_id() };
+
+    mutex_lock(&trace.lock);
+
+    if (trace.count == trace.allocated) {
+        u64 wanted = trace.allocated ? trace.allocated * 2 : 1024;
+        TraceEvent* events = realloc(trace.events, wanted * sizeof(TraceEvent));
+        if (events) {
+            trace.events    = events;
+            trace.allocated = wanted;
+        }
+    }
+
+    // if we are out of memory we just lose the event, it's only a trace
+    if (trace.count < trace.allocated) trace.events[trace.count++] = event;
+
+    mutex_unlock(&trace.lock);
+}
+
+// threads get small numbers in the order they show up, which is what the viewers like
+u64 trace_thread_number(u64* threads, u64* thread_count, u64 thread) {
+
+    for (u64 i = 0; i < *thread_count; i++) {
+        if (threads[i] == thread) return i + 1;
+    }
+
+    if (*thread_count == 64) return 64; // we never have that many, but just in case
+
+    threads[(*thread_count)++] = thread;
+    return *thread_count;
+}
+
+u8 trace_save(char* path) {
+
+    FILE* f = fopen(path, "wb");
+    if (!f) return 0;
+
+    u64 threads[64];
+    u64 thread_count = 0;
+
+    fprintf(f, "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n");
+
+    for (u64 i = 0; i < trace.count; i++) {
+
+        TraceEvent* it = &trace.events[i];
+
+        fprintf(
+            f, "{\"name\": \"%s\", \"ph\": \"X\", \"pid\": 1, \"tid\": %llu, \"ts\": %.3f, \"dur\": %.3f}%s\n",
+            it->name, trace_thread_number(threads, &thread_count, it->thread),
+            (it->start - trace.origin) * 1e6, (it->end - it->start) * 1e6,
+            i + 1 < trace.count ? "," : ""
+        );
+    }
+
+    fprintf(f, "]}\n");
+
+    u8 ok = !ferror(f);
+    return fclose(f) == 0 && ok;
+}
+
+// runs at exit, so we also get a trace when something fails with hard_error()
+void trace_save_at_exit() {
+    if (!trace_save(trace.path)) fprintf(stderr, "Cannot write the trace to \"%s\".\n", trace.path);
+}
+
+void trace_enable(char* path) {
+    mutex_init(&trace.lock);
+    trace.enabled = 1;
+    trace.path    = path;
+    trace.origin  = get_time();
+    atexit(trace_save_at_exit);
+}
@@ -2,14 +2,49 @@
 
 #define max_language_count 8
 
+typedef u8 LanguageMask; // bit n for language n, so it needs to have max_language_count bits
+
+#define max_variable_count 64
+
+// see the Script section in script.c
+typedef struct {
+    u8  op;
+    u8  dst;     // registers
+    u8  a;
+    u8  b;
+    s32 value;   // a constant or a variable slot
+} Instruction;
+
+// a text with placeholders is split into these, see the Templates section in script.c
+typedef struct {
+    String literal;    // the text before the placeholder
+    s32    variable;   // what goes after it, -1 if this is the last segment of the text
+} TextSegment;
+
 typedef struct {
-    String link;
-    String text[max_language_count];
+    String       link;
+    u64          link_index;  // slot of the linked scene in the scene table, resolved while parsing
+    String       text[max_language_count];
+    LanguageMask text_mask;   // which languages have text
+    u16          text_template[max_language_count];  // 1 + where the segments of the text start in scene->segments, 0 if it has no placeholder
+    u16          condition;   // 1 + where it starts in scene->code, 0 if the option is always there
+    u16          effect;      // same, for what runs when it's chosen
 } Option;
 
 typedef struct {
-    String text[max_language_count];
-    Option options[8];
-    u64    option_count;
+    String       text[max_language_count];
+    LanguageMask text_mask;   // which languages have text
+    u16          text_template[max_language_count];  // same as in Option
+    Option       options[8];
+    u64          option_count;
+    Instruction* code;        // the conditions and effects of the options, NULL if none of them have any
+    u64          code_count;
+    TextSegment* segments;    // of every text with a placeholder, NULL if none of them have any
+    u64          segment_count;
+    String       source;      // the scene body in the file, see parse_scene()
+    u64          file;        // index in story->files, 0 is the file with the header
+    u64          offset;      // of the source in the file
+    u64          line;        // line of the label, 0 if the label is not defined
+    u8           parsed;
 } Scene;
 
@@ -0,0 +1,224 @@
+/* ==== Writer ==== */
+
+/*
+    Output for the exporters. Most of what they write is a String view into the story file,
+    so with writer_gather, the writer doesn't copy them: it keeps a list of (pointer, count) segments,
+    and gives the whole list to write_segments() (writev() on Linux) when the list or the scratch buffer is full.
+    The bytes we make ourselves (numbers, escapes, short pieces) go to the scratch buffer, and a segment points there.
+    
+    writer_stdio writes everything through a FILE* right away, which is how the exporters used to write,
+    we keep it for the platforms without writev() and to compare in "story bench-export".
+    
+    note: a view must stay valid until the next flush, which is true for the story file and for string literals
+*/
+
+#define writer_segment_capacity 1024
+#define writer_scratch_capacity (64 * 1024)
+#define writer_copy_below       32     // shorter views are copied, a segment for each of them costs more than the copy
+
+typedef enum {
+    writer_gather,
+    writer_stdio,
+} WriterBackend;
+
+typedef struct {
+    FILE*         file;
+    WriterBackend backend;
+    String*       segments;       // pending, in order
+    u64           segment_count;
+    u8*           scratch;
+    u64           scratch_count;
+    u64           written;        // bytes, pending ones included
+    u64           call_count;     // write calls with writer_gather, for the benchmark
+    u8            failed;
+} Writer;
+
+u8 writer_open(Writer* w, char* path, WriterBackend backend) {
+    
+    *w = (Writer) { .backend = backend };
+    
+    w->file = fopen(path, "wb");
+    if (!w->file) return 0;
+    
+    if (backend == writer_gather) {
+        w->segments = memory_alloc(memory_export, writer_segment_capacity * sizeof(String));
+        w->scratch  = memory_alloc(memory_export, writer_scratch_capacity);
+        if (!w->segments || !w->scratch) {
+            fclose(w->file);
+            return 0;
+        }
+    }
+    
+    return 1;
+}
+
+void writer_flush(Writer* w) {
+    
+    if (w->backend == writer_gather) {
+        if (!w->failed && !write_segments(w->file, w->segments, w->segment_count, &w->call_count)) w->failed = 1;
+        w->segment_count = 0;
+        w->scratch_count = 0;
+    }
+}
+
+// gives 1 if everything is written
+u8 writer_close(Writer* w) {
+    
+    writer_flush(w);
+    if (fclose(w->file) != 0) w->failed = 1;
+    
+    memory_free(w->segments);
+    memory_free(w->scratch);
+    
+    return !w->failed;
+}
+
+// s is copied, so it can be anything
+void writer_copy(Writer* w, String s) {
+    
+    w->written += s.count;
+    
+    if (w->backend == writer_stdio) {
+        fwrite(s.data, 1, s.count, w->file);
+        return;
+    }
+    
+    while (s.count) {
+        
+        if (w->scratch_count == writer_scratch_capacity) writer_flush(w);
+        if (w->segment_count == writer_segment_capacity) writer_flush(w);
+        
+        u64 count = writer_scratch_capacity - w->scratch_count;
+        if (count > s.count) count = s.count;
+        
+        u8* at = w->scratch + w->scratch_count;
+        memcpy(at, s.data, count);
+        w->scratch_count += count;
+        
+        // most copies come right after another one, so they are one segment
+        String* last = w->segment_count ? &w->segments[w->segment_count - 1] : NULL;
+        if (last && last->data + last->count == at) last->count += count;
+        else                                        w->segments[w->segment_count++] = (String) { at, count };
+        
+        s = string_advance(s, count);
+    }
+}
+
+// s is only read at the next flush, see above
+void writer_view(Writer* w, String s) {
+    
+    if (!s.count) return;
+    
+    if (w->backend == writer_stdio || s.count < writer_copy_below) {
+        writer_copy(w, s);
+        return;
+    }
+    
+    if (w->segment_count == writer_segment_capacity) writer_flush(w);
+    
+    w->segments[w->segment_count++] = s;
+    w->written += s.count;
+}
+
+void writer_u8(Writer* w, u8 c) {
+    writer_copy(w, (String) { &c, 1 });
+}
+
+// little endian whatever the machine is, for binary formats
+void writer_u32_le(Writer* w, u32 v) {
+    u8 bytes[4] = { (u8) v, (u8) (v >> 8), (u8) (v >> 16), (u8) (v >> 24) };
+    writer_copy(w, array_string(bytes));
+}
+
+void writer_u64_le(Writer* w, u64 v) {
+    writer_u32_le(w, (u32) v);
+    writer_u32_le(w, (u32) (v >> 32));
+}
+
+// like printf(), for numbers, the result is copied, a long one goes through a buffer of its own
+void writer_printf(Writer* w, char* format, ...) {
+    
+    char buffer[1024];
+    
+    va_list args;
+    va_start(args, format);
+    
+    va_list copy;
+    va_copy(copy, args);
+    int count = vsnprintf(buffer, sizeof(buffer), format, copy);
+    va_end(copy);
+    
+    if (count >= 0 && (u64) count < sizeof(buffer)) {
+        writer_copy(w, (String) { (u8*) buffer, count });
+    } else if (count >= 0) {
+        u8* data = memory_alloc(memory_export, count + 1);
+        if (!data) hard_error("Out of memory when exporting.\n");
+        vsnprintf((char*) data, count + 1, format, args);
+        writer_copy(w, (String) { data, count });
+        memory_free(data);
+    } else {
+        w->failed = 1; // an encoding error, better a failed export than one with a hole in it
+    }
+    
+    va_end(args);
+}
+
+// like file_print(), every "@" is a String that is written as a view, and the pieces of the format too
+void writer_print(Writer* w, String format, ...) {
+    
+    va_list args;
+    va_start(args, format);
+    
+    u64 start = 0;
+    for (u64 i = 0; i < format.count; i++) {
+        
+        if (format.data[i] != '@') continue;
+        
+        writer_view(w, string_view(format, start, i));
+        
+        if (i + 1 < format.count && format.data[i + 1] == '@') { // short circuit 
+            writer_u8(w, '@');
+            i++;
+        } else {
+            writer_view(w, va_arg(args, String)); // not safe, but this is C varargs, what can you do 
+        }
+        
+        start = i + 1;
+    }
+    
+    writer_view(w, string_view(format, start, format.count));
+    
+    va_end(args);
+}
+
+// same output as file_print_quoted_string(), the runs that need no escape are views
+void writer_quoted_string(Writer* w, String s) {
+    
+    writer_u8(w, '"');
+    
+    u64 start = 0;
+    for (u64 i = 0; i < s.count; i++) {
+        
+        u8 c = s.data[i];
+        if (c >= 0x20 && c != '"' && c != '\\') continue;
+        
+        writer_view(w, string_view(s, start, i));
+        start = i + 1;
+        
+        switch (c) {
+            
+            case '"':  writer_copy(w, string("\\\"")); break;
+            case '\\': writer_copy(w, string("\\\\")); break;
+            case '\b': writer_copy(w, string("\\b"));  break;
+            case '\f': writer_copy(w, string("\\f"));  break;
+            case '\n': writer_copy(w, string("\\n"));  break;
+            case '\r': writer_copy(w, string("\\r"));  break;
+            case '\t': writer_copy(w, string("\\t"));  break;
+            
+            default:   writer_printf(w, "\\u%.4x", c); break;
+        }
+    }
+    
+    writer_view(w, string_view(s, start, s.count));
+    writer_u8(w, '"');
+}